@@ -0,0 +1,29 @@
+#!/bin/sh
+# Runs every bench/*.lox on one clox build three ways: interpreted with
+# --no-jit, with the JIT, and compiled ahead of time with --emit-c, the C
+# built against the libloxrt.a next to the clox binary. The times are the ones
+# the scripts print themselves, so the AOT number leaves out the C compiler.
+#
+#   cmake -S . -B out/release -DCMAKE_BUILD_TYPE=Release -DCLOX_DEBUG=OFF
+#   cmake --build out/release
+#   bench/aot.sh out/release/clox
+
+dir=$(dirname "$0")
+clox=$1
+build=$(dirname "$clox")
+cc=${CC:-cc}
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+for script in "$dir"/*.lox; do
+  echo "== $(basename "$script")"
+  for mode in --no-jit jit; do
+    seconds=$("$clox" $([ $mode = jit ] || echo $mode) "$script" | tail -n 1)
+    printf "   %-40s %ss\n" "$mode" "$seconds"
+  done
+  "$clox" --emit-c "$tmp/script.c" "$script" &&
+    $cc -O2 -I "$dir/../include" "$tmp/script.c" "$build/libloxrt.a" -lm -pthread \
+      -o "$tmp/script" &&
+    printf "   %-40s %ss\n" "--emit-c" "$("$tmp/script" | tail -n 1)"
+done
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Runs every bench/*.lox against one or more clox binaries, so two builds can
+# be compared side by side. Each script prints its own clock() time as the
+# last line of output, which is what gets reported here.
+#
+#   cmake -S . -B out/goto   -DCMAKE_BUILD_TYPE=Release -DCLOX_DEBUG=OFF
+#   cmake -S . -B out/switch -DCMAKE_BUILD_TYPE=Release -DCLOX_DEBUG=OFF \
+#         -DCLOX_COMPUTED_GOTO=OFF
+#   cmake --build out/goto && cmake --build out/switch
+#   bench/bench.sh out/goto/clox out/switch/clox
+#
+# Keep CLOX_DEBUG off, otherwise the DEBUG_* tracing swamps the numbers.
+
+dir=$(dirname "$0")
+
+for script in "$dir"/*.lox; do
+  echo "== $(basename "$script")"
+  for clox in "$@"; do
+    seconds=$("$clox" "$script" | tail -n 1)
+    printf "   %-40s %ss\n" "$clox" "$seconds"
+  done
+done
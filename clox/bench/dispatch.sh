@@ -0,0 +1,21 @@
+#!/bin/sh
+# Reports how many instructions run() dispatched for every bench/*.lox, to see
+# how much the peephole superinstructions save. Needs builds with the dispatch
+# counter on, e.g. one with and one without the peephole pass:
+#
+#   cmake -S . -B out/fused   -DCMAKE_BUILD_TYPE=Release -DCLOX_DEBUG=OFF \
+#         -DCLOX_COUNT_DISPATCH=ON
+#   cmake -S . -B out/unfused -DCMAKE_BUILD_TYPE=Release -DCLOX_DEBUG=OFF \
+#         -DCLOX_COUNT_DISPATCH=ON -DCLOX_PEEPHOLE=OFF
+#   cmake --build out/fused && cmake --build out/unfused
+#   bench/dispatch.sh out/unfused/clox out/fused/clox
+
+dir=$(dirname "$0")
+
+for script in "$dir"/*.lox; do
+  echo "== $(basename "$script")"
+  for clox in "$@"; do
+    count=$("$clox" "$script" 2>&1 >/dev/null | grep dispatched)
+    printf "   %-40s %s\n" "$clox" "$count"
+  done
+done
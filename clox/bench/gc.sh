@@ -0,0 +1,27 @@
+#!/bin/sh
+# Runs every bench/*.lox with each collector, clox --gc full, generational,
+# incremental and concurrent, and reports the time the script prints along
+# with the pauses from --gc-stats (count, total, mean and longest per kind of
+# collection, and how they spread out). Anything after the binary is passed
+# on, e.g. a nursery size or a slice budget:
+#
+#   cmake -S . -B out/release -DCMAKE_BUILD_TYPE=Release -DCLOX_DEBUG=OFF
+#   cmake --build out/release
+#   bench/gc.sh out/release/clox --gc-nursery 4096 --gc-budget 500
+
+dir=$(dirname "$0")
+clox=$1
+shift
+
+stats=$(mktemp)
+trap 'rm -f "$stats"' EXIT
+
+for script in "$dir"/*.lox; do
+  echo "== $(basename "$script")"
+  for mode in full generational incremental concurrent; do
+    seconds=$("$clox" --gc $mode --gc-stats "$@" "$script" 2>"$stats" |
+      tail -n 1)
+    printf "   %-40s %ss\n" "--gc $mode" "$seconds"
+    sed -n '2,$s/^/      /p' "$stats"
+  done
+done
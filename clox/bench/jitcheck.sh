@@ -0,0 +1,43 @@
+#!/bin/sh
+# Differential check for the JIT: runs each script once with --no-jit and once
+# with --jit-eager (everything compiled the first time it's called) and fails
+# if stdout, stderr (the runtime error and its stack trace) or the exit code
+# differ.
+# Defaults to every bench/*.lox, whose last line is the time they took, so
+# that line is left out of the comparison for them.
+#
+#   bench/jitcheck.sh out/release/clox [script.lox ...]
+
+dir=$(dirname "$0")
+clox=$1
+shift
+if [ $# -eq 0 ]; then
+  set -- "$dir"/*.lox
+  timed=1
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+for script in "$@"; do
+  for mode in --no-jit --jit-eager; do
+    "$clox" $mode "$script" >"$tmp/out$mode" 2>"$tmp/stderr"
+    echo "exit $?" >"$tmp/err$mode"
+    cat "$tmp/stderr" >>"$tmp/err$mode"
+    if [ -n "$timed" ]; then
+      sed '$d' "$tmp/out$mode" >"$tmp/trimmed" && mv "$tmp/trimmed" "$tmp/out$mode"
+    fi
+  done
+  if cmp -s "$tmp/out--no-jit" "$tmp/out--jit-eager" &&
+     cmp -s "$tmp/err--no-jit" "$tmp/err--jit-eager"; then
+    echo "ok   $(basename "$script")"
+  else
+    echo "FAIL $(basename "$script")"
+    diff "$tmp/out--no-jit" "$tmp/out--jit-eager"
+    diff "$tmp/err--no-jit" "$tmp/err--jit-eager"
+    failed=1
+  fi
+done
+
+exit $failed
@@ -0,0 +1,31 @@
+#!/bin/sh
+# How marking scales with clox --gc-threads: runs bench/graph.lox (64 trees
+# cross-linked to each other, half a million objects that stay alive, and
+# garbage on top to keep collecting them) with 1 to 16 markers and reports
+# the time spent tracing from --gc-stats, with the speedup over 1 thread.
+# Full collections by default, anything after the binary is passed on:
+#
+#   cmake -S . -B out/release -DCMAKE_BUILD_TYPE=Release -DCLOX_DEBUG=OFF
+#   cmake --build out/release
+#   bench/parmark.sh out/release/clox --gc generational
+#
+# The markers are threads of their own, so it takes as many cores to scale.
+
+dir=$(dirname "$0")
+clox=$1
+shift
+
+printf "%-8s %12s %10s %10s %10s\n" threads "tracing ms" speedup stolen seconds
+base=
+for threads in 1 2 4 8 16; do
+  stats=$("$clox" --gc full --gc-threads $threads --gc-stats "$@" \
+    "$dir/graph.lox" 2>&1 >/dev/null | grep '^tracing')
+  seconds=$("$clox" --gc full --gc-threads $threads "$@" "$dir/graph.lox" |
+    tail -n 1)
+  ms=$(echo "$stats" | awk '{print $2}')
+  stolen=$(echo "$stats" | awk '{print $(NF-1)}')
+  base=${base:-$ms}
+  speedup=$(awk -v a="$base" -v b="$ms" 'BEGIN {printf "%.2f", a / b}')
+  printf "%-8s %12s %10s %10s %10s\n" $threads "$ms" "$speedup" "$stolen" \
+    "$seconds"
+done
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Runs every bench/*.lox on one clox binary, once as plain stack code and once
+# with --register, to compare the two kinds of code on the same build. Scripts
+# that use classes or properties mostly stay stack code under --register (see
+# src/regcode.c), so expect those two numbers to match.
+#
+#   cmake -S . -B out/release -DCMAKE_BUILD_TYPE=Release -DCLOX_DEBUG=OFF
+#   cmake --build out/release
+#   bench/register.sh out/release/clox
+
+dir=$(dirname "$0")
+clox=$1
+
+for script in "$dir"/*.lox; do
+  echo "== $(basename "$script")"
+  for mode in "" --register; do
+    seconds=$("$clox" $mode "$script" | tail -n 1)
+    printf "   %-40s %ss\n" "${mode:-stack}" "$seconds"
+  done
+done
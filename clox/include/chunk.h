@@ -33,15 +33,110 @@ typedef enum {
   OP_JUMP_IF_FALSE,
   OP_LOOP,
   OP_CALL,
+  OP_CALL_0, // OP_CALL with the arg count in the opcode, for 0 to 3 args
+  OP_CALL_1,
+  OP_CALL_2,
+  OP_CALL_3,
+  OP_TAIL_CALL, // OP_CALL in a return, the callee takes over the frame
   OP_INVOKE,
   OP_CLOSURE,
   OP_CLOSE_UPVALUE,
   OP_CONSTANT_LONG,
   OP_RETURN, // would late mean return from current function
+  OP_RETURN_NIL,   // nil, return: the implicit return at the end of a function
+  OP_RETURN_LOCAL, // get local a, return: an initializer's implicit return
   OP_CLASS,
   OP_METHOD,
+  OP_INHERIT,      // copies the superclass's methods down into the subclass
+  OP_GET_SUPER,    // name: this, superclass -> bound method
+  OP_SUPER_INVOKE, // name, arg count, cache: this, args, superclass -> result
+  // quickened forms, never emitted by the compiler. The generic instruction
+  // rewrites itself into one of these once it has seen its operand types, and
+  // they turn back into the generic one when the types don't match
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
+  OP_GREATER_NUM,
+  OP_LESS_NUM,
+  // superinstructions, fused out of common sequences by the peephole pass
+  // (see peephole.c) once a function is compiled
+  OP_ADD_LL,        // get local a, get local b, add
+  OP_ADD_LC,        // get local a, constant c, add
+  OP_LESS_LC_JIF,   // get local a, constant c, less, jump if false, pop
+  OP_LESS_LL_JIF,   // get local a, get local b, less, jump if false, pop
+  OP_SET_LOCAL_POP, // set local a, pop
+  OP_POPN,          // n x pop
+  // register form (see regcode.c), only ever run by run_reg(). Operands
+  // named r are frame slots (registers), k constant indexes, g global slots
+  OP_R_MOVE,          // r_dst r_src
+  OP_R_LOADK,         // r_dst k
+  OP_R_NIL,           // r_dst
+  OP_R_TRUE,          // r_dst
+  OP_R_FALSE,         // r_dst
+  OP_R_GET_GLOBAL,    // r_dst g(2 bytes)
+  OP_R_DEFINE_GLOBAL, // r_src g(2 bytes)
+  OP_R_SET_GLOBAL,    // r_src g(2 bytes)
+  OP_R_GET_UPVALUE,   // r_dst upvalue
+  OP_R_SET_UPVALUE,   // r_src upvalue
+  OP_R_EQUAL,         // r_dst r_a r_b, and so on for the other binary ops
+  OP_R_EQUAL_K,       // r_dst r_a k_b, and so on for the other _K forms
+  OP_R_GREATER,
+  OP_R_GREATER_K,
+  OP_R_LESS,
+  OP_R_LESS_K,
+  OP_R_ADD,
+  OP_R_ADD_K,
+  OP_R_SUBTRACT,
+  OP_R_SUBTRACT_K,
+  OP_R_MULTIPLY,
+  OP_R_MULTIPLY_K,
+  OP_R_DIVIDE,
+  OP_R_DIVIDE_K,
+  OP_R_NOT,           // r_dst r_src
+  OP_R_NEGATE,        // r_dst r_src
+  OP_R_PRINT,         // r_src
+  OP_R_JUMP,          // offset(2 bytes)
+  OP_R_JUMP_IF_FALSE, // r_cond offset(2 bytes)
+  OP_R_LOOP,          // offset(2 bytes)
+  OP_R_CALL,          // r_base argCount, callee in r_base, result back in it
+  OP_R_CLOSURE,       // r_dst k, then (isLocal, index) per upvalue
+  OP_R_CLOSE_UPVALUE, // r_slot
+  OP_R_RETURN,        // r_src
 } OpCode;
 // when no value given to any elements in enum, all are assigned int constants
+
+/**
+ * How many receiver shapes a single property access site remembers. Past
+ * that the site is megamorphic and the rest just take the slow path.
+ */
+#define PROPERTY_CACHE_WAYS 4
+
+/**
+ * One remembered receiver shape for a property access site. shape is NULL
+ * while the way is still empty. Since a shape pins down both the class and
+ * every field an instance has, a matching shape is all the checking a hit
+ * needs: a field hit is the field's index in instance->fields, a method hit
+ * is the closure that the name resolved to in klass->methods (the shape has
+ * no field hiding it). An OP_SET_PROPERTY that added the field remembers the
+ * shape the instance moves to as well.
+ */
+typedef struct {
+  ObjShape *shape;
+  int slot;             // index into instance->fields, -1 for methods
+  ObjShape *transition; // shape after adding the field, NULL if it was there
+  ObjClosure *method;   // only for method hits
+} PropertyCacheEntry;
+
+/**
+ * Inline cache for one OP_GET_PROPERTY / OP_SET_PROPERTY / OP_INVOKE, the
+ * instruction carries the index of its cache in chunk->caches as a 2 byte
+ * operand
+ */
+typedef struct {
+  PropertyCacheEntry entries[PROPERTY_CACHE_WAYS];
+} PropertyCache;
 /**
  * Stores bytecode for the entire program (before functions)
  *
@@ -58,6 +153,11 @@ typedef struct {    // a dynamic array wrapper
   int *new_lines; // indexes of bytecode in uint8_t code where new line starts.
                   // Implemented under Chp14, challenge 1's directive
   ValueArray constants; // array of value constants in the chunk
+  int cacheCount;       // no. of inline caches handed out to instructions
+  int cacheCapacity;
+  PropertyCache *caches; // inline caches for the property instructions
+  int maxRegisters; // frame size when code is in register form, 0 if it's
+                    // plain stack code
 } Chunk; // NOTE: count and capcity are the count and capcity of uint8_t code.
 
 /*
@@ -75,5 +175,11 @@ void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 int addConstant(Chunk *chunk, Value value);
+int addCache(Chunk *chunk);
+int instructionLength(Chunk *chunk, int offset);
+int stackEffect(Chunk *chunk, int offset);
+uint16_t readShort(uint8_t *code, int offset);
+int jumpTarget(uint8_t *code, int offset);
+int maxStackDepth(Chunk *chunk, int depth, int *depths);
 
 #endif
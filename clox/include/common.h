@@ -5,12 +5,40 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// CLOX_NO_DEBUG is passed in by cmake -DCLOX_DEBUG=OFF, for benchmark builds
+#ifndef CLOX_NO_DEBUG
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
 
 #define DEBUG_STRESS_GC
 #define DEBUG_LOG_GC
 
+// asserts that run() never pushes past the stack depth the compiler worked
+// out for the function (see maxStackDepth())
+#define DEBUG_CHECK_STACK
+#endif
+
+// threaded dispatch in run() needs GCC/Clang's labels-as-values, so anything
+// else (or cmake -DCLOX_COMPUTED_GOTO=OFF) gets the portable switch instead
+#if defined(__GNUC__) && !defined(CLOX_NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// NAN_BOXING comes from cmake -DCLOX_NAN_BOXING=ON and squeezes every Value
+// into a single 8 byte word instead of the 16 byte tagged struct (see value.h)
+
+// CLOX_NO_PEEPHOLE (cmake -DCLOX_PEEPHOLE=OFF) leaves the compiled chunks as
+// they are, without the superinstructions from peephole.c. DEBUG_COUNT_DISPATCH
+// (cmake -DCLOX_COUNT_DISPATCH=ON) prints how many instructions a script
+// dispatched, to see what the fusing saves
+
+// the template JIT (see jit.c) writes x86-64 machine code for the System V
+// ABI only, so anywhere else (or with cmake -DCLOX_JIT=OFF, which passes
+// CLOX_NO_JIT) everything stays interpreted
+#if defined(__x86_64__) && defined(__linux__) && !defined(CLOX_NO_JIT)
+#define JIT_ENABLED
+#endif
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
-#endif//just ending off with the #ifdef stuffs
\ No newline at end of file
+#endif//just ending off with the #ifdef stuffs
@@ -0,0 +1,10 @@
+#ifndef clox_emitc_h
+#define clox_emitc_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+bool emitC(const char* source, FILE* out);
+
+#endif
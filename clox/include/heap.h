@@ -0,0 +1,73 @@
+#ifndef clox_heap_h
+#define clox_heap_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+#define BLOCK_SIZE (64 * 1024) // and aligned to it, see blockOf()
+#define CELL_GRANULE 16
+#define CELL_MAX 256 // bigger objects are malloc()ed one by one
+#define BLOCK_GRANULES (BLOCK_SIZE / CELL_GRANULE)
+#define BITMAP_WORDS (BLOCK_GRANULES / 64)
+
+/**
+ * Where objects live with clox --gc full and generational: BLOCK_SIZE blocks,
+ * each cut into cells of one size class. Which cells hold an object (live)
+ * and which of those the last collection marked (marks) are bitmaps in the
+ * block's header, not in the objects, so marking writes nothing into them
+ * and sweeping a block only reads its bitmaps and the dead objects. A cell's
+ * bit is the one of the CELL_GRANULE it starts at (see bitOf())
+ * next      -> the next block of the same size class
+ * fresh     -> cells from here on were never handed out
+ * freeList  -> cells that were, and got freed since, linked through their
+ *              first word
+ * sweptAt   -> the collection this block was swept after, it's due for a
+ *              sweep (lazily, see heapAllocate()) while that isn't the last
+ *              one
+ */
+typedef struct Block {
+  struct Block *next;
+  uint32_t cellSize;
+  uint32_t cellCount;
+  uint32_t fresh;
+  uint32_t sweptAt;
+  void *freeList;
+  uint64_t live[BITMAP_WORDS];
+  uint64_t marks[BITMAP_WORDS];
+  _Alignas(CELL_GRANULE) char cells[];
+} Block;
+
+static inline Block* blockOf(Obj* object){
+    return (Block*)((uintptr_t)object & ~(uintptr_t)(BLOCK_SIZE - 1));
+}
+
+// a shift, not a division by the cell size, writeBarrier() gets here
+static inline uint32_t bitOf(Block* block, Obj* object){
+    return (uint32_t)((uintptr_t)((char*)object - block->cells) /
+                      CELL_GRANULE);
+}
+
+/**
+ * Whether the last collection marked object. With clox --gc generational the
+ * marks stay until the next major collection, marked is old
+ */
+static inline bool heapIsMarked(Obj* object){
+    Block* block = blockOf(object);
+    uint32_t bit = bitOf(block, object);
+    return (block->marks[bit / 64] >> (bit % 64)) & 1;
+}
+
+void* heapAllocate(size_t size);
+void heapRelease(Obj* object);
+bool heapMark(Obj* object, bool atomic);
+void heapStartSweep(bool keepMarks);
+void heapFinishSweep();
+void heapSetMarks(bool marked);
+bool heapInUse();
+void heapForEach(void (*visit)(Obj* object));
+void reportHeap(FILE* out);
+void freeHeap();
+
+#endif
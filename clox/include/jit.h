@@ -0,0 +1,44 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+
+#ifdef JIT_ENABLED
+
+#include "object.h"
+#include "vm.h"
+
+/**
+ * A function's machine code, see jit.c
+ * code      -> the machine code, mapped read + execute
+ * size      -> how much of it was mapped
+ * entries   -> bytecode offset -> offset of its machine code, or NO_ENTRY
+ *              where run() can't (or shouldn't) hand the frame over
+ * count     -> no. of bytecode bytes (size of entries)
+ */
+typedef struct JitCode {
+  uint8_t* code;
+  size_t size;
+  uint32_t* entries;
+  int count;
+} JitCode;
+
+#define NO_ENTRY UINT32_MAX
+
+/**
+ * Whether the (compiled) function's machine code can pick up at ip, checked
+ * by run() before it writes its frame back
+ */
+static inline bool jitCanEnter(ObjFunction* function, uint8_t* ip) {
+  JitCode* jit = function->jit;
+  int offset = (int)(ip - function->chunk.code);
+  return offset < jit->count && jit->entries[offset] != NO_ENTRY;
+}
+
+bool jitCompile(ObjFunction* function);
+void jitRun(CallFrame* frame);
+void jitFree(ObjFunction* function);
+
+#endif
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef clox_loxrt_h
+#define clox_loxrt_h
+
+/*
+What the C files written by clox --emit-c (see emitc.c) get to use. They are
+linked against libloxrt, which is all of clox but main.c, so they run on the
+very same vm stack, frames, objects and GC as the interpreter, just with every
+function's bytecode already turned into a C function instead of going through
+run().
+*/
+
+#include <math.h>
+#include <stdio.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+typedef enum {
+  AOT_NUMBER,
+  AOT_STRING,
+  AOT_FUNCTION,
+} AotConstantType;
+
+/**
+ * One entry of a function's constant table, as written out by the emitter.
+ * The loader rebuilds chunk.constants from these in the same order, so the
+ * constant indexes in the generated code still point at the right ones
+ * number   -> AOT_NUMBER
+ * chars    -> AOT_STRING, length bytes (not necessarily '\0' free)
+ * function -> AOT_FUNCTION, index into AotProgram.functions
+ */
+typedef struct {
+  AotConstantType type;
+  double number;
+  const char *chars;
+  int length;
+  int function;
+} AotConstant;
+
+/**
+ * name       -> NULL for the script
+ * maxStack   -> see ObjFunction.maxStack
+ * cacheCount -> no. of inline caches its property instructions use
+ */
+typedef struct {
+  const char *name;
+  int arity;
+  int upvalueCount;
+  int maxStack;
+  int cacheCount;
+  int constantCount;
+  const AotConstant *constants;
+  CompiledFn body;
+} AotFunction;
+
+/**
+ * globals   -> name of every global slot, in slot order, the generated code
+ *              uses the slots the compiler resolved
+ * functions -> functions[0] is the script
+ */
+typedef struct {
+  int globalCount;
+  const char **globals;
+  const AotFunction *functions;
+} AotProgram;
+
+/**
+ * Everything a generated function body needs on entry: its slots, constants
+ * and caches at hand (call() already made room on the stack for its deepest
+ * point). frame and slots have to be reloaded (AOT_RELOAD) after calls, which
+ * can grow (move) both vm.frames and the stack. The frame's back on top by
+ * then
+ */
+#define AOT_ENTER()                                                            \
+  Value *slots = vm.stack + frame->slots;                                      \
+  Value *constants = frame->closure->function->chunk.constants.values;        \
+  PropertyCache *caches = frame->closure->function->chunk.caches;              \
+  (void)constants;                                                             \
+  (void)caches
+
+#define AOT_RELOAD()                                                           \
+  (frame = &vm.frames[vm.frameCount - 1], slots = vm.stack + frame->slots)
+
+/**
+ * The generated code doesn't keep vm.stack_count up to date, it only writes
+ * it (the frame's depth at that point) before anything that can run the GC or
+ * looks at the stack top
+ */
+#define AOT_SYNC(depth) (vm.stack_count = frame->slots + (depth))
+
+#define AOT_FALSEY(value) (IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)))
+
+// loxrt.c
+int aotMain(const AotProgram *program);
+
+// vm.c, the parts of run() the generated code can't do inline. The ones that
+// return bool return false after a runtime error (already reported)
+InterpretResult aotInterpret(ObjFunction *script, size_t stackRoom);
+bool aotCall(int argCount);
+bool aotTailCall(int argCount, bool *reused);
+bool aotInvoke(ObjString *name, int argCount, PropertyCache *cache);
+bool aotSuperInvoke(ObjString *name, int argCount, PropertyCache *cache);
+bool aotGetProperty(ObjString *name, PropertyCache *cache);
+bool aotSetProperty(ObjString *name, PropertyCache *cache);
+void aotConcatenate();
+void aotDefineMethod(ObjString *name);
+bool aotInherit();
+bool aotGetSuper(ObjString *name);
+ObjUpvalue *aotCaptureUpvalue(Value *local);
+void aotCloseUpvalues(Value *last);
+bool aotReturn(CallFrame *frame, Value result);
+bool aotError(const char *format, ...);
+
+#endif
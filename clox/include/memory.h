@@ -1,9 +1,63 @@
 #ifndef clox_memory_h
 #define clox_memory_h
 
+#include <stdio.h>
+
 #include "common.h"
+#include "heap.h"
 #include "object.h"
 
+/**
+ * GC_FULL         -> every collection marks the whole heap, with the objects
+ *                    in heap.c's blocks and their mark bits on the side.
+ *                    Sweeping is lazy, a block at a time as the program
+ *                    needs cells again
+ * GC_GENERATIONAL -> objects start out young, most collections (minor ones)
+ *                    only trace what was allocated since the last one, and
+ *                    whatever survives is old from then on. A major
+ *                    collection does the whole heap once the old objects
+ *                    outgrow vm.nextMajorGC. In the same blocks as full,
+ *                    where a mark that stays is what makes an object old
+ * GC_INCREMENTAL  -> the whole heap, but in slices of at most vm.gcBudget
+ *                    objects each, with the program running in between
+ * GC_CONCURRENT   -> the whole heap, marked and swept on a thread of its own
+ *                    while the program keeps running, which only stops for
+ *                    the roots at either end of marking
+ */
+typedef enum {
+    GC_FULL,
+    GC_GENERATIONAL,
+    GC_INCREMENTAL,
+    GC_CONCURRENT,
+} GcMode;
+
+/**
+ * Where an incremental or concurrent collection is at (always GC_PHASE_IDLE
+ * otherwise)
+ * GC_PHASE_MARK    -> tracing from the gray stack, new objects are black
+ * GC_PHASE_STRINGS -> dropping the unmarked strings from vm.strings
+ * GC_PHASE_SWEEP   -> freeing the unmarked objects on vm.sweeping, new
+ *                     objects are white again
+ */
+typedef enum {
+    GC_PHASE_IDLE,
+    GC_PHASE_MARK,
+    GC_PHASE_STRINGS,
+    GC_PHASE_SWEEP,
+} GcPhase;
+
+/**
+ * Obj.scanState while a concurrent collection marks, who traced the object's
+ * references: the background marker, or the program right before it changed
+ * the object (see snapshotBarrier()). Whoever gets SCAN_BUSY in first does
+ * it, the other one leaves it alone
+ */
+typedef enum {
+    SCAN_NONE,
+    SCAN_BUSY,
+    SCAN_DONE,
+} ScanState;
+
 #define ALLOCATE(type, count) \
     (type*)reallocate(NULL, 0, sizeof(type) * (count))
 
@@ -23,9 +77,64 @@
     reallocate(pointer, sizeof(type)*(oldCount), 0)
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void* allocateObjectMemory(size_t size);
 void markObject(Obj* object);
 void markValue(Value value);
 void collectGarbage();
+void freeObject(Obj* object);
 void freeObjects();
+void rememberObject(Obj* object);
+void writeBarrierSlow(Obj* object, Obj* value);
+void snapshotObject(Obj* object);
+void setGcMode(GcMode mode);
+void reportGcStats(FILE* out);
+
+/**
+ * Whether the last collection marked object (generational: whether it's
+ * old), wherever its mark bit is. Relaxed, the concurrent collector's thread
+ * sets and clears the ones in the headers meanwhile
+ */
+static inline bool isMarkedObject(Obj* object){
+    return object->inBlock
+               ? heapIsMarked(object)
+               : __atomic_load_n(&object->isMarked, __ATOMIC_RELAXED);
+}
+
+/**
+ * Every store of a reference into an object on the heap (a field, a closed
+ * upvalue, a closure's upvalues, a class's methods, ...) has to come through
+ * here right after, the ones a constructor does included. A marked object
+ * getting an unmarked one is
+ *  - generational: an old object pointing at a young one, which the next
+ *    minor collection has to know about
+ *  - incremental, while marking: a black (or gray) object pointing at a white
+ *    one, which the marker might never get to otherwise
+ * Stores into the stack, globals and anything else that's a root don't need
+ * it
+ */
+static inline void writeBarrier(Obj* object, Value value){
+    if(isMarkedObject(object) && IS_OBJ(value) &&
+       !isMarkedObject(AS_OBJ(value))){
+        writeBarrierSlow(object, AS_OBJ(value));
+    }
+}
+
+extern bool concurrentMarking; // the background marker is running
+
+/**
+ * The other half for the concurrent collector, which marks what was
+ * reachable when it started (snapshot at the beginning): anything that's
+ * about to change an object on the heap (store into it, grow one of its
+ * tables or arrays) calls this first. Until the marker got to the object,
+ * the program traces the object's references itself, so the marker never
+ * looks at an object that's changing, and what was in it at the start gets
+ * marked even once it's overwritten
+ */
+static inline void snapshotBarrier(Obj* object){
+    if(concurrentMarking &&
+       __atomic_load_n(&object->scanState, __ATOMIC_ACQUIRE) != SCAN_DONE){
+        snapshotObject(object);
+    }
+}
 
 #endif
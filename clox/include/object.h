@@ -14,6 +14,7 @@
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_SHAPE(value) isObjType(value, OBJ_SHAPE)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
@@ -22,6 +23,7 @@
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative *)AS_OBJ(value))->function)
+#define AS_SHAPE(value) ((ObjShape *)AS_OBJ(value))
 #define AS_STRING(value)                                                       \
   ((ObjString *)AS_OBJ(value)) // returns pointer to ObjString type
 #define AS_CSTRING(value)                                                      \
@@ -34,6 +36,7 @@ typedef enum {
   OBJ_FUNCTION,
   OBJ_INSTANCE,
   OBJ_NATIVE,
+  OBJ_SHAPE,
   OBJ_STRING,
   OBJ_UPVALUE,
 } ObjType;
@@ -41,9 +44,23 @@ typedef enum {
 struct Obj {
   ObjType type;
   bool isMarked;
+  bool isRemembered; // in vm.remembered, see rememberObject()
+  uint8_t scanState; // a ScanState, see snapshotBarrier()
+  bool inBlock; // in a heap.c block, see allocateObjectMemory()
   struct Obj *next;
 };
 
+struct CallFrame;
+
+/**
+ * Body of a function that clox --emit-c turned into C (see emitc.c), runs the
+ * frame the function was just called in up to and including its return, or
+ * up to a tail call that takes the frame over
+ *
+ * @return bool false after a runtime error
+ */
+typedef bool (*CompiledFn)(struct CallFrame *frame);
+
 /**
  * NOTE:Functions are first class in Lox, ie they can be called
  * passed as arguments, created dynamically (no need top lvl declar
@@ -55,6 +72,11 @@ typedef struct {
   int upvalueCount;
   Chunk chunk;
   ObjString *name;
+  struct JitCode *jit; // machine code once it's hot (see jit.c), else NULL
+  uint32_t hotness;    // calls + loop iterations so far, to tell when it is
+  CompiledFn compiled; // its C body in a program from clox --emit-c, else NULL
+  int maxStack; // deepest its stack gets, reserved by call() up front
+  int opStatsIndex; // its row in the --opstats report, -1 until it first runs
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argCount, Value *args);
@@ -82,7 +104,7 @@ typedef struct ObjUpvalue {
   struct ObjUpvalue *next;
 } ObjUpvalue;
 
-typedef struct {
+struct ObjClosure {
   Obj obj;
   ObjFunction *function;
   ObjUpvalue *
@@ -90,18 +112,58 @@ typedef struct {
                  // closures pointing at the same ObjUpvalue in the memory so
                  // everyone's updated if it's Value ever changes
   int upvalueCount;
-} ObjClosure;
+};
 
-typedef struct {
+/**
+ * Past this many fields an instance stops following shapes and keeps its
+ * fields in a hash table of its own instead (dictionary mode), so a class
+ * that gets all sorts of fields thrown at it doesn't grow a huge shape tree
+ */
+#define SHAPE_MAX_FIELDS 32
+
+/**
+ * A shape (hidden class) is the list of field names an instance has, in the
+ * order they got added. Instances of a class that add the same fields in the
+ * same order share one shape, and the shape is what knows at which index of
+ * instance->fields each name lives. Adding a field moves the instance over to
+ * a child shape, and those transitions are remembered so everyone that adds
+ * the same field next ends up on the same child.
+ *
+ * Every class has its own root shape (no fields), so the shape also tells
+ * which class an instance belongs to. Lox can't delete fields, so the shapes
+ * only ever grow.
+ */
+struct ObjShape {
+  Obj obj;
+  ObjClass *klass;         // class whose instances use this shape
+  struct ObjShape *parent; // shape before the last field got added
+  ObjString **keys;        // field names, keys[i] lives in instance->fields[i]
+  int fieldCount;          // no. of keys
+  Table transitions;       // field name -> child shape with that field added
+};
+
+struct ObjClass {
   Obj obj;
   ObjString *name;
   Table methods;
-} ObjClass;
+  ObjShape *rootShape;       // shape of a freshly made instance
+  ObjClosure *initializer;   // methods' "init", NULL if it has none
+  int fieldHint;             // most fields an instance has needed so far, what
+                             // a new one gets room for right away
+};
 
+/**
+ * Field values live in a side array indexed by the shape. When an instance
+ * goes over SHAPE_MAX_FIELDS it drops its shape (shape = NULL) and moves all
+ * of its fields into its own dictionary table.
+ */
 typedef struct {
   Obj obj;
   ObjClass *klass;
-  Table fields;
+  ObjShape *shape;   // NULL in dictionary mode
+  Value *fields;     // field values, in the shape's key order
+  int fieldCapacity; // slots allocated in fields
+  Table *dictionary; // name -> value, only in dictionary mode
 } ObjInstance;
 
 typedef struct {
@@ -116,6 +178,11 @@ ObjClosure *newClosure(ObjFunction *function);
 ObjFunction *newFunction();
 ObjInstance *newInstance(ObjClass *klass);
 ObjNative *newNative(NativeFn function);
+ObjShape *newShape(ObjClass *klass);
+ObjShape *shapeAddField(ObjShape *shape, ObjString *key);
+int shapeFindSlot(ObjShape *shape, ObjString *key);
+bool instanceGetField(ObjInstance *instance, ObjString *name, Value *value);
+void instanceSetField(ObjInstance *instance, ObjString *name, Value value);
 ObjString *takeString(char *chars, int length);
 
 ObjString *copyString(const char *chars, int length);
@@ -0,0 +1,14 @@
+#ifndef clox_opstats_h
+#define clox_opstats_h
+
+#include <stdio.h>
+
+#include "object.h"
+
+void initOpStats();
+void recordOp(ObjFunction* function, uint8_t instruction);
+void reportOpStats(FILE* out);
+bool writeOpStatsJson(const char* path);
+void freeOpStats();
+
+#endif
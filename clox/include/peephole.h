@@ -0,0 +1,8 @@
+#ifndef clox_peephole_h
+#define clox_peephole_h
+
+#include "chunk.h"
+
+void optimizeChunk(Chunk* chunk);
+
+#endif
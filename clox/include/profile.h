@@ -0,0 +1,15 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+bool startProfiler();
+void stopProfiler();
+void drainProfile();
+void reportProfile(FILE* out);
+bool writeFoldedStacks(const char* path);
+void freeProfile();
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef clox_regcode_h
+#define clox_regcode_h
+
+#include "chunk.h"
+
+bool translateChunk(Chunk* chunk, int arity);
+
+#endif
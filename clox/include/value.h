@@ -7,12 +7,77 @@
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct ObjClass ObjClass;
+typedef struct ObjClosure ObjClosure;
+typedef struct ObjShape ObjShape;
+
+#ifdef NAN_BOXING
+/*
+NaN boxing: every Value is a single 64 bit word. Numbers are stored as the plain
+double. Everything else hides inside the unused bits of a quiet NaN:
+
+    sign bit | 11 exponent bits | quiet bit + 1 | 50 payload bits
+       0          all 1s             1 1            tag (nil/false/true/empty)
+       1          all 1s             1 1            Obj* (48 bits is plenty)
+
+A real NaN produced by arithmetic never has all of those bits set, so it still
+reads back as a number.
+*/
+#include <string.h>
+
+typedef uint64_t Value;
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL   1 // 01.
+#define TAG_FALSE 2 // 10.
+#define TAG_TRUE  3 // 11.
+#define TAG_EMPTY 4 // 100, never seen by lox code (see EMPTY_VAL)
+
+//to check what the lox type is
+#define IS_BOOL(value)   (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)    ((value) == NIL_VAL)
+#define IS_EMPTY(value)  ((value) == EMPTY_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_OBJ(value)    (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+//turns lox type to C types
+#define AS_OBJ(value)    ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+#define AS_BOOL(value)   ((value) == TRUE_VAL)
+#define AS_NUMBER(value) valueToNum(value)
+
+//turns C types into lox types
+#define FALSE_VAL         ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL          ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define BOOL_VAL(b)       ((b) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL           ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define EMPTY_VAL         ((Value)(uint64_t)(QNAN | TAG_EMPTY))
+#define NUMBER_VAL(num)   numToValue(num)
+#define OBJ_VAL(obj)      (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+// memcpy is how you type pun in C without upsetting strict aliasing, the
+// compiler turns it into a plain register move
+static inline double valueToNum(Value value){
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+static inline Value numToValue(double num){
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
 
 typedef enum{
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
-    VAL_OBJ
+    VAL_OBJ,
+    VAL_EMPTY //never seen by lox code (see EMPTY_VAL)
 }ValueType;
 
 typedef struct{
@@ -27,6 +92,7 @@ typedef struct{
 //to check what the lox type is
 #define IS_BOOL(value)   ((value).type == VAL_BOOL)
 #define IS_NIL(value)    ((value).type == VAL_NIL)
+#define IS_EMPTY(value)  ((value).type == VAL_EMPTY)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)    ((value).type == VAL_OBJ)
 
@@ -40,6 +106,12 @@ typedef struct{
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}}) 
 #define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
+#define EMPTY_VAL         ((Value){VAL_EMPTY, {.number = 0}})
+
+#endif
+
+//EMPTY_VAL is what a global variable's slot holds until the variable gets
+//defined, so the vm can still tell "undefined variable" apart from nil
 
 typedef struct{//dynamic array to store values (data after output)
     int capacity;
@@ -2,15 +2,23 @@
 #define clox_vm_h
 
 #include "chunk.h"
+#include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
 #define INIT_STACK 256
-#define FRAMES_MAX 64
+#define INIT_FRAMES 64
+// vm.frames grows as deep as the recursion goes, this only turns runaway
+// recursion into "Stack Overflow." before it takes all the memory there is
+#define FRAMES_MAX (1 << 22)
 #define STACK_MAX (FRAME_MAX * UINT8_COUNT)
+#define JIT_THRESHOLD 1000 // calls + loop iterations before a function's JITed
+#define GC_NURSERY (256 * 1024) // bytes between minor collections, by default
+#define GC_BUDGET 1000 // objects per slice of an incremental collection
+#define GC_THREADS_MAX 64 // clox --gc-threads, the program's thread included
 
-typedef struct {
+typedef struct CallFrame {
   ObjClosure *closure;
   uint8_t *ip;
   int slots;
@@ -18,21 +26,65 @@ typedef struct {
 
 /**
  * This is where the entire data from source code gets evaluated
+ * frames -> one per active call, grown (moved) by call() when it's full, so
+ *           anything holding a CallFrame* across a call has to look it up
+ *           again after
+ * frameCapacity -> no. of frames that fit before it has to grow
  * Chunk stores the bytecodes from compiler
  * ip points to any one memory point in chunk->code, for bytecode execution
  * stack_size -> capacite of the vm stack
  * stack_count -> current count of bytecode in the stack
- * globals -> hashtable with all the globals
+ * globalValues -> every global variable's value, indexed by the slot the
+ *                 compiler resolved it to (EMPTY_VAL while undefined)
+ * globalNames -> name of each slot, for error messages and the disassembler
+ * globalSlots -> name -> NUMBER_VAL(slot), so the compiler and natives can
+ *                find the slot of a name
+ * registerMode -> compile functions to register code where possible
+ *                (clox --register), see regcode.c
+ * jitEnabled -> whether hot functions get compiled to machine code (off with
+ *              clox --no-jit)
+ * jitThreshold -> how hot is hot, see ObjFunction.hotness (1 with
+ *                 clox --jit-eager)
+ * opStats -> count every instruction run() and run_reg() dispatch
+ *            (clox --opstats), see opstats.c
  * strings -> hashtable with all the OBJ_STRINGs
  * object -> head of the obj list for GC
+ * gcMode -> GC_GENERATIONAL unless clox --gc full, see collectGarbage()
+ * youngObjects -> (generational) everything allocated since the last
+ *                 collection, objects only has the old ones
+ * nurserySize -> (generational) bytes allocated between minor collections
+ *                (clox --gc-nursery)
+ * oldBytes -> (generational) what was left after the last collection
+ * nextMajorGC -> (generational) how big oldBytes gets before the next
+ *                collection is a major one
+ * remembered -> (generational) old objects that were given a reference to a
+ *               young one since the last collection (see writeBarrier()), a
+ *               minor collection traces from them as if they were roots
+ * gcPhase -> (incremental, concurrent) how far the collection in
+ *           progress got
+ * gcBudget -> (incremental) objects a slice marks or sweeps, (concurrent)
+ *             strings a slice drops (clox --gc-budget)
+ * sweeping -> (incremental, concurrent) what's left to sweep, objects only
+ *             has what was swept already and what got allocated since
+ * stringCursor -> (incremental, concurrent) next entry of vm.strings to
+ *                 look at, while it has stringCapacity entries
+ * gcThreads -> (full, generational) threads marking a full or major
+ *              collection, 1 unless clox --gc-threads
  */
 typedef struct {
-  CallFrame frames[FRAMES_MAX];
+  CallFrame *frames;
   int frameCount;
+  int frameCapacity;
   int stack_size;
   int stack_count;
   Value *stack;
-  Table globals;
+  ValueArray globalValues;
+  ValueArray globalNames;
+  Table globalSlots;
+  bool registerMode;
+  bool jitEnabled;
+  uint32_t jitThreshold;
+  bool opStats;
   Table strings;
   ObjString *initString;
   ObjUpvalue
@@ -44,6 +96,20 @@ typedef struct {
   int grayCount;
   int grayCapacity;
   Obj **grayStack;
+  GcMode gcMode;
+  Obj *youngObjects;
+  size_t nurserySize;
+  size_t oldBytes;
+  size_t nextMajorGC;
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj **remembered;
+  GcPhase gcPhase;
+  int gcBudget;
+  Obj *sweeping;
+  int stringCursor;
+  int stringCapacity;
+  int gcThreads;
 } VM;
 
 /**
@@ -53,6 +119,7 @@ typedef enum {
   INTERPRET_OK,
   INTERPRET_COMPILE_ERROR,
   INTERPRET_RUNTIME_ERROR,
+  INTERPRET_SWITCH, // internal to vm.c: the top frame needs the other loop
 } InterpretResult;
 
 extern VM vm;
@@ -60,6 +127,8 @@ extern VM vm;
 void initVM();
 void freeVM();
 InterpretResult interpret(const char *source);
+int globalSlot(ObjString *name);
+void resize_vm();
 void push(Value value);
 Value pop();
 
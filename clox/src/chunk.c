@@ -24,6 +24,10 @@ void initChunk(
   chunk->lines = NULL;
   chunk->new_lines = NULL;
   initValueArray(&chunk->constants);
+  chunk->cacheCount = 0;
+  chunk->cacheCapacity = 0;
+  chunk->caches = NULL;
+  chunk->maxRegisters = 0;
 }
 /**
  * Provided with valid chunk location, the byte to be written upon it and the
@@ -87,6 +91,260 @@ int addConstant(Chunk *chunk, Value value) {
   return chunk->constants.count - 1;
 }
 
+/**
+ * Hands out a fresh, empty inline cache for one property instruction and
+ * returns its index in chunk->caches, which the compiler emits as the
+ * instruction's cache operand
+ *
+ * @param chunk
+ *
+ * @return int index of the new cache
+ */
+int addCache(Chunk *chunk) {
+  if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+    int oldCapacity = chunk->cacheCapacity;
+    chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->caches = GROW_ARRAY(PropertyCache, chunk->caches, oldCapacity,
+                               chunk->cacheCapacity);
+  }
+  PropertyCache *cache = &chunk->caches[chunk->cacheCount];
+  for (int i = 0; i < PROPERTY_CACHE_WAYS; i++) {
+    cache->entries[i].shape = NULL;
+    cache->entries[i].slot = -1;
+    cache->entries[i].transition = NULL;
+    cache->entries[i].method = NULL;
+  }
+  return chunk->cacheCount++;
+}
+
+/**
+ * Size in bytes of the instruction at offset, operands included, for the
+ * passes that walk over finished bytecode
+ *
+ * @param chunk
+ * @param offset where the instruction's opcode is
+ *
+ * @return int
+ */
+int instructionLength(Chunk *chunk, int offset) {
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_RETURN_LOCAL:
+  case OP_CLASS:
+  case OP_METHOD:
+  case OP_GET_SUPER:
+  case OP_POPN:
+  case OP_SET_LOCAL_POP:
+  case OP_R_NIL:
+  case OP_R_TRUE:
+  case OP_R_FALSE:
+  case OP_R_PRINT:
+  case OP_R_CLOSE_UPVALUE:
+  case OP_R_RETURN:
+    return 2;
+  case OP_GET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+  case OP_ADD_LL:
+  case OP_ADD_LC:
+  case OP_R_MOVE:
+  case OP_R_LOADK:
+  case OP_R_GET_UPVALUE:
+  case OP_R_SET_UPVALUE:
+  case OP_R_NOT:
+  case OP_R_NEGATE:
+  case OP_R_JUMP:
+  case OP_R_LOOP:
+  case OP_R_CALL:
+    return 3;
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+  case OP_CONSTANT_LONG:
+  case OP_R_GET_GLOBAL:
+  case OP_R_DEFINE_GLOBAL:
+  case OP_R_SET_GLOBAL:
+  case OP_R_EQUAL:
+  case OP_R_EQUAL_K:
+  case OP_R_GREATER:
+  case OP_R_GREATER_K:
+  case OP_R_LESS:
+  case OP_R_LESS_K:
+  case OP_R_ADD:
+  case OP_R_ADD_K:
+  case OP_R_SUBTRACT:
+  case OP_R_SUBTRACT_K:
+  case OP_R_MULTIPLY:
+  case OP_R_MULTIPLY_K:
+  case OP_R_DIVIDE:
+  case OP_R_DIVIDE_K:
+  case OP_R_JUMP_IF_FALSE:
+    return 4;
+  case OP_INVOKE:
+  case OP_SUPER_INVOKE:
+  case OP_LESS_LC_JIF:
+  case OP_LESS_LL_JIF:
+    return 5;
+  case OP_CLOSURE: {
+    ObjFunction *function =
+        AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+    return 2 + 2 * function->upvalueCount;
+  }
+  case OP_R_CLOSURE: {
+    ObjFunction *function =
+        AS_FUNCTION(chunk->constants.values[chunk->code[offset + 2]]);
+    return 3 + 2 * function->upvalueCount;
+  }
+  default:
+    return 1;
+  }
+}
+
+/**
+ * How the (stack code) instruction at offset changes the stack depth when it
+ * falls through to the next one
+ *
+ * @return int
+ */
+int stackEffect(Chunk *chunk, int offset) {
+  uint8_t *code = chunk->code;
+  switch (code[offset]) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_LOCAL:
+  case OP_GET_GLOBAL:
+  case OP_GET_UPVALUE:
+  case OP_CLOSURE:
+  case OP_CLASS:
+  case OP_ADD_LL:
+  case OP_ADD_LC:
+    return 1;
+  case OP_POP:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_PROPERTY:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_ADD_NUM:
+  case OP_ADD_STR:
+  case OP_SUBTRACT_NUM:
+  case OP_MULTIPLY_NUM:
+  case OP_DIVIDE_NUM:
+  case OP_GREATER_NUM:
+  case OP_LESS_NUM:
+  case OP_PRINT:
+  case OP_CLOSE_UPVALUE:
+  case OP_RETURN:
+  case OP_METHOD:
+  case OP_INHERIT:
+  case OP_GET_SUPER:
+  case OP_SET_LOCAL_POP:
+    return -1;
+  case OP_POPN:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+    return -code[offset + 1];
+  case OP_CALL_0:
+  case OP_CALL_1:
+  case OP_CALL_2:
+  case OP_CALL_3:
+    return -(code[offset] - OP_CALL_0);
+  case OP_INVOKE:
+    return -code[offset + 2];
+  case OP_SUPER_INVOKE:
+    return -code[offset + 2] - 1;
+  default:
+    return 0;
+  }
+}
+
+/**
+ * Yanks the 2 byte operand at code[offset], same as READ_SHORT() in the vm
+ */
+uint16_t readShort(uint8_t *code, int offset) {
+  return (uint16_t)(code[offset] << 8 | code[offset + 1]);
+}
+
+/**
+ * Where the jump instruction at offset lands, -1 if it isn't a jump. Counts
+ * the fused compare and jumps the peephole pass makes as jumps too
+ *
+ * @return int
+ */
+int jumpTarget(uint8_t *code, int offset) {
+  switch (code[offset]) {
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+    return offset + 3 + readShort(code, offset + 1);
+  case OP_LOOP:
+    return offset + 3 - readShort(code, offset + 1);
+  case OP_LESS_LC_JIF:
+  case OP_LESS_LL_JIF:
+    return offset + 5 + readShort(code, offset + 3);
+  default:
+    return -1;
+  }
+}
+
+/**
+ * The deepest the stack gets while the chunk's (stack) code runs, starting
+ * at depth (the callee and its args). The compiler gets to every instruction
+ * at the same depth on every path, so one walk over the code sees them all,
+ * as long as forward jumps tell their target its depth: the straight line
+ * depth is off right behind an unconditional jump. Counts what run() pushes
+ * on the slow paths of the fused instructions too
+ *
+ * @param depths NULL, or chunk->count + 1 ints that get the depth in front of
+ *               every instruction, -1 for offsets in the middle of one
+ *
+ * @return int
+ */
+int maxStackDepth(Chunk *chunk, int depth, int *depths) {
+  int *at = depths != NULL ? depths : ALLOCATE(int, chunk->count + 1);
+  for (int i = 0; i <= chunk->count; i++) {
+    at[i] = -1;
+  }
+  int maxDepth = depth;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (at[offset] != -1) {
+      depth = at[offset];
+    } else {
+      at[offset] = depth;
+    }
+    uint8_t op = chunk->code[offset];
+    int target = jumpTarget(chunk->code, offset);
+    // the fused compares push the false the jump target pops
+    bool pushes = op == OP_LESS_LC_JIF || op == OP_LESS_LL_JIF;
+    if (target > offset)
+      at[target] = depth + pushes;
+
+    // the fused adds push both operands when they're strings
+    int deepest = depth + pushes + (op == OP_ADD_LL || op == OP_ADD_LC ? 2 : 0);
+    depth += stackEffect(chunk, offset);
+    deepest = depth > deepest ? depth : deepest;
+    maxDepth = deepest > maxDepth ? deepest : maxDepth;
+  }
+  if (depths == NULL)
+    FREE_ARRAY(int, at, chunk->count + 1);
+  return maxDepth;
+}
+
 /**
  * It's my own addition for OP_CONST_LONG
  * @deprecated
@@ -118,5 +376,6 @@ void freeChunk(Chunk *chunk) {
   FREE_ARRAY(int, chunk->lines, chunk->LineCapacity);
   FREE_ARRAY(int, chunk->new_lines, chunk->LineCapacity);
   freeValueArray(&chunk->constants);
+  FREE_ARRAY(PropertyCache, chunk->caches, chunk->cacheCapacity);
   initChunk(chunk);
 }
@@ -9,7 +9,10 @@
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "peephole.h"
+#include "regcode.h"
 #include "scanner.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -83,10 +86,13 @@ typedef struct Compiler {
   int localCount;
   Upvalue upvalue[UINT8_COUNT];
   int scopeDepth;
+  int lastCall; // offset of the last OP_CALL(_n) emitted, -1 if none yet
+  int lastJumpTarget; // where the last patched jump lands, -1 if none yet
 } Compiler;
 
 typedef struct ClassCompiler {
   struct ClassCompiler *enclosing;
+  bool hasSuperclass; // whether "super" is a local (of the class body's scope)
 } ClassCompiler;
 
 Parser parser;
@@ -256,17 +262,17 @@ static int emitJump(uint8_t instruction) {
 }
 
 /**
- * Just invokes emitByte to return a bytecode that's OP_RETURN
+ * Emits the implicit return, nil or (in an initializer) this, as the one
+ * instruction that returns it
  */
 static void emitReturn() {
   if (current->type == TYPE_INITIALIZER) {
-    emitBytes(OP_GET_LOCAL,
+    emitBytes(OP_RETURN_LOCAL,
               0); // returns the instance which will be on the stack 0 of the
                   // call frame's slot, the call frame will be from init()
   } else {
-    emitByte(OP_NIL);
+    emitByte(OP_RETURN_NIL);
   }
-  emitByte(OP_RETURN);
 }
 
 /**
@@ -278,7 +284,9 @@ static void emitReturn() {
  * @return uint8_t the index where it is stored
  */
 static uint8_t makeConstant(Value value) {
+  snapshotBarrier(&current->function->obj);
   int constant = addConstant(currentChunk(), value);
+  writeBarrier(&current->function->obj, value);
   if (constant > UINT8_MAX) {
     error("Too many constants in one chunk");
     return 0;
@@ -304,6 +312,62 @@ static void patchJump(int offset) {
 
   currentChunk()->code[offset] = (jump >> 8) & 0xff;
   currentChunk()->code[offset + 1] = jump & 0xff;
+  current->lastJumpTarget = currentChunk()->count;
+}
+
+/**
+ * Makes the forward jumps that land on target land one byte further, for when
+ * a byte got slipped in right at target
+ *
+ * @param target
+ *
+ * @return void
+ */
+static void moveJumpsTo(int target) {
+  Chunk *chunk = currentChunk();
+  for (int offset = 0; offset < target;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t *code = chunk->code;
+    if (code[offset] != OP_JUMP && code[offset] != OP_JUMP_IF_FALSE)
+      continue;
+    int jump = (code[offset + 1] << 8 | code[offset + 2]);
+    if (offset + 3 + jump != target)
+      continue;
+    jump++;
+    if (jump > UINT16_MAX) {
+      error("Too much code to jump over");
+    }
+    code[offset + 1] = (jump >> 8) & 0xff;
+    code[offset + 2] = jump & 0xff;
+  }
+}
+
+/**
+ * Emits a 2 byte operand, high byte first (what READ_SHORT() expects)
+ *
+ * @param value
+ *
+ * @return void
+ */
+static void emitShort(uint16_t value) {
+  emitByte((value >> 8) & 0xff);
+  emitByte(value & 0xff);
+}
+
+/**
+ * Gives the property (or invoke) instruction that was just emitted its own
+ * inline cache
+ * and emits the cache's index as a 2 byte operand
+ *
+ * @return void
+ */
+static void emitCache() {
+  snapshotBarrier(&current->function->obj);
+  int cache = addCache(currentChunk());
+  if (cache > UINT16_MAX) {
+    error("Too many property accesses in one function.");
+  }
+  emitShort((uint16_t)cache);
 }
 
 /**
@@ -328,13 +392,17 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
   compiler->type = type;
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
+  compiler->lastCall = -1;
+  compiler->lastJumpTarget = -1;
   compiler->function =
       newFunction(); // making the function null only to assign stuff to it
                      // immediatly after is for garbage collection apprantly
   current = compiler;
   if (type != TYPE_SCRIPT) {
-    current->function->name =
-        copyString(parser.previous.start, parser.previous.length);
+    ObjString *name = copyString(parser.previous.start, parser.previous.length);
+    snapshotBarrier(&current->function->obj);
+    current->function->name = name;
+    writeBarrier(&current->function->obj, OBJ_VAL(name));
   }
   /*
   Remember that the compiler’s locals array keeps track of which stack slots are
@@ -364,6 +432,16 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
 static ObjFunction *endCompiler() {
   emitReturn();
   ObjFunction *function = current->function;
+  if (!parser.hadError)
+    function->maxStack = maxStackDepth(currentChunk(), function->arity + 1, NULL);
+  // functions that make it into register code skip the peephole pass, whose
+  // superinstructions only exist in stack code
+  if (!parser.hadError &&
+      !(vm.registerMode && translateChunk(currentChunk(), function->arity))) {
+#ifndef CLOX_NO_PEEPHOLE
+    optimizeChunk(currentChunk());
+#endif
+  }
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
     disassembleChunk(
@@ -423,6 +501,22 @@ static void parsePrecedence(Precedence precedence);
 static uint8_t identifierConstant(Token *name) {
   return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
+
+/**
+ * Returns the index of the global variable name in the vm's global array
+ * (vm.globalValues), which is what the global instructions take as a 2 byte
+ * operand. Globals are resolved right here instead of by name at runtime.
+ *
+ * @return uint16_t
+ */
+static uint16_t globalVariable(Token *name) {
+  int slot = globalSlot(copyString(name->start, name->length));
+  if (slot > UINT16_MAX) {
+    error("Too many global variables.");
+    return 0;
+  }
+  return (uint16_t)slot;
+}
 /**
  * Returns true or false depending on weather two variable names are equivalent
  * or not
@@ -675,7 +769,12 @@ static void binary(bool canAssign) {
 
 static void call(bool canAssign) {
   uint8_t argCount = argumentList();
-  emitBytes(OP_CALL, argCount);
+  current->lastCall = currentChunk()->count;
+  if (argCount <= 3) {
+    emitByte(OP_CALL_0 + argCount);
+  } else {
+    emitBytes(OP_CALL, argCount);
+  }
 }
 
 static void dot(bool canAssign) {
@@ -685,12 +784,15 @@ static void dot(bool canAssign) {
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
     emitBytes(OP_SET_PROPERTY, name);
+    emitCache();
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint argCount = argumentList();
     emitBytes(OP_INVOKE, name);
     emitByte(argCount);
+    emitCache();
   } else {
     emitBytes(OP_GET_PROPERTY, name);
+    emitCache();
   }
 }
 
@@ -797,16 +899,21 @@ static void namedVariable(Token name, bool canAssign) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
-    arg = identifierConstant(&name);
+    arg = globalVariable(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
 
+  uint8_t op = getOp; // to get global expr->getter
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(setOp, (uint8_t)arg); // to set global expr->setter
+    op = setOp; // to set global expr->setter
+  }
+  if (op == OP_GET_GLOBAL || op == OP_SET_GLOBAL) {
+    emitByte(op);
+    emitShort((uint16_t)arg);
   } else {
-    emitBytes(getOp, (uint8_t)arg); // to get global expr->getter
+    emitBytes(op, (uint8_t)arg);
   }
 
   /*
@@ -825,6 +932,46 @@ static void variable(bool canAssign) {
   */
 }
 
+/**
+ * A token for a name the compiler uses on its own ("this", "super") that
+ * doesn't come from the source
+ */
+static Token syntheticToken(const char *text) {
+  Token token;
+  token.start = text;
+  token.length = (int)strlen(text);
+  return token;
+}
+
+/**
+ * super.name and super.name(args). The superclass is the "super" local the
+ * class declaration made, so which class's method runs is known from where
+ * the code is, not from the receiver. A call goes through its own inline
+ * cache (OP_SUPER_INVOKE), keyed by the superclass
+ */
+static void super_(bool canAssign) {
+  if (currentClass == NULL) {
+    error("Can't use 'super' outside of a class.");
+  } else if (!currentClass->hasSuperclass) {
+    error("Can't use 'super' in a class with no superclass.");
+  }
+  consume(TOKEN_DOT, "Expect '.' after 'super'.");
+  consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
+  uint8_t name = identifierConstant(&parser.previous);
+
+  namedVariable(syntheticToken("this"), false);
+  if (match(TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList();
+    namedVariable(syntheticToken("super"), false);
+    emitBytes(OP_SUPER_INVOKE, name);
+    emitByte(argCount);
+    emitCache();
+  } else {
+    namedVariable(syntheticToken("super"), false);
+    emitBytes(OP_GET_SUPER, name);
+  }
+}
+
 static void this_(bool canAssign) {
   if (currentClass == NULL) {
     error("Can't use 'this' outside a class.");
@@ -891,7 +1038,7 @@ ParseRule rules[] = {
     [TOKEN_OR] = {NULL, or_, PREC_OR},
     [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
     [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_SUPER] = {NULL, NULL, PREC_NONE},
+    [TOKEN_SUPER] = {super_, NULL, PREC_NONE},
     [TOKEN_THIS] = {this_, NULL, PREC_NONE},
     [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
     [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
@@ -929,24 +1076,24 @@ static void parsePrecedence(Precedence precedence) {
  * To 'declare' both local and global variable. First declears local variable
  * through declearVariable() On declearVariable it simply adds the local
  * variable's token to compiler For global variable, it uses
- * identifierConstant(), which in turn stores the variable's name as value to
- * chunk's ValueArray and returns the index where it is stored.
+ * globalVariable(), which hands out the variable's slot in the vm's global
+ * array.
  *
  * @param errorMessage the error message to be displayed in case of missing
  * variable name
  *
- * @return uint8_t i.e the index on ValueArray where the global variable's name
- * is stored as OBJ_STRING, returns 0 if it's a local var
+ * @return uint16_t i.e the global variable's slot in vm.globalValues, returns
+ * 0 if it's a local var
  */
 
-static uint8_t parseVariable(const char *errorMessage) {
+static uint16_t parseVariable(const char *errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
 
   declareVariable();
   if (current->scopeDepth > 0)
     return 0; // exit if in local scope
 
-  return identifierConstant(&parser.previous);
+  return globalVariable(&parser.previous);
 }
 
 /**
@@ -964,23 +1111,23 @@ static void markInitialized() {
 
 /**
  * For globals, simply emits OP_DEFINE_GLOBAL, for local calls markInitialized()
- * fnc NOTE: In clox, global variables are "resolved after compile time", i.e we
- * just compile the corresponding global declarations as Bytecode and store the
- * value in chunks. So at run time as the vm goes thru the chunk, it puts the
- * declaraion in hashtable at runtime. For local vars, the mapping of variables
- * to it's value is done at compile time using the Compile struct, making local
- *      variables a little more efficient.
+ * fnc NOTE: global variables get their slot in vm.globalValues at compile
+ * time, but the slot holds EMPTY_VAL until the vm actually runs the
+ * OP_DEFINE_GLOBAL, which is how using a global before its declaration is
+ * still caught at runtime. For local vars, the mapping of variables to it's
+ * value is done at compile time using the Compile struct, with the value on
+ * the vm stack.
  *
  * @return void
  */
-static void defineVariable(uint8_t global) {
+static void defineVariable(uint16_t global) {
   if (current->scopeDepth > 0) {
     markInitialized();
     return;
   }
 
-  emitBytes(OP_DEFINE_GLOBAL, global); // OP_DEFINE_GLOBAL's like OP_CONSTANT
-                                       // but for declaring global variables
+  emitByte(OP_DEFINE_GLOBAL); // OP_DEFINE_GLOBAL's like OP_CONSTANT but for
+  emitShort(global);          // declaring global variables
 }
 
 /**
@@ -1040,7 +1187,7 @@ static void function(FunctionType type) {
       if (current->function->arity > 255) {
         errorAtCurrent("Can't have more than 255 parameters.");
       }
-      uint8_t constant = parseVariable("Expect parameter name.");
+      uint16_t constant = parseVariable("Expect parameter name.");
       defineVariable(constant);
     } while (match(TOKEN_COMMA));
   }
@@ -1075,12 +1222,31 @@ static void classDeclaration() {
   uint8_t nameConstant = identifierConstant(&parser.previous);
   declareVariable();
   emitBytes(OP_CLASS, nameConstant);
-  defineVariable(nameConstant);
+  defineVariable(current->scopeDepth > 0 ? 0 : globalVariable(&className));
 
   ClassCompiler classCompiler;
   classCompiler.enclosing = currentClass;
+  classCompiler.hasSuperclass = false;
   currentClass = &classCompiler;
 
+  if (match(TOKEN_LESS)) {
+    consume(TOKEN_IDENTIFIER, "Expect superclass name.");
+    variable(false);
+    if (identifiersEqual(&className, &parser.previous)) {
+      error("A class can't inherit from itself.");
+    }
+
+    // the superclass stays on the stack as "super" for as long as the body
+    // is being compiled, the methods capture it from there
+    beginScope();
+    addLocal(syntheticToken("super"));
+    defineVariable(0);
+
+    namedVariable(className, false);
+    emitByte(OP_INHERIT);
+    classCompiler.hasSuperclass = true;
+  }
+
   namedVariable(className, false);
   consume(TOKEN_LEFT_BRACE, "Expect { before class body.");
 
@@ -1090,11 +1256,14 @@ static void classDeclaration() {
   consume(TOKEN_RIGHT_BRACE, "Expect } before class body.");
   emitByte(OP_POP);
 
+  if (classCompiler.hasSuperclass) {
+    endScope();
+  }
   currentClass = currentClass->enclosing;
 }
 
 static void funDeclaration() {
-  uint8_t global = parseVariable("Expect function name.");
+  uint16_t global = parseVariable("Expect function name.");
   markInitialized(); // we should immeditaly initialize functions after decl for
                      // recursion purposes
   function(TYPE_FUNCTION);
@@ -1122,7 +1291,7 @@ static void funDeclaration() {
  */
 
 static void varDeclaration() {
-  uint8_t global = parseVariable(
+  uint16_t global = parseVariable(
       "Expect variable name"); // global = 0, if the given variable to be
                                // decleard is local. Else global is assigned the
   // corresponding index in ValueArray where the variable name is stored as
@@ -1239,10 +1408,29 @@ static void returnStatement() {
     if (current->type == TYPE_INITIALIZER) {
       error("Can't return a value from an initializer.");
     }
-    emitReturn(); // returns OP_NIL and OP_RETURN so we implicitly return NIL
+    emitReturn(); // OP_RETURN_NIL, so we implicitly return NIL
   } else {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+    // return f(args); with the call the very last thing the expression did,
+    // so nothing's left to do in this frame once f returns and f can have it.
+    // The OP_RETURN stays for callees that don't take the frame (natives)
+    Chunk *chunk = currentChunk();
+    int call = current->lastCall;
+    if (call != -1 && call + instructionLength(chunk, call) == chunk->count) {
+      if (chunk->code[call] == OP_CALL) {
+        chunk->code[call] = OP_TAIL_CALL;
+      } else {
+        // OP_CALL_n is the last byte, so its arg count can just go after it,
+        // with any jump past the call (return a and f();) moved past it too
+        uint8_t argCount = chunk->code[call] - OP_CALL_0;
+        chunk->code[call] = OP_TAIL_CALL;
+        emitByte(argCount);
+        if (current->lastJumpTarget == call + 1) {
+          moveJumpsTo(call + 1);
+        }
+      }
+    }
     emitByte(OP_RETURN);
   }
 }
@@ -4,10 +4,120 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
+
+/**
+ * Name of the opcode, for reports that only have the byte (--opstats)
+ *
+ * @return const char* "OP_UNKNOWN" for a byte that isn't an opcode
+ */
+const char *opcodeName(uint8_t instruction) {
+#define NAME(op) [op] = #op
+  static const char *names[UINT8_COUNT] = {
+    NAME(OP_CONSTANT),
+    NAME(OP_NIL),
+    NAME(OP_TRUE),
+    NAME(OP_FALSE),
+    NAME(OP_POP),
+    NAME(OP_GET_LOCAL),
+    NAME(OP_SET_LOCAL),
+    NAME(OP_GET_GLOBAL),
+    NAME(OP_DEFINE_GLOBAL),
+    NAME(OP_SET_GLOBAL),
+    NAME(OP_GET_UPVALUE),
+    NAME(OP_SET_UPVALUE),
+    NAME(OP_SET_PROPERTY),
+    NAME(OP_GET_PROPERTY),
+    NAME(OP_EQUAL),
+    NAME(OP_GREATER),
+    NAME(OP_LESS),
+    NAME(OP_ADD),
+    NAME(OP_SUBTRACT),
+    NAME(OP_MULTIPLY),
+    NAME(OP_DIVIDE),
+    NAME(OP_NOT),
+    NAME(OP_NEGATE),
+    NAME(OP_PRINT),
+    NAME(OP_JUMP),
+    NAME(OP_JUMP_IF_FALSE),
+    NAME(OP_LOOP),
+    NAME(OP_CALL),
+    NAME(OP_CALL_0),
+    NAME(OP_CALL_1),
+    NAME(OP_CALL_2),
+    NAME(OP_CALL_3),
+    NAME(OP_TAIL_CALL),
+    NAME(OP_INVOKE),
+    NAME(OP_CLOSURE),
+    NAME(OP_CLOSE_UPVALUE),
+    NAME(OP_CONSTANT_LONG),
+    NAME(OP_RETURN),
+    NAME(OP_RETURN_NIL),
+    NAME(OP_RETURN_LOCAL),
+    NAME(OP_CLASS),
+    NAME(OP_METHOD),
+    NAME(OP_INHERIT),
+    NAME(OP_GET_SUPER),
+    NAME(OP_SUPER_INVOKE),
+    NAME(OP_ADD_NUM),
+    NAME(OP_ADD_STR),
+    NAME(OP_SUBTRACT_NUM),
+    NAME(OP_MULTIPLY_NUM),
+    NAME(OP_DIVIDE_NUM),
+    NAME(OP_GREATER_NUM),
+    NAME(OP_LESS_NUM),
+    NAME(OP_ADD_LL),
+    NAME(OP_ADD_LC),
+    NAME(OP_LESS_LC_JIF),
+    NAME(OP_LESS_LL_JIF),
+    NAME(OP_SET_LOCAL_POP),
+    NAME(OP_POPN),
+    NAME(OP_R_MOVE),
+    NAME(OP_R_LOADK),
+    NAME(OP_R_NIL),
+    NAME(OP_R_TRUE),
+    NAME(OP_R_FALSE),
+    NAME(OP_R_GET_GLOBAL),
+    NAME(OP_R_DEFINE_GLOBAL),
+    NAME(OP_R_SET_GLOBAL),
+    NAME(OP_R_GET_UPVALUE),
+    NAME(OP_R_SET_UPVALUE),
+    NAME(OP_R_EQUAL),
+    NAME(OP_R_EQUAL_K),
+    NAME(OP_R_GREATER),
+    NAME(OP_R_GREATER_K),
+    NAME(OP_R_LESS),
+    NAME(OP_R_LESS_K),
+    NAME(OP_R_ADD),
+    NAME(OP_R_ADD_K),
+    NAME(OP_R_SUBTRACT),
+    NAME(OP_R_SUBTRACT_K),
+    NAME(OP_R_MULTIPLY),
+    NAME(OP_R_MULTIPLY_K),
+    NAME(OP_R_DIVIDE),
+    NAME(OP_R_DIVIDE_K),
+    NAME(OP_R_NOT),
+    NAME(OP_R_NEGATE),
+    NAME(OP_R_PRINT),
+    NAME(OP_R_JUMP),
+    NAME(OP_R_JUMP_IF_FALSE),
+    NAME(OP_R_LOOP),
+    NAME(OP_R_CALL),
+    NAME(OP_R_CLOSURE),
+    NAME(OP_R_CLOSE_UPVALUE),
+    NAME(OP_R_RETURN),
+  };
+#undef NAME
+  return names[instruction] != NULL ? names[instruction] : "OP_UNKNOWN";
+}
 
 void disassembleChunk(Chunk *chunk, const char *name) {
   printf("== %s ==\n", name);
 
+  if (chunk->maxRegisters > 0) {
+    printf("(register form, %d registers)\n", chunk->maxRegisters);
+  }
+
   for (int offset = 0; offset < chunk->count;) {
     offset = disassembleInstruction(chunk, offset);
   }
@@ -35,12 +145,120 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset) {
 static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
   uint8_t constant = chunk->code[offset + 1];
   uint8_t argCount = chunk->code[offset + 2];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+  cache |= chunk->code[offset + 4];
   printf("%-16s (%d args) %4d '", name, argCount, constant);
   printValue(chunk->constants.values[constant]);
+  printf("' (ic %d)\n", cache);
+  return offset + 5;
+}
+
+static int propertyInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+  cache |= chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' (ic %d)\n", cache);
+  return offset + 4;
+}
+
+static int globalInstruction(const char *name, Chunk *chunk, int offset) {
+  uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+  slot |= chunk->code[offset + 2];
+  printf("%-16s %4d '", name, slot);
+  printValue(vm.globalNames.values[slot]);
+  printf("'\n");
+  return offset + 3;
+}
+
+static int localPairInstruction(const char *name, Chunk *chunk, int offset) {
+  printf("%-16s %4d %4d\n", name, chunk->code[offset + 1],
+         chunk->code[offset + 2]);
+  return offset + 3;
+}
+
+static int localConstantInstruction(const char *name, Chunk *chunk,
+                                    int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  printValue(chunk->constants.values[constant]);
   printf("'\n");
   return offset + 3;
 }
 
+static int localConstantJumpInstruction(const char *name, Chunk *chunk,
+                                        int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+  jump |= chunk->code[offset + 4];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' -> %d\n", offset + 5 + jump);
+  return offset + 5;
+}
+
+static int localPairJumpInstruction(const char *name, Chunk *chunk,
+                                    int offset) {
+  uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+  jump |= chunk->code[offset + 4];
+  printf("%-16s %4d %4d -> %d\n", name, chunk->code[offset + 1],
+         chunk->code[offset + 2], offset + 5 + jump);
+  return offset + 5;
+}
+
+static int registerInstruction(const char *name, Chunk *chunk, int offset,
+                               int registers) {
+  printf("%-16s", name);
+  for (int i = 1; i <= registers; i++) {
+    printf(" r%-3d", chunk->code[offset + i]);
+  }
+  printf("\n");
+  return offset + 1 + registers;
+}
+
+static int registerByteInstruction(const char *name, Chunk *chunk,
+                                   int offset) {
+  printf("%-16s r%-3d %4d\n", name, chunk->code[offset + 1],
+         chunk->code[offset + 2]);
+  return offset + 3;
+}
+
+// registers first, then one constant index
+static int registerConstantInstruction(const char *name, Chunk *chunk,
+                                       int offset, int registers) {
+  uint8_t constant = chunk->code[offset + 1 + registers];
+  printf("%-16s", name);
+  for (int i = 1; i <= registers; i++) {
+    printf(" r%-3d", chunk->code[offset + i]);
+  }
+  printf(" %4d '", constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 2 + registers;
+}
+
+static int registerGlobalInstruction(const char *name, Chunk *chunk,
+                                     int offset) {
+  uint16_t slot = (uint16_t)(chunk->code[offset + 2] << 8);
+  slot |= chunk->code[offset + 3];
+  printf("%-16s r%-3d %4d '", name, chunk->code[offset + 1], slot);
+  printValue(vm.globalNames.values[slot]);
+  printf("'\n");
+  return offset + 4;
+}
+
+static int registerJumpInstruction(const char *name, Chunk *chunk,
+                                   int offset) {
+  uint16_t jump = (uint16_t)(chunk->code[offset + 2] << 8);
+  jump |= chunk->code[offset + 3];
+  printf("%-16s r%-3d -> %d\n", name, chunk->code[offset + 1],
+         offset + 4 + jump);
+  return offset + 4;
+}
+
 static int simpleInstruction(const char *name, int offset) {
   printf("%s\n", name);
   return offset + 1;
@@ -104,13 +322,13 @@ int disassembleInstruction(Chunk *chunk, int offset) {
   case OP_SET_LOCAL:
     return byteInstruction("OP_SET_LOCAL", chunk, offset);
   case OP_GET_GLOBAL:
-    return constantInstruction(
+    return globalInstruction(
         "OP_GET_GLOBAL", chunk,
         offset); // printing OP_GET_GLOBAL + string of the var name
   case OP_DEFINE_GLOBAL:
-    return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
   case OP_SET_GLOBAL:
-    return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+    return globalInstruction("OP_SET_GLOBAL", chunk, offset);
   case OP_GET_UPVALUE:
     return byteInstruction("OP_GET_UPVALUE", chunk, offset);
   case OP_SET_UPVALUE:
@@ -118,9 +336,9 @@ int disassembleInstruction(Chunk *chunk, int offset) {
   case OP_EQUAL:
     return simpleInstruction("OP_EQUAL", offset);
   case OP_SET_PROPERTY:
-    return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+    return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
   case OP_GET_PROPERTY:
-    return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+    return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
   case OP_GREATER:
     return simpleInstruction("OP_GREATER", offset);
   case OP_LESS:
@@ -147,10 +365,52 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return jumpInstruction("OP_LOOP", -1, chunk, offset);
   case OP_CALL:
     return byteInstruction("OP_CALL", chunk, offset);
+  case OP_CALL_0:
+    return simpleInstruction("OP_CALL_0", offset);
+  case OP_CALL_1:
+    return simpleInstruction("OP_CALL_1", offset);
+  case OP_CALL_2:
+    return simpleInstruction("OP_CALL_2", offset);
+  case OP_CALL_3:
+    return simpleInstruction("OP_CALL_3", offset);
+  case OP_TAIL_CALL:
+    return byteInstruction("OP_TAIL_CALL", chunk, offset);
   case OP_INVOKE:
     return invokeInstruction("OP_INVOKE", chunk, offset);
   case OP_METHOD:
     return constantInstruction("OP_METHOD", chunk, offset);
+  case OP_INHERIT:
+    return simpleInstruction("OP_INHERIT", offset);
+  case OP_GET_SUPER:
+    return constantInstruction("OP_GET_SUPER", chunk, offset);
+  case OP_SUPER_INVOKE:
+    return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+  case OP_ADD_NUM:
+    return simpleInstruction("OP_ADD_NUM", offset);
+  case OP_ADD_STR:
+    return simpleInstruction("OP_ADD_STR", offset);
+  case OP_SUBTRACT_NUM:
+    return simpleInstruction("OP_SUBTRACT_NUM", offset);
+  case OP_MULTIPLY_NUM:
+    return simpleInstruction("OP_MULTIPLY_NUM", offset);
+  case OP_DIVIDE_NUM:
+    return simpleInstruction("OP_DIVIDE_NUM", offset);
+  case OP_GREATER_NUM:
+    return simpleInstruction("OP_GREATER_NUM", offset);
+  case OP_LESS_NUM:
+    return simpleInstruction("OP_LESS_NUM", offset);
+  case OP_ADD_LL:
+    return localPairInstruction("OP_ADD_LL", chunk, offset);
+  case OP_ADD_LC:
+    return localConstantInstruction("OP_ADD_LC", chunk, offset);
+  case OP_LESS_LC_JIF:
+    return localConstantJumpInstruction("OP_LESS_LC_JIF", chunk, offset);
+  case OP_LESS_LL_JIF:
+    return localPairJumpInstruction("OP_LESS_LL_JIF", chunk, offset);
+  case OP_SET_LOCAL_POP:
+    return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+  case OP_POPN:
+    return byteInstruction("OP_POPN", chunk, offset);
   case OP_CLOSURE: {
     offset++;
     uint8_t constant = chunk->code[offset++];
@@ -166,10 +426,98 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     }
     return offset;
   }
+  case OP_R_CLOSURE: {
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s r%-3d %4d ", "OP_R_CLOSURE", chunk->code[offset + 1],
+           constant);
+    printValue(chunk->constants.values[constant]);
+    printf("\n");
+    offset += 3;
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+    for (int j = 0; j < function->upvalueCount; j++) {
+      int isLocal = chunk->code[offset++];
+      int index = chunk->code[offset++];
+      printf("%04d        |               %s %d\n", offset - 2,
+             isLocal ? "local" : "upvalue", index);
+    }
+    return offset;
+  }
+  case OP_R_MOVE:
+    return registerInstruction("OP_R_MOVE", chunk, offset, 2);
+  case OP_R_LOADK:
+    return registerConstantInstruction("OP_R_LOADK", chunk, offset, 1);
+  case OP_R_NIL:
+    return registerInstruction("OP_R_NIL", chunk, offset, 1);
+  case OP_R_TRUE:
+    return registerInstruction("OP_R_TRUE", chunk, offset, 1);
+  case OP_R_FALSE:
+    return registerInstruction("OP_R_FALSE", chunk, offset, 1);
+  case OP_R_GET_GLOBAL:
+    return registerGlobalInstruction("OP_R_GET_GLOBAL", chunk, offset);
+  case OP_R_DEFINE_GLOBAL:
+    return registerGlobalInstruction("OP_R_DEFINE_GLOBAL", chunk, offset);
+  case OP_R_SET_GLOBAL:
+    return registerGlobalInstruction("OP_R_SET_GLOBAL", chunk, offset);
+  case OP_R_GET_UPVALUE:
+    return registerByteInstruction("OP_R_GET_UPVALUE", chunk, offset);
+  case OP_R_SET_UPVALUE:
+    return registerByteInstruction("OP_R_SET_UPVALUE", chunk, offset);
+  case OP_R_EQUAL:
+    return registerInstruction("OP_R_EQUAL", chunk, offset, 3);
+  case OP_R_EQUAL_K:
+    return registerConstantInstruction("OP_R_EQUAL_K", chunk, offset, 2);
+  case OP_R_GREATER:
+    return registerInstruction("OP_R_GREATER", chunk, offset, 3);
+  case OP_R_GREATER_K:
+    return registerConstantInstruction("OP_R_GREATER_K", chunk, offset, 2);
+  case OP_R_LESS:
+    return registerInstruction("OP_R_LESS", chunk, offset, 3);
+  case OP_R_LESS_K:
+    return registerConstantInstruction("OP_R_LESS_K", chunk, offset, 2);
+  case OP_R_ADD:
+    return registerInstruction("OP_R_ADD", chunk, offset, 3);
+  case OP_R_ADD_K:
+    return registerConstantInstruction("OP_R_ADD_K", chunk, offset, 2);
+  case OP_R_SUBTRACT:
+    return registerInstruction("OP_R_SUBTRACT", chunk, offset, 3);
+  case OP_R_SUBTRACT_K:
+    return registerConstantInstruction("OP_R_SUBTRACT_K", chunk, offset, 2);
+  case OP_R_MULTIPLY:
+    return registerInstruction("OP_R_MULTIPLY", chunk, offset, 3);
+  case OP_R_MULTIPLY_K:
+    return registerConstantInstruction("OP_R_MULTIPLY_K", chunk, offset, 2);
+  case OP_R_DIVIDE:
+    return registerInstruction("OP_R_DIVIDE", chunk, offset, 3);
+  case OP_R_DIVIDE_K:
+    return registerConstantInstruction("OP_R_DIVIDE_K", chunk, offset, 2);
+  case OP_R_NOT:
+    return registerInstruction("OP_R_NOT", chunk, offset, 2);
+  case OP_R_NEGATE:
+    return registerInstruction("OP_R_NEGATE", chunk, offset, 2);
+  case OP_R_PRINT:
+    return registerInstruction("OP_R_PRINT", chunk, offset, 1);
+  case OP_R_JUMP:
+    return jumpInstruction("OP_R_JUMP", 1, chunk, offset);
+  case OP_R_JUMP_IF_FALSE:
+    return registerJumpInstruction("OP_R_JUMP_IF_FALSE", chunk, offset);
+  case OP_R_LOOP:
+    return jumpInstruction("OP_R_LOOP", -1, chunk, offset);
+  case OP_R_CALL:
+    printf("%-16s r%-3d (%d args)\n", "OP_R_CALL", chunk->code[offset + 1],
+           chunk->code[offset + 2]);
+    return offset + 3;
+  case OP_R_CLOSE_UPVALUE:
+    return registerInstruction("OP_R_CLOSE_UPVALUE", chunk, offset, 1);
+  case OP_R_RETURN:
+    return registerInstruction("OP_R_RETURN", chunk, offset, 1);
   case OP_CLOSE_UPVALUE:
     return simpleInstruction("OP_CLOSE_UPVALUE", offset);
   case OP_RETURN:
     return simpleInstruction("OP_RETURN", offset);
+  case OP_RETURN_NIL:
+    return simpleInstruction("OP_RETURN_NIL", offset);
+  case OP_RETURN_LOCAL:
+    return byteInstruction("OP_RETURN_LOCAL", chunk, offset);
   case OP_CLASS:
     return constantInstruction("OP_CLASS", chunk, offset);
   default:
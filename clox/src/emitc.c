@@ -0,0 +1,929 @@
+// Ahead-of-time backend (clox --emit-c): compiles a script the usual way, then
+// writes every function's bytecode out as one C function, to be built against
+// libloxrt (see loxrt.h) into a program that starts running right away, with
+// no scanning, compiling or dispatching left to do.
+//
+// The compiler knows how deep the stack is at every instruction, so each
+// stack position becomes a fixed slots[n] of the frame, and the pushes and
+// pops disappear. Numbers, locals, globals, upvalues, jumps and arithmetic are
+// plain C; calls, property access and the like go through the aot*() helpers
+// in vm.c. The values stay on the vm stack, where the GC and the upvalues can
+// see them.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "compiler.h"
+#include "emitc.h"
+#include "object.h"
+#include "vm.h"
+
+/**
+ * Every function in the script, in the order they're written out (the script
+ * first), so a function's index is its name in the generated code
+ */
+typedef struct {
+  ObjFunction **functions;
+  int count;
+  int capacity;
+} FunctionList;
+
+static int functionIndex(FunctionList *list, ObjFunction *function) {
+  for (int i = 0; i < list->count; i++) {
+    if (list->functions[i] == function)
+      return i;
+  }
+  return -1;
+}
+
+static void collectFunctions(FunctionList *list, ObjFunction *function) {
+  if (list->capacity < list->count + 1) {
+    list->capacity = list->capacity < 8 ? 8 : list->capacity * 2;
+    list->functions =
+        realloc(list->functions, list->capacity * sizeof(ObjFunction *));
+  }
+  list->functions[list->count++] = function;
+
+  ValueArray *constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (IS_FUNCTION(constants->values[i])) {
+      collectFunctions(list, AS_FUNCTION(constants->values[i]));
+    }
+  }
+}
+
+/**
+ * Writes chars out as a C string literal, escaping whatever isn't plain
+ * printable ASCII (and '?', to stay clear of trigraphs)
+ */
+static void emitString(FILE *out, const char *chars, int length) {
+  fputc('"', out);
+  for (int i = 0; i < length; i++) {
+    unsigned char c = (unsigned char)chars[i];
+    if (c == '"' || c == '\\' || c == '?') {
+      fprintf(out, "\\%c", c);
+    } else if (c < ' ' || c > '~') {
+      fprintf(out, "\\%03o", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+static void emitNumber(FILE *out, double number) {
+  if (isinf(number)) {
+    fprintf(out, number > 0 ? "HUGE_VAL" : "(-HUGE_VAL)");
+    return;
+  }
+  if (isnan(number)) {
+    fprintf(out, "NAN");
+    return;
+  }
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.17g", number);
+  // keeps it a double literal
+  if (strpbrk(buffer, ".e") == NULL)
+    strcat(buffer, ".0");
+  fputs(buffer, out);
+}
+
+/**
+ * What the emitter knows about the value the bytecode keeps at a depth, the
+ * same idea as in regcode.c. Values are used straight from where they are,
+ * and only written to their slot (materialized) once something needs them on
+ * the vm stack: a call, anything that can run the GC, or a jump, since every
+ * label starts with the whole frame in its slots
+ *  ENTRY_SLOT   -> it's in slots[depth]
+ *  ENTRY_LOCAL  -> it's a copy of slots[operand] (OP_GET_LOCAL)
+ *  ENTRY_CONST  -> it's constants[operand] (OP_CONSTANT)
+ *  ENTRY_NUMBER -> it's the double in C local n<operand>
+ *  ENTRY_BOOL   -> it's the bool in C local c<operand>
+ * Results of arithmetic and compares stay in those C locals, which the C
+ * compiler can keep in registers
+ */
+typedef enum {
+  ENTRY_SLOT,
+  ENTRY_LOCAL,
+  ENTRY_CONST,
+  ENTRY_NUMBER,
+  ENTRY_BOOL,
+} StackEntryKind;
+
+typedef struct {
+  StackEntryKind kind;
+  int operand;
+} StackEntry;
+
+typedef struct {
+  FILE *out;
+  Chunk *chunk;
+  bool *isTarget;
+  StackEntry *entries;
+  int maxDepth;
+  int depth;
+} Emitter;
+
+/**
+ * The constant at index, numbers written in as literals so the C compiler
+ * gets to see them
+ */
+static void emitConstant(Emitter *e, int index) {
+  Value value = e->chunk->constants.values[index];
+  if (IS_NUMBER(value)) {
+    fprintf(e->out, "NUMBER_VAL(");
+    emitNumber(e->out, AS_NUMBER(value));
+    fprintf(e->out, ")");
+  } else {
+    fprintf(e->out, "constants[%d]", index);
+  }
+}
+
+/**
+ * The value at depth slot, as a Value
+ */
+static void emitValue(Emitter *e, int slot) {
+  StackEntry *entry = &e->entries[slot];
+  switch (entry->kind) {
+  case ENTRY_SLOT:
+    fprintf(e->out, "slots[%d]", slot);
+    break;
+  case ENTRY_LOCAL:
+    fprintf(e->out, "slots[%d]", entry->operand);
+    break;
+  case ENTRY_CONST:
+    emitConstant(e, entry->operand);
+    break;
+  case ENTRY_NUMBER:
+    fprintf(e->out, "NUMBER_VAL(n%d)", entry->operand);
+    break;
+  case ENTRY_BOOL:
+    fprintf(e->out, "BOOL_VAL(c%d)", entry->operand);
+    break;
+  }
+}
+
+/**
+ * The value at depth slot as a double, once it's known to be a number
+ */
+static void emitNumberOf(Emitter *e, int slot) {
+  StackEntry *entry = &e->entries[slot];
+  switch (entry->kind) {
+  case ENTRY_SLOT:
+    fprintf(e->out, "AS_NUMBER(slots[%d])", slot);
+    break;
+  case ENTRY_LOCAL:
+    fprintf(e->out, "AS_NUMBER(slots[%d])", entry->operand);
+    break;
+  case ENTRY_CONST:
+    emitNumber(e->out, AS_NUMBER(e->chunk->constants.values[entry->operand]));
+    break;
+  default: // ENTRY_NUMBER
+    fprintf(e->out, "n%d", entry->operand);
+    break;
+  }
+}
+
+static bool isKnownNumber(Emitter *e, int slot) {
+  StackEntry *entry = &e->entries[slot];
+  return entry->kind == ENTRY_NUMBER ||
+         (entry->kind == ENTRY_CONST &&
+          IS_NUMBER(e->chunk->constants.values[entry->operand]));
+}
+
+/**
+ * A bool or a constant string, which the number paths can be left out for
+ */
+static bool isNotNumber(Emitter *e, int slot) {
+  StackEntry *entry = &e->entries[slot];
+  return entry->kind == ENTRY_BOOL ||
+         (entry->kind == ENTRY_CONST &&
+          !IS_NUMBER(e->chunk->constants.values[entry->operand]));
+}
+
+/**
+ * Writes the runtime check that the values at depth a and b are numbers, for
+ * whichever of them isn't known to be one already
+ */
+static void emitNumberCheck(Emitter *e, int a, int b, const char *message) {
+  int slots[] = {a, b};
+  bool first = true;
+  for (int i = 0; i < 2; i++) {
+    if (isKnownNumber(e, slots[i]))
+      continue;
+    fprintf(e->out, first ? "  if (" : " || ");
+    first = false;
+    if (isNotNumber(e, slots[i])) {
+      fprintf(e->out, "true");
+    } else {
+      fprintf(e->out, "!IS_NUMBER(");
+      emitValue(e, slots[i]);
+      fprintf(e->out, ")");
+    }
+  }
+  if (!first)
+    fprintf(e->out, ")\n    return aotError(\"%s\");\n", message);
+}
+
+static void materialize(Emitter *e, int slot) {
+  if (e->entries[slot].kind == ENTRY_SLOT)
+    return;
+  fprintf(e->out, "  slots[%d] = ", slot);
+  emitValue(e, slot);
+  fprintf(e->out, ";\n");
+  e->entries[slot].kind = ENTRY_SLOT;
+}
+
+static void materializeAll(Emitter *e) {
+  for (int slot = 0; slot < e->depth; slot++) {
+    materialize(e, slot);
+  }
+}
+
+/**
+ * Forgets everything it knew, for right after a jump or a return, where the
+ * next instruction (if anything gets there at all) is a label
+ */
+static void forgetAll(Emitter *e) {
+  for (int slot = 0; slot <= e->maxDepth; slot++) {
+    e->entries[slot].kind = ENTRY_SLOT;
+  }
+}
+
+/**
+ * slots[local] is about to be overwritten, so the copies of it between local
+ * and below need their own copy first
+ */
+static void materializeCopiesOf(Emitter *e, int local, int below) {
+  for (int slot = local + 1; slot < below; slot++) {
+    if (e->entries[slot].kind == ENTRY_LOCAL &&
+        e->entries[slot].operand == local) {
+      materialize(e, slot);
+    }
+  }
+}
+
+/**
+ * Everything's in its slot and vm.stack_count covers it, for anything that
+ * can run the GC or looks at the top of the stack
+ */
+static void sync(Emitter *e) {
+  materializeAll(e);
+  fprintf(e->out, "  AOT_SYNC(%d);\n", e->depth);
+}
+
+static void pushEntry(Emitter *e, StackEntryKind kind, int operand) {
+  e->entries[e->depth].kind = kind;
+  e->entries[e->depth].operand = operand;
+  e->depth++;
+}
+
+/**
+ * slots[local] = the value on top, which stays there
+ */
+static void setLocal(Emitter *e, int local) {
+  int top = e->depth - 1;
+  materializeCopiesOf(e, local, top);
+  fprintf(e->out, "  slots[%d] = ", local);
+  emitValue(e, top);
+  fprintf(e->out, ";\n");
+  e->entries[local].kind = ENTRY_SLOT;
+}
+
+/**
+ * OP_ADD on the two values on top. Numbers are by far the common case, so
+ * that's done inline and only strings go through the vm. If the sum's
+ * stored to a local right away (setLocal >= 0), it goes straight there
+ */
+static void add(Emitter *e, int setLocal) {
+  int a = e->depth - 2;
+  int b = e->depth - 1;
+  if (isKnownNumber(e, a) && isKnownNumber(e, b)) {
+    fprintf(e->out, "  n%d = ", a);
+    emitNumberOf(e, a);
+    fprintf(e->out, " + ");
+    emitNumberOf(e, b);
+    fprintf(e->out, ";\n");
+    e->depth--;
+    e->entries[a].kind = ENTRY_NUMBER;
+    e->entries[a].operand = a;
+    if (setLocal >= 0) {
+      materializeCopiesOf(e, setLocal, a);
+      fprintf(e->out, "  slots[%d] = NUMBER_VAL(n%d);\n", setLocal, a);
+      e->entries[setLocal].kind = ENTRY_SLOT;
+    }
+    return;
+  }
+
+  // the string path needs everything under the operands on the stack, and
+  // it has to be there whichever way it goes
+  e->depth -= 2;
+  materializeAll(e);
+  if (setLocal >= 0)
+    materializeCopiesOf(e, setLocal, a);
+  e->depth += 2;
+
+  int result = setLocal >= 0 ? setLocal : a;
+  // a string can't be half of two numbers, nor a number half of two strings
+  bool numbers = !isNotNumber(e, a) && !isNotNumber(e, b);
+  bool strings = !isKnownNumber(e, a) && !isKnownNumber(e, b);
+  if (numbers) {
+    fprintf(e->out, "  if (");
+    if (!isKnownNumber(e, a)) {
+      fprintf(e->out, "IS_NUMBER(");
+      emitValue(e, a);
+      fprintf(e->out, ")%s", isKnownNumber(e, b) ? "" : " && ");
+    }
+    if (!isKnownNumber(e, b)) {
+      fprintf(e->out, "IS_NUMBER(");
+      emitValue(e, b);
+      fprintf(e->out, ")");
+    }
+    fprintf(e->out, ") {\n  slots[%d] = NUMBER_VAL(", result);
+    emitNumberOf(e, a);
+    fprintf(e->out, " + ");
+    emitNumberOf(e, b);
+    fprintf(e->out, ");\n");
+  }
+  if (strings) {
+    fprintf(e->out, numbers ? "  } else if (IS_STRING(" : "  if (IS_STRING(");
+    emitValue(e, a);
+    fprintf(e->out, ") && IS_STRING(");
+    emitValue(e, b);
+    fprintf(e->out, ")) {\n");
+    materialize(e, a);
+    materialize(e, b);
+    fprintf(e->out, "  AOT_SYNC(%d);\n  aotConcatenate();\n", e->depth);
+    if (setLocal >= 0)
+      fprintf(e->out, "  slots[%d] = slots[%d];\n", setLocal, a);
+  }
+  fprintf(e->out, numbers || strings ? "  } else {\n  " : "");
+  fprintf(e->out, "  return aotError(\"Operands must be two numbers or two "
+                  "strings.\");\n");
+  fprintf(e->out, numbers || strings ? "  }\n" : "");
+
+  e->depth--;
+  if (setLocal >= 0) {
+    e->entries[setLocal].kind = ENTRY_SLOT;
+    e->entries[a].kind = ENTRY_LOCAL;
+    e->entries[a].operand = setLocal;
+  } else {
+    e->entries[a].kind = ENTRY_SLOT;
+  }
+}
+
+/**
+ * The number only binary operators (and ==), result into the C local for the
+ * left operand's depth
+ */
+static void binary(Emitter *e, uint8_t op) {
+  int a = e->depth - 2;
+  int b = e->depth - 1;
+  const char *symbol;
+  bool compare = false;
+  switch (op) {
+  case OP_EQUAL:
+    if (isKnownNumber(e, a) && isKnownNumber(e, b)) {
+      symbol = "==";
+      compare = true;
+      break;
+    }
+    fprintf(e->out, "  c%d = valuesEqual(", a);
+    emitValue(e, a);
+    fprintf(e->out, ", ");
+    emitValue(e, b);
+    fprintf(e->out, ");\n");
+    e->depth--;
+    e->entries[a].kind = ENTRY_BOOL;
+    e->entries[a].operand = a;
+    return;
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_NUM:
+    symbol = "-";
+    break;
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_NUM:
+    symbol = "*";
+    break;
+  case OP_DIVIDE:
+  case OP_DIVIDE_NUM:
+    symbol = "/";
+    break;
+  case OP_GREATER:
+  case OP_GREATER_NUM:
+    symbol = ">";
+    compare = true;
+    break;
+  default: // OP_LESS, OP_LESS_NUM
+    symbol = "<";
+    compare = true;
+    break;
+  }
+  if (op != OP_EQUAL)
+    emitNumberCheck(e, a, b, "Operands must be numbers.");
+  fprintf(e->out, "  %c%d = ", compare ? 'c' : 'n', a);
+  emitNumberOf(e, a);
+  fprintf(e->out, " %s ", symbol);
+  emitNumberOf(e, b);
+  fprintf(e->out, ";\n");
+  e->depth--;
+  e->entries[a].kind = compare ? ENTRY_BOOL : ENTRY_NUMBER;
+  e->entries[a].operand = a;
+}
+
+/**
+ * Jumps to target if the value on top is falsey, keeping it. Everything goes
+ * to its slot first, except for the condition itself when the target only
+ * pops it again anyway
+ */
+static void jumpIfFalse(Emitter *e, int target) {
+  int top = e->depth - 1;
+  bool dead = e->chunk->code[target] == OP_POP;
+  e->depth--;
+  materializeAll(e);
+  e->depth++;
+  if (!dead)
+    materialize(e, top);
+  if (e->entries[top].kind == ENTRY_BOOL) {
+    fprintf(e->out, "  if (!c%d)\n", e->entries[top].operand);
+  } else {
+    fprintf(e->out, "  if (AOT_FALSEY(");
+    emitValue(e, top);
+    fprintf(e->out, "))\n");
+  }
+  fprintf(e->out, "    goto L%d;\n", target);
+}
+
+/**
+ * Writes out the instruction at offset
+ *
+ * @return int no. of bytecode bytes it took care of, more than the one
+ * instruction if it fused the next one in
+ */
+static int emitInstruction(Emitter *e, int offset) {
+  FILE *out = e->out;
+  Chunk *chunk = e->chunk;
+  uint8_t *code = chunk->code;
+  int length = instructionLength(chunk, offset);
+  int next = offset + length;
+  int d = e->depth;
+  switch (code[offset]) {
+  case OP_CONSTANT:
+    pushEntry(e, ENTRY_CONST, code[offset + 1]);
+    break;
+  case OP_CONSTANT_LONG:
+    pushEntry(e, ENTRY_CONST,
+         code[offset + 1] | (code[offset + 2] << 8) | (code[offset + 3] << 16));
+    break;
+  case OP_NIL:
+    fprintf(out, "  slots[%d] = NIL_VAL;\n", d);
+    pushEntry(e, ENTRY_SLOT, 0);
+    break;
+  case OP_TRUE:
+  case OP_FALSE:
+    fprintf(out, "  c%d = %s;\n", d, code[offset] == OP_TRUE ? "true" : "false");
+    pushEntry(e, ENTRY_BOOL, d);
+    break;
+  case OP_POP:
+    e->depth--;
+    break;
+  case OP_POPN:
+    e->depth -= code[offset + 1];
+    break;
+  case OP_GET_LOCAL: {
+    StackEntry local = e->entries[code[offset + 1]];
+    if (local.kind == ENTRY_SLOT) {
+      pushEntry(e, ENTRY_LOCAL, code[offset + 1]);
+    } else {
+      pushEntry(e, local.kind, local.operand); // a copy of a copy
+    }
+    break;
+  }
+  case OP_SET_LOCAL:
+    setLocal(e, code[offset + 1]);
+    break;
+  case OP_SET_LOCAL_POP:
+    setLocal(e, code[offset + 1]);
+    e->depth--;
+    break;
+  case OP_GET_GLOBAL: {
+    int slot = readShort(code, offset + 1);
+    fprintf(out,
+            "  if (IS_EMPTY(vm.globalValues.values[%d]))\n"
+            "    return aotError(\"Undefined variable '%%s'\", "
+            "AS_CSTRING(vm.globalNames.values[%d]));\n"
+            "  slots[%d] = vm.globalValues.values[%d];\n",
+            slot, slot, d, slot);
+    pushEntry(e, ENTRY_SLOT, 0);
+    break;
+  }
+  case OP_DEFINE_GLOBAL:
+    fprintf(out, "  vm.globalValues.values[%d] = ", readShort(code, offset + 1));
+    emitValue(e, d - 1);
+    fprintf(out, ";\n");
+    e->depth--;
+    break;
+  case OP_SET_GLOBAL: {
+    int slot = readShort(code, offset + 1);
+    fprintf(out,
+            "  if (IS_EMPTY(vm.globalValues.values[%d]))\n"
+            "    return aotError(\"Undefined variable '%%s'.\", "
+            "AS_CSTRING(vm.globalNames.values[%d]));\n"
+            "  vm.globalValues.values[%d] = ",
+            slot, slot, slot);
+    emitValue(e, d - 1);
+    fprintf(out, ";\n");
+    break;
+  }
+  case OP_GET_UPVALUE:
+    fprintf(out, "  slots[%d] = *frame->closure->upvalues[%d]->location;\n", d,
+            code[offset + 1]);
+    pushEntry(e, ENTRY_SLOT, 0);
+    break;
+  case OP_SET_UPVALUE:
+    fprintf(out,
+            "  {\n"
+            "    ObjUpvalue *upvalue = frame->closure->upvalues[%d];\n"
+            "    snapshotBarrier(&upvalue->obj);\n"
+            "    *upvalue->location = ",
+            code[offset + 1]);
+    emitValue(e, d - 1);
+    fprintf(out, ";\n"
+                 "    writeBarrier(&upvalue->obj, *upvalue->location);\n"
+                 "  }\n");
+    break;
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+    sync(e);
+    fprintf(out,
+            "  if (!%s(AS_STRING(constants[%d]), &caches[%d]))\n"
+            "    return false;\n",
+            code[offset] == OP_GET_PROPERTY ? "aotGetProperty"
+                                            : "aotSetProperty",
+            code[offset + 1], readShort(code, offset + 2));
+    if (code[offset] == OP_SET_PROPERTY)
+      e->depth--;
+    break;
+  case OP_ADD:
+  case OP_ADD_NUM:
+  case OP_ADD_STR:
+  case OP_ADD_LL:
+  case OP_ADD_LC: {
+    if (code[offset] == OP_ADD_LL || code[offset] == OP_ADD_LC) {
+      pushEntry(e, ENTRY_LOCAL, code[offset + 1]);
+      pushEntry(e, code[offset] == OP_ADD_LL ? ENTRY_LOCAL : ENTRY_CONST,
+                code[offset + 2]);
+    }
+    // fuses a following store to a local in, see add()
+    int local = -1;
+    if (next < chunk->count && !e->isTarget[next] &&
+        (code[next] == OP_SET_LOCAL || code[next] == OP_SET_LOCAL_POP))
+      local = code[next + 1];
+    add(e, local);
+    if (local < 0)
+      break;
+    if (code[next] == OP_SET_LOCAL_POP)
+      e->depth--;
+    return length + instructionLength(chunk, next);
+  }
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_SUBTRACT_NUM:
+  case OP_MULTIPLY_NUM:
+  case OP_DIVIDE_NUM:
+  case OP_GREATER_NUM:
+  case OP_LESS_NUM:
+    binary(e, code[offset]);
+    break;
+  case OP_LESS_LC_JIF:
+  case OP_LESS_LL_JIF: {
+    int target = jumpTarget(code, offset);
+    materializeAll(e);
+    pushEntry(e, ENTRY_LOCAL, code[offset + 1]);
+    pushEntry(e, code[offset] == OP_LESS_LL_JIF ? ENTRY_LOCAL : ENTRY_CONST,
+         code[offset + 2]);
+    binary(e, OP_LESS);
+    // the jump leaves a false behind, for the target to pop
+    if (code[target] == OP_POP) {
+      fprintf(out, "  if (!c%d)\n    goto L%d;\n", d, target);
+    } else {
+      fprintf(out,
+              "  if (!c%d) {\n    slots[%d] = BOOL_VAL(false);\n"
+              "    goto L%d;\n  }\n",
+              d, d, target);
+    }
+    e->depth--;
+    break;
+  }
+  case OP_NOT:
+    fprintf(out, "  c%d = ", d - 1);
+    if (e->entries[d - 1].kind == ENTRY_BOOL) {
+      fprintf(out, "!c%d;\n", e->entries[d - 1].operand);
+    } else {
+      fprintf(out, "AOT_FALSEY(");
+      emitValue(e, d - 1);
+      fprintf(out, ");\n");
+    }
+    e->entries[d - 1].kind = ENTRY_BOOL;
+    e->entries[d - 1].operand = d - 1;
+    break;
+  case OP_NEGATE:
+    if (!isKnownNumber(e, d - 1)) {
+      fprintf(out, "  if (!IS_NUMBER(");
+      emitValue(e, d - 1);
+      fprintf(out, "))\n    return aotError(\"Operant must be a number.\");\n");
+    }
+    fprintf(out, "  n%d = -(", d - 1);
+    emitNumberOf(e, d - 1);
+    fprintf(out, ");\n");
+    e->entries[d - 1].kind = ENTRY_NUMBER;
+    e->entries[d - 1].operand = d - 1;
+    break;
+  case OP_PRINT:
+    fprintf(out, "  printValue(");
+    emitValue(e, d - 1);
+    fprintf(out, ");\n  printf(\"\\n\");\n");
+    e->depth--;
+    break;
+  case OP_JUMP:
+  case OP_LOOP:
+    materializeAll(e);
+    fprintf(out, "  goto L%d;\n", jumpTarget(code, offset));
+    forgetAll(e);
+    break;
+  case OP_JUMP_IF_FALSE:
+    jumpIfFalse(e, jumpTarget(code, offset));
+    break;
+  case OP_CALL:
+  case OP_CALL_0:
+  case OP_CALL_1:
+  case OP_CALL_2:
+  case OP_CALL_3: {
+    int argCount = code[offset] == OP_CALL ? code[offset + 1]
+                                           : code[offset] - OP_CALL_0;
+    sync(e);
+    fprintf(out,
+            "  if (!aotCall(%d))\n"
+            "    return false;\n"
+            "  AOT_RELOAD();\n",
+            argCount);
+    e->depth -= argCount;
+    break;
+  }
+  case OP_TAIL_CALL:
+    sync(e);
+    fprintf(out,
+            "  {\n"
+            "    bool reused;\n"
+            "    if (!aotTailCall(%d, &reused))\n"
+            "      return false;\n"
+            "    if (reused)\n"
+            "      return true;\n"
+            "  }\n"
+            "  AOT_RELOAD();\n",
+            code[offset + 1]);
+    e->depth -= code[offset + 1];
+    break;
+  case OP_INVOKE:
+    sync(e);
+    fprintf(out,
+            "  if (!aotInvoke(AS_STRING(constants[%d]), %d, &caches[%d]))\n"
+            "    return false;\n"
+            "  AOT_RELOAD();\n",
+            code[offset + 1], code[offset + 2], readShort(code, offset + 3));
+    e->depth -= code[offset + 2];
+    break;
+  case OP_CLOSURE: {
+    int constant = code[offset + 1];
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+    sync(e);
+    fprintf(out,
+            "  {\n"
+            "    ObjClosure *closure = newClosure(AS_FUNCTION(constants[%d]));\n"
+            "    slots[%d] = OBJ_VAL(closure);\n",
+            constant, d);
+    pushEntry(e, ENTRY_SLOT, 0);
+    if (function->upvalueCount > 0)
+      fprintf(out, "    ObjUpvalue *upvalue;\n"
+                   "    AOT_SYNC(%d);\n",
+              e->depth);
+    for (int i = 0; i < function->upvalueCount; i++) {
+      uint8_t isLocal = code[offset + 2 + 2 * i];
+      uint8_t index = code[offset + 3 + 2 * i];
+      if (isLocal) {
+        fprintf(out, "    upvalue = aotCaptureUpvalue(&slots[%d]);\n", index);
+      } else {
+        fprintf(out, "    upvalue = frame->closure->upvalues[%d];\n", index);
+      }
+      fprintf(out,
+              "    snapshotBarrier(&closure->obj);\n"
+              "    closure->upvalues[%d] = upvalue;\n"
+              "    writeBarrier(&closure->obj, OBJ_VAL(upvalue));\n",
+              i);
+    }
+    fprintf(out, "  }\n");
+    break;
+  }
+  case OP_CLOSE_UPVALUE:
+    materializeAll(e);
+    fprintf(out, "  aotCloseUpvalues(&slots[%d]);\n", d - 1);
+    e->depth--;
+    break;
+  case OP_RETURN:
+    fprintf(out, "  return aotReturn(frame, ");
+    emitValue(e, d - 1);
+    fprintf(out, ");\n");
+    e->depth--;
+    forgetAll(e);
+    break;
+  case OP_RETURN_NIL:
+    fprintf(out, "  return aotReturn(frame, NIL_VAL);\n");
+    forgetAll(e);
+    break;
+  case OP_RETURN_LOCAL:
+    fprintf(out, "  return aotReturn(frame, ");
+    emitValue(e, code[offset + 1]);
+    fprintf(out, ");\n");
+    forgetAll(e);
+    break;
+  case OP_CLASS:
+    sync(e);
+    fprintf(out, "  slots[%d] = OBJ_VAL(newClass(AS_STRING(constants[%d])));\n",
+            d, code[offset + 1]);
+    pushEntry(e, ENTRY_SLOT, 0);
+    break;
+  case OP_METHOD:
+    sync(e);
+    fprintf(out, "  aotDefineMethod(AS_STRING(constants[%d]));\n",
+            code[offset + 1]);
+    e->depth--;
+    break;
+  case OP_INHERIT:
+    sync(e);
+    fprintf(out, "  if (!aotInherit())\n    return false;\n");
+    e->depth--;
+    break;
+  case OP_GET_SUPER:
+    sync(e);
+    fprintf(out,
+            "  if (!aotGetSuper(AS_STRING(constants[%d])))\n"
+            "    return false;\n",
+            code[offset + 1]);
+    e->depth--;
+    break;
+  case OP_SUPER_INVOKE:
+    sync(e);
+    fprintf(out,
+            "  if (!aotSuperInvoke(AS_STRING(constants[%d]), %d, &caches[%d]))\n"
+            "    return false;\n"
+            "  AOT_RELOAD();\n",
+            code[offset + 1], code[offset + 2], readShort(code, offset + 3));
+    e->depth -= code[offset + 2] + 1;
+    break;
+  default:
+    fprintf(out, "  return aotError(\"Unknown opcode %d.\");\n", code[offset]);
+    break;
+  }
+  return length;
+}
+
+static void emitFunction(FILE *out, FunctionList *list, int index) {
+  ObjFunction *function = list->functions[index];
+  Chunk *chunk = &function->chunk;
+  int *depths = malloc((chunk->count + 1) * sizeof(int));
+  bool *isTarget = calloc(chunk->count + 1, sizeof(bool));
+  int maxDepth = maxStackDepth(chunk, function->arity + 1, depths);
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    int target = jumpTarget(chunk->code, offset);
+    if (target != -1)
+      isTarget[target] = true;
+  }
+
+  fprintf(out, "// %s\nstatic bool fn%d(CallFrame *frame) {\n",
+          function->name == NULL ? "<script>" : function->name->chars, index);
+  fprintf(out, "  AOT_ENTER();\n");
+  for (int i = 0; i < maxDepth; i++) {
+    fprintf(out, "  double n%d;\n  bool c%d;\n", i, i);
+  }
+
+  Emitter e;
+  e.out = out;
+  e.chunk = chunk;
+  e.isTarget = isTarget;
+  e.entries = malloc((maxDepth + 1) * sizeof(StackEntry));
+  e.maxDepth = maxDepth;
+  e.depth = function->arity + 1;
+  forgetAll(&e);
+  for (int offset = 0; offset < chunk->count;) {
+    if (isTarget[offset]) {
+      materializeAll(&e);
+      fprintf(out, "L%d:;\n", offset);
+    }
+    // the same unless a jump or a return came right before
+    e.depth = depths[offset];
+    offset += emitInstruction(&e, offset);
+  }
+  fprintf(out, "}\n\n");
+
+  free(e.entries);
+  free(depths);
+  free(isTarget);
+}
+
+/**
+ * The constant table of function index, for the loader (see loxrt.c)
+ */
+static void emitConstants(FILE *out, FunctionList *list, int index) {
+  ValueArray *constants = &list->functions[index]->chunk.constants;
+  if (constants->count == 0)
+    return;
+  fprintf(out, "static const AotConstant constants%d[] = {\n", index);
+  for (int i = 0; i < constants->count; i++) {
+    Value value = constants->values[i];
+    if (IS_NUMBER(value)) {
+      fprintf(out, "    {AOT_NUMBER, ");
+      emitNumber(out, AS_NUMBER(value));
+      fprintf(out, ", NULL, 0, 0},\n");
+    } else if (IS_STRING(value)) {
+      fprintf(out, "    {AOT_STRING, 0, ");
+      emitString(out, AS_CSTRING(value), AS_STRING(value)->length);
+      fprintf(out, ", %d, 0},\n", AS_STRING(value)->length);
+    } else {
+      fprintf(out, "    {AOT_FUNCTION, 0, NULL, 0, %d},\n",
+              functionIndex(list, AS_FUNCTION(value)));
+    }
+  }
+  fprintf(out, "};\n");
+}
+
+bool emitC(const char *source, FILE *out) {
+  ObjFunction *script = compile(source);
+  if (script == NULL)
+    return false;
+
+  FunctionList list = {0};
+  collectFunctions(&list, script);
+
+  fprintf(out, "// Written by clox --emit-c. Build it against libloxrt and "
+               "the clox headers:\n"
+               "//   cc -O2 -I clox/include this.c libloxrt.a -lm -pthread\n\n");
+#ifdef NAN_BOXING
+  fprintf(out, "// this clox packs its values with NaN boxing\n"
+               "#define NAN_BOXING\n");
+#endif
+  fprintf(out, "#include \"loxrt.h\"\n\n");
+
+  for (int i = 0; i < list.count; i++) {
+    fprintf(out, "static bool fn%d(CallFrame *frame);\n", i);
+  }
+  fprintf(out, "\n");
+  for (int i = 0; i < list.count; i++) {
+    emitFunction(out, &list, i);
+  }
+
+  for (int i = 0; i < list.count; i++) {
+    emitConstants(out, &list, i);
+  }
+  fprintf(out, "\nstatic const AotFunction functions[] = {\n");
+  for (int i = 0; i < list.count; i++) {
+    ObjFunction *function = list.functions[i];
+    Chunk *chunk = &function->chunk;
+    fprintf(out, "    {");
+    if (function->name == NULL) {
+      fprintf(out, "NULL");
+    } else {
+      emitString(out, function->name->chars, function->name->length);
+    }
+    fprintf(out, ", %d, %d, %d, %d, %d, ", function->arity,
+            function->upvalueCount, function->maxStack, chunk->cacheCount,
+            chunk->constants.count);
+    if (chunk->constants.count == 0) {
+      fprintf(out, "NULL, fn%d},\n", i);
+    } else {
+      fprintf(out, "constants%d, fn%d},\n", i, i);
+    }
+  }
+  fprintf(out, "};\n\nstatic const char *globals[] = {\n");
+  for (int i = 0; i < vm.globalNames.count; i++) {
+    ObjString *name = AS_STRING(vm.globalNames.values[i]);
+    fprintf(out, "    ");
+    emitString(out, name->chars, name->length);
+    fprintf(out, ",\n");
+  }
+  fprintf(out,
+          "};\n\n"
+          "static const AotProgram program = {%d, globals, functions};\n\n"
+          "int main(void) { return aotMain(&program); }\n",
+          vm.globalNames.count);
+
+  free(list.functions);
+  return true;
+}
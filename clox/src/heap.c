@@ -0,0 +1,251 @@
+// The blocks clox --gc full and generational allocate objects from (see
+// heap.h). A collection marks into the blocks' bitmaps (heapMark()) and then
+// only makes every block due for a sweep. heapAllocate() sweeps a block when
+// it gets to it for a free cell. With full, the ones it never got to are
+// swept right before the next collection marks (heapFinishSweep()); with
+// generational they can wait, a dead object never gets marked again. So a
+// collection itself costs as much as there is alive, the dead objects get
+// paid for as the program allocates again.
+//
+// The blocks are plain aligned_alloc()ed, vm.bytesAllocated only counts the
+// objects in them (see allocateObjectMemory())
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+#include "memory.h"
+
+#define SIZE_CLASSES (CELL_MAX / CELL_GRANULE)
+
+/**
+ * blocks to last -> every block of the size class, oldest first
+ * cursor -> the one heapAllocate() takes cells from, the blocks before it
+ *           were swept and filled up since the last collection
+ */
+typedef struct {
+  Block *blocks;
+  Block *last;
+  Block *cursor;
+} SizeClass;
+
+static SizeClass classes[SIZE_CLASSES];
+static uint32_t collections; // see Block.sweptAt
+static bool keepsMarks; // the last collection was a generational one
+static long blockCount; // made so far
+static long sweptLazily; // blocks heapAllocate() swept
+static long sweptEarly;  // blocks heapFinishSweep() had to
+static long deadObjects; // freed by either
+
+static Block *newBlock(uint32_t cellSize) {
+  Block *block = (Block *)aligned_alloc(BLOCK_SIZE, BLOCK_SIZE);
+  if (block == NULL)
+    exit(1);
+  memset(block, 0, offsetof(Block, cells));
+  block->cellSize = cellSize;
+  block->cellCount =
+      (uint32_t)((BLOCK_SIZE - offsetof(Block, cells)) / cellSize);
+  block->sweptAt = collections;
+  blockCount++;
+  return block;
+}
+
+// how many bitmap words block's cells take up
+static int bitmapWords(Block *block) {
+  return (int)(block->cellCount * (block->cellSize / CELL_GRANULE) + 63) / 64;
+}
+
+static Obj *objectAt(Block *block, int word, int bit) {
+  return (Obj *)(block->cells + (size_t)(word * 64 + bit) * CELL_GRANULE);
+}
+
+/**
+ * Frees the objects in block the last collection didn't mark. A full one's
+ * marks get cleared for the next one, the generational ones stay (they're
+ * the old objects). Only the bitmaps and the dead objects get looked at,
+ * freeObject() hands their cells back through heapRelease()
+ */
+static void sweepBlock(Block *block) {
+  int words = bitmapWords(block);
+  for (int i = 0; i < words; i++) {
+    uint64_t dead = block->live[i] & ~block->marks[i];
+    while (dead != 0) {
+      int bit = __builtin_ctzll(dead);
+      dead &= dead - 1;
+      freeObject(objectAt(block, i, bit));
+      deadObjects++;
+    }
+  }
+  if (!keepsMarks)
+    memset(block->marks, 0, sizeof(block->marks));
+  block->sweptAt = collections;
+}
+
+/**
+ * A cell for an object of size bytes, NULL if that's more than CELL_MAX.
+ * Free cells come from the cursor's block, a block that's still due for a
+ * sweep is swept first, and past the last block there's a new one
+ */
+void *heapAllocate(size_t size) {
+  if (size == 0 || size > CELL_MAX)
+    return NULL;
+  int index = (int)((size - 1) / CELL_GRANULE);
+  SizeClass *sizeClass = &classes[index];
+  for (;;) {
+    Block *block = sizeClass->cursor;
+    if (block == NULL) {
+      block = newBlock((uint32_t)(index + 1) * CELL_GRANULE);
+      if (sizeClass->last != NULL) {
+        sizeClass->last->next = block;
+      } else {
+        sizeClass->blocks = block;
+      }
+      sizeClass->last = block;
+      sizeClass->cursor = block;
+    }
+    if (block->sweptAt != collections) {
+      sweepBlock(block);
+      sweptLazily++;
+    }
+
+    void *cell;
+    if (block->freeList != NULL) {
+      cell = block->freeList;
+      block->freeList = *(void **)cell;
+    } else if (block->fresh < block->cellCount) {
+      cell = block->cells + (size_t)block->fresh++ * block->cellSize;
+    } else {
+      sizeClass->cursor = block->next;
+      continue;
+    }
+    uint32_t at = bitOf(block, (Obj *)cell);
+    block->live[at / 64] |= (uint64_t)1 << (at % 64);
+    return cell;
+  }
+}
+
+void heapRelease(Obj *object) {
+  Block *block = blockOf(object);
+  uint32_t at = bitOf(block, object);
+  block->live[at / 64] &= ~((uint64_t)1 << (at % 64));
+  *(void **)object = block->freeList;
+  block->freeList = object;
+}
+
+/**
+ * Sets object's mark bit, atomically while markers run in parallel (see
+ * traceInParallel())
+ *
+ * @return bool whether it wasn't set yet
+ */
+bool heapMark(Obj *object, bool atomic) {
+  Block *block = blockOf(object);
+  uint32_t at = bitOf(block, object);
+  uint64_t *word = &block->marks[at / 64];
+  uint64_t bit = (uint64_t)1 << (at % 64);
+  if (atomic) {
+    return !(__atomic_load_n(word, __ATOMIC_RELAXED) & bit) &&
+           !(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
+  }
+  if (*word & bit)
+    return false;
+  *word |= bit;
+  return true;
+}
+
+/**
+ * Marking's over: every block is due for a sweep, and heapAllocate() starts
+ * over at the first block of each size class
+ *
+ * @param keepMarks whether the sweeps leave the marks be (generational)
+ */
+void heapStartSweep(bool keepMarks) {
+  collections++;
+  keepsMarks = keepMarks;
+  for (int i = 0; i < SIZE_CLASSES; i++) {
+    classes[i].cursor = classes[i].blocks;
+  }
+}
+
+/**
+ * Sweeps what heapAllocate() didn't get to since the last collection: the
+ * next full one is about to mark over those bitmaps, or the collector is
+ * switching and keepMarks with it
+ */
+void heapFinishSweep() {
+  for (int i = 0; i < SIZE_CLASSES; i++) {
+    for (Block *block = classes[i].blocks; block != NULL;
+         block = block->next) {
+      if (block->sweptAt != collections) {
+        sweepBlock(block);
+        sweptEarly++;
+      }
+    }
+  }
+}
+
+/**
+ * Marks every object in the blocks (everything's old), or none of them, for
+ * a major collection or a switch of collectors. The sweeps have to be done
+ */
+void heapSetMarks(bool marked) {
+  for (int i = 0; i < SIZE_CLASSES; i++) {
+    for (Block *block = classes[i].blocks; block != NULL;
+         block = block->next) {
+      if (marked) {
+        memcpy(block->marks, block->live, sizeof(block->marks));
+      } else {
+        memset(block->marks, 0, sizeof(block->marks));
+      }
+    }
+  }
+}
+
+bool heapInUse() {
+  for (int i = 0; i < SIZE_CLASSES; i++) {
+    if (classes[i].blocks != NULL)
+      return true;
+  }
+  return false;
+}
+
+/**
+ * Calls visit for every object in the blocks, visit may free it
+ */
+void heapForEach(void (*visit)(Obj *object)) {
+  for (int i = 0; i < SIZE_CLASSES; i++) {
+    for (Block *block = classes[i].blocks; block != NULL;
+         block = block->next) {
+      int words = bitmapWords(block);
+      for (int j = 0; j < words; j++) {
+        uint64_t live = block->live[j];
+        while (live != 0) {
+          int bit = __builtin_ctzll(live);
+          live &= live - 1;
+          visit(objectAt(block, j, bit));
+        }
+      }
+    }
+  }
+}
+
+void reportHeap(FILE *out) {
+  fprintf(out,
+          "%ld blocks of %d KB, swept %ld as they were needed and %ld "
+          "before the next collection, %ld objects freed\n",
+          blockCount, BLOCK_SIZE / 1024, sweptLazily, sweptEarly, deadObjects);
+}
+
+void freeHeap() {
+  for (int i = 0; i < SIZE_CLASSES; i++) {
+    Block *block = classes[i].blocks;
+    while (block != NULL) {
+      Block *next = block->next;
+      free(block);
+      block = next;
+    }
+    classes[i].blocks = NULL;
+    classes[i].last = NULL;
+    classes[i].cursor = NULL;
+  }
+}
@@ -0,0 +1,929 @@
+// Baseline template JIT: once a function gets hot, every instruction of its
+// chunk is pasted as a fixed piece of x86-64 machine code, one after another,
+// so the loop body runs without run()'s dispatch in between.
+//
+// The machine code keeps working on the same vm stack and CallFrame as run()
+// does, which is what makes going back and forth between the two cheap:
+//  - the machine code does the common case of an instruction (numbers, locals,
+//    globals, jumps) itself
+//  - everything else (calls, returns, allocation, type errors, ...) leaves the
+//    machine code right *before* that instruction with the frame written back,
+//    and run() simply carries on from there, doing the instruction the usual
+//    way
+//  - run() hands the frame back (jitRun()) whenever it's entered, loops or
+//    gets back to it after a call (see ENTER_JIT() in vm.c)
+
+#include "jit.h"
+
+#ifdef JIT_ENABLED
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+typedef void (*JitEntry)(Value *sp, Value *slots, CallFrame *frame, VM *vm,
+                         uint8_t *target);
+
+// run() only hands a frame over if the machine code gets at least this many
+// instructions in before it exits again, entering and leaving costs about as
+// much as run() doing a couple of them itself
+#define MIN_RUN 4
+
+// x86-64 registers, in their encoding order
+enum {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+// what the machine code keeps in the callee saved registers
+#define REG_SP RBX    // one past the top of the vm stack (run()'s sp)
+#define REG_SLOTS R12 // the frame's slot 0
+#define REG_FRAME R13 // the CallFrame
+#define REG_VM R14    // &vm
+
+// condition codes, for jcc/setcc
+enum {
+  CC_B = 0x2,
+  CC_AE = 0x3,
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_BE = 0x6,
+  CC_A = 0x7,
+};
+
+#define VALUE_SIZE ((int)sizeof(Value))
+#ifdef NAN_BOXING
+#define VALUE_SHIFT 3
+#define NUMBER_OFFSET 0
+#else
+#define VALUE_SHIFT 4
+#define NUMBER_OFFSET ((int)offsetof(Value, as.number))
+#endif
+
+// where the value distance slots down from the top of the stack lives
+#define PEEK_DISP(distance) (-VALUE_SIZE * (1 + (distance)))
+#define SLOT_DISP(slot) (VALUE_SIZE * (slot))
+
+/**
+ * The machine code being written out, plus what's needed to fix up jumps once
+ * everything's been laid out
+ */
+typedef struct {
+  uint8_t *code;
+  int count;
+  int capacity;
+  Chunk *chunk;
+  uint32_t *entries;
+  int exitCode; // offset of the shared exit sequence
+  int *jumpFrom; // rel32 operands of jumps to a bytecode offset
+  int *jumpTo;
+  int jumpCount;
+  int *exitFrom; // rel32 operands of jumps that leave the machine code
+  int *exitAt;   // at this bytecode offset
+  int exitCount;
+  int fixupCapacity;
+  bool leaves; // the last instruction written out always exits
+} Assembler;
+
+static void emitByte(Assembler *a, uint8_t byte) {
+  if (a->count == a->capacity) {
+    a->capacity = a->capacity < 256 ? 256 : a->capacity * 2;
+    a->code = realloc(a->code, a->capacity);
+    if (a->code == NULL)
+      exit(1);
+  }
+  a->code[a->count++] = byte;
+}
+
+static void emit32(Assembler *a, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    emitByte(a, (value >> (8 * i)) & 0xff);
+  }
+}
+
+static void emit64(Assembler *a, uint64_t value) {
+  emit32(a, (uint32_t)value);
+  emit32(a, (uint32_t)(value >> 32));
+}
+
+static void patch32(Assembler *a, int offset, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    a->code[offset + i] = (value >> (8 * i)) & 0xff;
+  }
+}
+
+/**
+ * REX prefix, left out when it would be a plain 0x40
+ */
+static void rex(Assembler *a, bool wide, int reg, int base) {
+  uint8_t prefix = 0x40 | (wide ? 8 : 0) | ((reg >> 3) << 2) | (base >> 3);
+  if (prefix != 0x40)
+    emitByte(a, prefix);
+}
+
+/**
+ * ModRM (+ SIB) for [base + disp32], always the disp32 form to keep it simple
+ */
+static void memOperand(Assembler *a, int reg, int base, int32_t disp) {
+  emitByte(a, 0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP)
+    emitByte(a, 0x24); // rsp/r12 as a base need a SIB byte
+  emit32(a, (uint32_t)disp);
+}
+
+static void regOperand(Assembler *a, int reg, int rm) {
+  emitByte(a, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// mov reg, [base + disp] (64 bit)
+static void loadReg(Assembler *a, int reg, int base, int32_t disp) {
+  rex(a, true, reg, base);
+  emitByte(a, 0x8b);
+  memOperand(a, reg, base, disp);
+}
+
+// mov [base + disp], reg (64 bit)
+static void storeReg(Assembler *a, int base, int32_t disp, int reg) {
+  rex(a, true, reg, base);
+  emitByte(a, 0x89);
+  memOperand(a, reg, base, disp);
+}
+
+// mov dword [base + disp], reg
+static void storeReg32(Assembler *a, int base, int32_t disp, int reg) {
+  rex(a, false, reg, base);
+  emitByte(a, 0x89);
+  memOperand(a, reg, base, disp);
+}
+
+// mov dst, src (64 bit)
+static void moveReg(Assembler *a, int dst, int src) {
+  rex(a, true, src, dst);
+  emitByte(a, 0x89);
+  regOperand(a, src, dst);
+}
+
+// mov reg, imm64
+static void loadImmediate(Assembler *a, int reg, uint64_t value) {
+  rex(a, true, 0, reg);
+  emitByte(a, 0xb8 + (reg & 7));
+  emit64(a, value);
+}
+
+// lea reg, [base + disp]
+static void loadAddress(Assembler *a, int reg, int base, int32_t disp) {
+  rex(a, true, reg, base);
+  emitByte(a, 0x8d);
+  memOperand(a, reg, base, disp);
+}
+
+// cmp byte [base + disp], imm8
+static void compareByte(Assembler *a, int base, int32_t disp, uint8_t value) {
+  rex(a, false, 0, base);
+  emitByte(a, 0x80);
+  memOperand(a, 7, base, disp);
+  emitByte(a, value);
+}
+
+// xor byte [base + disp], imm8
+static void xorByte(Assembler *a, int base, int32_t disp, uint8_t value) {
+  rex(a, false, 0, base);
+  emitByte(a, 0x80);
+  memOperand(a, 6, base, disp);
+  emitByte(a, value);
+}
+
+// NaN boxing checks and makes values a whole word at a time, the tagged
+// union through its type field
+#ifdef NAN_BOXING
+// cmp left, right (64 bit)
+static void compareReg(Assembler *a, int left, int right) {
+  rex(a, true, right, left);
+  emitByte(a, 0x39);
+  regOperand(a, right, left);
+}
+
+// and dst, src (64 bit)
+static void andReg(Assembler *a, int dst, int src) {
+  rex(a, true, src, dst);
+  emitByte(a, 0x21);
+  regOperand(a, src, dst);
+}
+
+// add dst, src (64 bit)
+static void addReg(Assembler *a, int dst, int src) {
+  rex(a, true, src, dst);
+  emitByte(a, 0x01);
+  regOperand(a, src, dst);
+}
+#else
+// mov dword [base + disp], imm32, or the qword sign extended one if wide
+static void storeImmediate(Assembler *a, bool wide, int base, int32_t disp,
+                           uint32_t value) {
+  rex(a, wide, 0, base);
+  emitByte(a, 0xc7);
+  memOperand(a, 0, base, disp);
+  emit32(a, value);
+}
+
+// cmp dword [base + disp], imm8
+static void compareImmediate(Assembler *a, int base, int32_t disp,
+                             uint8_t value) {
+  rex(a, false, 0, base);
+  emitByte(a, 0x83);
+  memOperand(a, 7, base, disp);
+  emitByte(a, value);
+}
+#endif
+
+/**
+ * SSE2 scalar double ops: prefix 0F op with a memory or a register operand,
+ * xmm0 to xmm7 only
+ */
+static void sseLoad(Assembler *a, uint8_t prefix, uint8_t op, int xmm,
+                    int base, int32_t disp) {
+  if (prefix != 0)
+    emitByte(a, prefix);
+  rex(a, false, xmm, base);
+  emitByte(a, 0x0f);
+  emitByte(a, op);
+  memOperand(a, xmm, base, disp);
+}
+
+static void sseRegs(Assembler *a, uint8_t prefix, uint8_t op, int dst,
+                    int src) {
+  emitByte(a, prefix);
+  emitByte(a, 0x0f);
+  emitByte(a, op);
+  regOperand(a, dst, src);
+}
+
+#define MOVSD_LOAD 0x10
+#define MOVSD_STORE 0x11
+#define ADDSD 0x58
+#define MULSD 0x59
+#define SUBSD 0x5c
+#define DIVSD 0x5e
+
+// setcc al, then movzx eax, al
+static void setFlag(Assembler *a, int cc) {
+  emitByte(a, 0x0f);
+  emitByte(a, 0x90 + cc);
+  emitByte(a, 0xc0);
+  emitByte(a, 0x0f);
+  emitByte(a, 0xb6);
+  emitByte(a, 0xc0);
+}
+
+/**
+ * jcc/jmp rel32 with the distance left blank, returns where it goes
+ */
+static int emitJump(Assembler *a, int cc) {
+  if (cc < 0) {
+    emitByte(a, 0xe9);
+  } else {
+    emitByte(a, 0x0f);
+    emitByte(a, 0x80 + cc);
+  }
+  emit32(a, 0);
+  return a->count - 4;
+}
+
+static void patchJumpTo(Assembler *a, int operand, int target) {
+  patch32(a, operand, (uint32_t)(target - (operand + 4)));
+}
+
+static void patchJumpHere(Assembler *a, int operand) {
+  patchJumpTo(a, operand, a->count);
+}
+
+static void addFixup(Assembler *a, int **from, int **to, int *count,
+                     int operand, int offset) {
+  if (*count == a->fixupCapacity) {
+    int capacity = a->fixupCapacity < 16 ? 16 : a->fixupCapacity * 2;
+    a->jumpFrom = realloc(a->jumpFrom, capacity * sizeof(int));
+    a->jumpTo = realloc(a->jumpTo, capacity * sizeof(int));
+    a->exitFrom = realloc(a->exitFrom, capacity * sizeof(int));
+    a->exitAt = realloc(a->exitAt, capacity * sizeof(int));
+    a->fixupCapacity = capacity;
+  }
+  (*from)[*count] = operand;
+  (*to)[*count] = offset;
+  (*count)++;
+}
+
+/**
+ * Jumps (cc < 0: always) to the machine code of the instruction at bytecode
+ * offset target
+ */
+static void jumpTo(Assembler *a, int cc, int target) {
+  int operand = emitJump(a, cc);
+  addFixup(a, &a->jumpFrom, &a->jumpTo, &a->jumpCount, operand, target);
+}
+
+/**
+ * Leaves the machine code (if cc holds, cc < 0: always), run() picks up at
+ * the instruction at bytecode offset with the stack as it is
+ */
+static void exitAt(Assembler *a, int cc, int offset) {
+  if (cc < 0) {
+    loadImmediate(a, RAX, (uint64_t)(uintptr_t)(a->chunk->code + offset));
+    patchJumpTo(a, emitJump(a, -1), a->exitCode);
+    return;
+  }
+  int operand = emitJump(a, cc);
+  addFixup(a, &a->exitFrom, &a->exitAt, &a->exitCount, operand, offset);
+}
+
+/**
+ * call fn, with whatever arguments are in the registers already
+ */
+static void callFunction(Assembler *a, void *fn) {
+  loadImmediate(a, RAX, (uint64_t)(uintptr_t)fn);
+  emitByte(a, 0xff); // call rax
+  emitByte(a, 0xd0);
+}
+
+/**
+ * call fn(rdi = top of the stack + distance), for the helpers below
+ */
+static void callHelper(Assembler *a, void *fn, int32_t disp) {
+  loadAddress(a, RDI, REG_SP, disp);
+  callFunction(a, fn);
+}
+
+// ---- Values ----
+
+/**
+ * Values are moved as (and the type written as a whole) 8 byte word, a 16
+ * byte load of something that was just stored in smaller pieces can't be
+ * forwarded from the store buffer and stalls for the both of them
+ */
+static void copyValue(Assembler *a, int dstBase, int32_t dstDisp, int srcBase,
+                      int32_t srcDisp) {
+  loadReg(a, RAX, srcBase, srcDisp);
+#ifndef NAN_BOXING
+  loadReg(a, RDX, srcBase, srcDisp + 8);
+  storeReg(a, dstBase, dstDisp + 8, RDX);
+#endif
+  storeReg(a, dstBase, dstDisp, RAX);
+}
+
+/**
+ * rsi = the frame's closure's upvalue index, rcx = where its value is
+ */
+static void loadUpvalue(Assembler *a, int index) {
+  loadReg(a, RCX, REG_FRAME, offsetof(CallFrame, closure));
+  loadReg(a, RCX, RCX, offsetof(ObjClosure, upvalues));
+  loadReg(a, RSI, RCX, index * (int)sizeof(ObjUpvalue *));
+  loadReg(a, RCX, RSI, offsetof(ObjUpvalue, location));
+}
+
+/**
+ * Stores one of nil/true/false/empty
+ */
+static void storeLiteral(Assembler *a, int base, int32_t disp, Value value) {
+#ifdef NAN_BOXING
+  loadImmediate(a, RAX, value);
+  storeReg(a, base, disp, RAX);
+#else
+  storeImmediate(a, true, base, disp, value.type);
+  storeImmediate(a, true, base, disp + offsetof(Value, as),
+                 IS_BOOL(value) ? AS_BOOL(value) : 0);
+#endif
+}
+
+/**
+ * Leaves at offset unless the value at [base + disp] is a number
+ */
+static void checkNumber(Assembler *a, int base, int32_t disp, int offset) {
+#ifdef NAN_BOXING
+  loadReg(a, RAX, base, disp);
+  loadImmediate(a, RDX, QNAN);
+  andReg(a, RAX, RDX);
+  compareReg(a, RAX, RDX);
+  exitAt(a, CC_E, offset);
+#else
+  compareImmediate(a, base, disp + offsetof(Value, type), VAL_NUMBER);
+  exitAt(a, CC_NE, offset);
+#endif
+}
+
+static void loadNumber(Assembler *a, int xmm, int base, int32_t disp) {
+  sseLoad(a, 0xf2, MOVSD_LOAD, xmm, base, disp + NUMBER_OFFSET);
+}
+
+static void storeNumber(Assembler *a, int base, int32_t disp) {
+#ifndef NAN_BOXING
+  storeImmediate(a, true, base, disp + offsetof(Value, type), VAL_NUMBER);
+#endif
+  sseLoad(a, 0xf2, MOVSD_STORE, 0, base, disp + NUMBER_OFFSET);
+}
+
+/**
+ * Stores true if cc holds (from the last compare), else false
+ */
+static void storeCondition(Assembler *a, int cc, int base, int32_t disp) {
+  setFlag(a, cc);
+#ifdef NAN_BOXING
+  loadImmediate(a, RDX, FALSE_VAL); // TRUE_VAL is FALSE_VAL + 1
+  addReg(a, RAX, RDX);
+  storeReg(a, base, disp, RAX);
+#else
+  storeImmediate(a, true, base, disp + offsetof(Value, type), VAL_BOOL);
+  storeReg(a, base, disp + offsetof(Value, as), RAX);
+#endif
+}
+
+/**
+ * Jumps to the bytecode offset target if the value at [base + disp] is falsey
+ */
+static void jumpIfFalsey(Assembler *a, int base, int32_t disp, int target) {
+#ifdef NAN_BOXING
+  loadReg(a, RAX, base, disp);
+  loadImmediate(a, RDX, NIL_VAL);
+  compareReg(a, RAX, RDX);
+  jumpTo(a, CC_E, target);
+  loadImmediate(a, RDX, FALSE_VAL);
+  compareReg(a, RAX, RDX);
+  jumpTo(a, CC_E, target);
+#else
+  compareImmediate(a, base, disp + offsetof(Value, type), VAL_NIL);
+  jumpTo(a, CC_E, target);
+  compareImmediate(a, base, disp + offsetof(Value, type), VAL_BOOL);
+  int notBool = emitJump(a, CC_NE);
+  compareByte(a, base, disp + offsetof(Value, as.boolean), 0);
+  jumpTo(a, CC_E, target);
+  patchJumpHere(a, notBool);
+#endif
+}
+
+static void adjustStack(Assembler *a, int values) {
+  loadAddress(a, REG_SP, REG_SP, values * VALUE_SIZE);
+}
+
+// ---- Helpers the machine code calls for what's too long to inline ----
+
+static void jitEqual(Value *top) {
+  top[-1] = BOOL_VAL(valuesEqual(top[-1], top[0]));
+}
+
+static void jitNot(Value *top) {
+  *top = BOOL_VAL(IS_NIL(*top) || (IS_BOOL(*top) && !AS_BOOL(*top)));
+}
+
+static void jitPrint(Value *top) {
+  printValue(*top);
+  printf("\n");
+}
+
+static void jitUpvalueBarrier(ObjUpvalue *upvalue, Value *value) {
+  writeBarrier(&upvalue->obj, *value);
+}
+
+static void jitSnapshotUpvalue(ObjUpvalue *upvalue) {
+  snapshotBarrier(&upvalue->obj);
+}
+
+// ---- Templates ----
+
+/**
+ * Numbers only: left op right for the two values on top. Anything else leaves
+ * for run() (strings, errors)
+ */
+static void arithmetic(Assembler *a, int offset, uint8_t op) {
+  checkNumber(a, REG_SP, PEEK_DISP(1), offset);
+  checkNumber(a, REG_SP, PEEK_DISP(0), offset);
+  loadNumber(a, 0, REG_SP, PEEK_DISP(1));
+  loadNumber(a, 1, REG_SP, PEEK_DISP(0));
+  sseRegs(a, 0xf2, op, 0, 1);
+  storeNumber(a, REG_SP, PEEK_DISP(1));
+  adjustStack(a, -1);
+}
+
+/**
+ * left > right (greater) or left < right, negated for a `<=`/`>=` (the
+ * comparison followed by OP_NOT). ucomisd leaves CF and ZF set for NaNs, so
+ * "above" is false and "below or equal" is true for those, like in C
+ */
+static void comparison(Assembler *a, int offset, bool greater, bool negate) {
+  checkNumber(a, REG_SP, PEEK_DISP(1), offset);
+  checkNumber(a, REG_SP, PEEK_DISP(0), offset);
+  loadNumber(a, 0, REG_SP, PEEK_DISP(1));
+  loadNumber(a, 1, REG_SP, PEEK_DISP(0));
+  if (greater) {
+    sseRegs(a, 0x66, 0x2e, 0, 1); // ucomisd xmm0, xmm1
+  } else {
+    sseRegs(a, 0x66, 0x2e, 1, 0); // right > left
+  }
+  storeCondition(a, negate ? CC_BE : CC_A, REG_SP, PEEK_DISP(1));
+  adjustStack(a, -1);
+}
+
+/**
+ * OP_LESS_LC_JIF/OP_LESS_LL_JIF: left (a local) < right, or else push false
+ * and jump. xmm1 has to hold right already
+ */
+static void lessJump(Assembler *a, int offset, int left, int target) {
+  checkNumber(a, REG_SLOTS, SLOT_DISP(left), offset);
+  loadNumber(a, 0, REG_SLOTS, SLOT_DISP(left));
+  sseRegs(a, 0x66, 0x2e, 1, 0); // ucomisd xmm1, xmm0
+  int less = emitJump(a, CC_A);
+  storeLiteral(a, REG_SP, 0, BOOL_VAL(false));
+  adjustStack(a, 1);
+  jumpTo(a, -1, target);
+  patchJumpHere(a, less);
+}
+
+/**
+ * Writes out the instruction at offset, gives back how many bytecode bytes it
+ * took care of (more than the one instruction if it fused the next one in)
+ */
+static int emitInstruction(Assembler *a, int offset, bool *isTarget) {
+  Chunk *chunk = a->chunk;
+  uint8_t *code = chunk->code;
+  Value *constants = chunk->constants.values;
+  int length = instructionLength(chunk, offset);
+  int next = offset + length;
+
+  switch (code[offset]) {
+  case OP_CONSTANT:
+    loadImmediate(a, RCX,
+                  (uint64_t)(uintptr_t)&constants[code[offset + 1]]);
+    copyValue(a, REG_SP, 0, RCX, 0);
+    adjustStack(a, 1);
+    break;
+  case OP_NIL:
+    storeLiteral(a, REG_SP, 0, NIL_VAL);
+    adjustStack(a, 1);
+    break;
+  case OP_TRUE:
+    storeLiteral(a, REG_SP, 0, BOOL_VAL(true));
+    adjustStack(a, 1);
+    break;
+  case OP_FALSE:
+    storeLiteral(a, REG_SP, 0, BOOL_VAL(false));
+    adjustStack(a, 1);
+    break;
+  case OP_POP:
+    adjustStack(a, -1);
+    break;
+  case OP_POPN:
+    adjustStack(a, -code[offset + 1]);
+    break;
+  case OP_GET_LOCAL:
+    copyValue(a, REG_SP, 0, REG_SLOTS, SLOT_DISP(code[offset + 1]));
+    adjustStack(a, 1);
+    break;
+  case OP_SET_LOCAL:
+    copyValue(a, REG_SLOTS, SLOT_DISP(code[offset + 1]), REG_SP,
+              PEEK_DISP(0));
+    break;
+  case OP_SET_LOCAL_POP:
+    copyValue(a, REG_SLOTS, SLOT_DISP(code[offset + 1]), REG_SP,
+              PEEK_DISP(0));
+    adjustStack(a, -1);
+    break;
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_DEFINE_GLOBAL: {
+    // vm.globalValues can move when more code gets compiled, so it's looked
+    // up every time
+    int32_t slot = SLOT_DISP(readShort(code, offset + 1));
+    loadReg(a, RCX, REG_VM,
+            offsetof(VM, globalValues) + offsetof(ValueArray, values));
+    if (code[offset] != OP_DEFINE_GLOBAL) {
+#ifdef NAN_BOXING
+      loadReg(a, RAX, RCX, slot);
+      loadImmediate(a, RDX, EMPTY_VAL);
+      compareReg(a, RAX, RDX);
+#else
+      compareImmediate(a, RCX, slot + offsetof(Value, type), VAL_EMPTY);
+#endif
+      exitAt(a, CC_E, offset); // undefined, run() reports it
+    }
+    if (code[offset] == OP_GET_GLOBAL) {
+      copyValue(a, REG_SP, 0, RCX, slot);
+      adjustStack(a, 1);
+    } else {
+      copyValue(a, RCX, slot, REG_SP, PEEK_DISP(0));
+      if (code[offset] == OP_DEFINE_GLOBAL)
+        adjustStack(a, -1);
+    }
+    break;
+  }
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+    loadUpvalue(a, code[offset + 1]);
+    if (code[offset] == OP_GET_UPVALUE) {
+      copyValue(a, REG_SP, 0, RCX, 0);
+      adjustStack(a, 1);
+    } else {
+      if (vm.gcMode == GC_CONCURRENT) {
+        // snapshotBarrier() comes before the store, the call doesn't leave
+        // RCX and RSI alone though
+        moveReg(a, RDI, RSI);
+        callFunction(a, jitSnapshotUpvalue);
+        loadUpvalue(a, code[offset + 1]);
+      }
+      copyValue(a, RCX, 0, REG_SP, PEEK_DISP(0));
+      // writeBarrier(), only an old upvalue has to go and check the value.
+      // One in heap.c's blocks has its mark on the side, the call looks
+      compareByte(a, RSI, offsetof(ObjUpvalue, obj.isMarked), 0);
+      int old = emitJump(a, CC_NE);
+      compareByte(a, RSI, offsetof(ObjUpvalue, obj.inBlock), 0);
+      int young = emitJump(a, CC_E);
+      patchJumpHere(a, old);
+      moveReg(a, RDI, RSI);
+      loadAddress(a, RSI, REG_SP, PEEK_DISP(0));
+      callFunction(a, jitUpvalueBarrier);
+      patchJumpHere(a, young);
+    }
+    break;
+  case OP_EQUAL:
+    callHelper(a, jitEqual, PEEK_DISP(0));
+    adjustStack(a, -1);
+    break;
+  case OP_GREATER:
+  case OP_GREATER_NUM:
+  case OP_LESS:
+  case OP_LESS_NUM: {
+    bool greater =
+        code[offset] == OP_GREATER || code[offset] == OP_GREATER_NUM;
+    bool negate = next < chunk->count && code[next] == OP_NOT &&
+                  !isTarget[next];
+    comparison(a, offset, greater, negate);
+    if (negate)
+      return length + 1;
+    break;
+  }
+  case OP_ADD:
+  case OP_ADD_NUM:
+  case OP_ADD_STR:
+    arithmetic(a, offset, ADDSD);
+    break;
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_NUM:
+    arithmetic(a, offset, SUBSD);
+    break;
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_NUM:
+    arithmetic(a, offset, MULSD);
+    break;
+  case OP_DIVIDE:
+  case OP_DIVIDE_NUM:
+    arithmetic(a, offset, DIVSD);
+    break;
+  case OP_NOT:
+    callHelper(a, jitNot, PEEK_DISP(0));
+    break;
+  case OP_NEGATE:
+    checkNumber(a, REG_SP, PEEK_DISP(0), offset);
+    xorByte(a, REG_SP, PEEK_DISP(0) + NUMBER_OFFSET + 7, 0x80); // sign bit
+    break;
+  case OP_PRINT:
+    callHelper(a, jitPrint, PEEK_DISP(0));
+    adjustStack(a, -1);
+    break;
+  case OP_JUMP:
+  case OP_LOOP:
+    jumpTo(a, -1, jumpTarget(code, offset));
+    break;
+  case OP_JUMP_IF_FALSE:
+    jumpIfFalsey(a, REG_SP, PEEK_DISP(0), jumpTarget(code, offset));
+    break;
+  case OP_ADD_LL:
+  case OP_ADD_LC: {
+    int left = SLOT_DISP(code[offset + 1]);
+    checkNumber(a, REG_SLOTS, left, offset);
+    if (code[offset] == OP_ADD_LL) {
+      checkNumber(a, REG_SLOTS, SLOT_DISP(code[offset + 2]), offset);
+      loadNumber(a, 1, REG_SLOTS, SLOT_DISP(code[offset + 2]));
+    } else if (IS_NUMBER(constants[code[offset + 2]])) {
+      loadImmediate(a, RCX,
+                    (uint64_t)(uintptr_t)&constants[code[offset + 2]]);
+      loadNumber(a, 1, RCX, 0);
+    } else {
+      exitAt(a, -1, offset);
+      a->leaves = true;
+      break;
+    }
+    loadNumber(a, 0, REG_SLOTS, left);
+    sseRegs(a, 0xf2, ADDSD, 0, 1);
+    storeNumber(a, REG_SP, 0);
+    adjustStack(a, 1);
+    break;
+  }
+  case OP_LESS_LC_JIF:
+    if (!IS_NUMBER(constants[code[offset + 2]])) {
+      exitAt(a, -1, offset);
+      a->leaves = true;
+      break;
+    }
+    loadImmediate(a, RCX, (uint64_t)(uintptr_t)&constants[code[offset + 2]]);
+    loadNumber(a, 1, RCX, 0);
+    lessJump(a, offset, code[offset + 1], jumpTarget(code, offset));
+    break;
+  case OP_LESS_LL_JIF:
+    checkNumber(a, REG_SLOTS, SLOT_DISP(code[offset + 2]), offset);
+    loadNumber(a, 1, REG_SLOTS, SLOT_DISP(code[offset + 2]));
+    lessJump(a, offset, code[offset + 1], jumpTarget(code, offset));
+    break;
+  default:
+    // calls, returns, closures, classes, properties: all run()'s
+    exitAt(a, -1, offset);
+    a->leaves = true;
+    break;
+  }
+  return length;
+}
+
+/**
+ * Maps size bytes of fresh memory, copies count bytes of code into it and then flips it from
+ * writable to executable, so no page is ever both at once
+ *
+ * @return uint8_t* NULL if the OS said no
+ */
+static uint8_t *mapExecutable(uint8_t *code, int count, size_t size) {
+  uint8_t *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED)
+    return NULL;
+  memcpy(memory, code, count);
+  if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, size);
+    return NULL;
+  }
+  return memory;
+}
+
+/**
+ * Compiles function's chunk into machine code, laid out as:
+ *
+ *   entry: saves the callee saved registers, loads the vm state into them and
+ *          jumps to the instruction it's asked to start at
+ *   exit:  writes ip (in rax) and the stack top back, restores and returns
+ *   the instructions, one template each
+ *   a stub per place the instructions can leave from, loading its ip for exit
+ *
+ * Functions in register form (see regcode.c) are left alone.
+ *
+ * @return bool false if it didn't compile, it's never tried again then
+ */
+bool jitCompile(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  if (chunk->maxRegisters > 0)
+    return false;
+
+  int count = chunk->count;
+  Assembler a = {0};
+  a.chunk = chunk;
+  a.entries = malloc(count * sizeof(uint32_t));
+  bool *isTarget = calloc(count + 1, sizeof(bool));
+  for (int offset = 0; offset < count; offset++) {
+    a.entries[offset] = NO_ENTRY;
+  }
+  for (int offset = 0; offset < count;
+       offset += instructionLength(chunk, offset)) {
+    int target = jumpTarget(chunk->code, offset);
+    if (target != -1)
+      isTarget[target] = true;
+  }
+
+  // entry(sp = rdi, slots = rsi, frame = rdx, vm = rcx, target = r8)
+  emitByte(&a, 0x55); // push rbp
+  moveReg(&a, RBP, RSP);
+  emitByte(&a, 0x53);       // push rbx
+  emitByte(&a, 0x41);       // push r12
+  emitByte(&a, 0x54);
+  emitByte(&a, 0x41);       // push r13
+  emitByte(&a, 0x55);
+  emitByte(&a, 0x41);       // push r14, which leaves rsp 16 byte aligned
+  emitByte(&a, 0x56);
+  moveReg(&a, REG_SP, RDI);
+  moveReg(&a, REG_SLOTS, RSI);
+  moveReg(&a, REG_FRAME, RDX);
+  moveReg(&a, REG_VM, RCX);
+  emitByte(&a, 0x41); // jmp r8
+  emitByte(&a, 0xff);
+  emitByte(&a, 0xe0);
+
+  a.exitCode = a.count;
+  storeReg(&a, REG_FRAME, offsetof(CallFrame, ip), RAX);
+  moveReg(&a, RAX, REG_SP);
+  rex(&a, true, RAX, REG_VM); // sub rax, [vm.stack]
+  emitByte(&a, 0x2b);
+  memOperand(&a, RAX, REG_VM, offsetof(VM, stack));
+  emitByte(&a, 0x48); // shr rax, VALUE_SHIFT
+  emitByte(&a, 0xc1);
+  emitByte(&a, 0xe8);
+  emitByte(&a, VALUE_SHIFT);
+  storeReg32(&a, REG_VM, offsetof(VM, stack_count), RAX);
+  emitByte(&a, 0x41); // pop r14
+  emitByte(&a, 0x5e);
+  emitByte(&a, 0x41); // pop r13
+  emitByte(&a, 0x5d);
+  emitByte(&a, 0x41); // pop r12
+  emitByte(&a, 0x5c);
+  emitByte(&a, 0x5b); // pop rbx
+  emitByte(&a, 0x5d); // pop rbp
+  emitByte(&a, 0xc3); // ret
+
+  // order[] / leaves[] -> the instructions as written out, fused ones count
+  // once
+  int *order = malloc(count * sizeof(int));
+  bool *leaves = malloc(count * sizeof(bool));
+  int instructions = 0;
+  for (int offset = 0; offset < count;) {
+    a.entries[offset] = a.count;
+    a.leaves = false;
+    order[instructions] = offset;
+    offset += emitInstruction(&a, offset, isTarget);
+    leaves[instructions++] = a.leaves;
+  }
+
+  for (int i = 0; i < a.jumpCount; i++) {
+    patchJumpTo(&a, a.jumpFrom[i], a.entries[a.jumpTo[i]]);
+  }
+
+  // jumps inside the machine code are patched, from here on entries is only
+  // where run() can come in: not right in front of an exit
+  int run = 0;
+  for (int i = instructions - 1; i >= 0; i--) {
+    if (leaves[i]) {
+      run = 0;
+    } else if (chunk->code[order[i]] == OP_LOOP) {
+      run = MIN_RUN; // goes round the loop again
+    } else {
+      run++;
+    }
+    if (run < MIN_RUN)
+      a.entries[order[i]] = NO_ENTRY;
+  }
+  free(order);
+  free(leaves);
+  for (int i = 0; i < a.exitCount; i++) {
+    patchJumpHere(&a, a.exitFrom[i]);
+    exitAt(&a, -1, a.exitAt[i]);
+  }
+
+  long pageSize = sysconf(_SC_PAGESIZE);
+  size_t size = (a.count + pageSize - 1) / pageSize * pageSize;
+  uint8_t *code = mapExecutable(a.code, a.count, size);
+  free(a.code);
+  free(a.jumpFrom);
+  free(a.jumpTo);
+  free(a.exitFrom);
+  free(a.exitAt);
+  free(isTarget);
+  if (code == NULL) {
+    free(a.entries);
+    return false;
+  }
+
+  JitCode *jit = malloc(sizeof(JitCode));
+  jit->code = code;
+  jit->size = size;
+  jit->entries = a.entries;
+  jit->count = count;
+  function->jit = jit;
+  return true;
+}
+
+/**
+ * Runs frame's machine code from frame->ip on (which has to be the top frame,
+ * written back, and somewhere jitCanEnter()), until it gets to something it
+ * leaves to run(). Comes back with frame->ip and vm.stack_count written back.
+ */
+void jitRun(CallFrame *frame) {
+  ObjFunction *function = frame->closure->function;
+  JitCode *jit = function->jit;
+  int offset = (int)(frame->ip - function->chunk.code);
+
+  // the machine code never checks for room when it pushes, call() made room
+  // for the deepest the frame gets already
+
+  JitEntry entry = (JitEntry)(void *)jit->code;
+  entry(vm.stack + vm.stack_count, vm.stack + frame->slots, frame, &vm,
+        jit->code + jit->entries[offset]);
+}
+
+void jitFree(ObjFunction *function) {
+  JitCode *jit = function->jit;
+  if (jit == NULL)
+    return;
+  munmap(jit->code, jit->size);
+  free(jit->entries);
+  free(jit);
+  function->jit = NULL;
+}
+
+#endif
@@ -0,0 +1,126 @@
+// Start-up for programs written by clox --emit-c: builds the functions and
+// global slots the compiler made back out of the tables the emitter wrote
+// (see emitc.c), then runs the script. Nothing gets scanned or compiled.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "loxrt.h"
+
+// Compiled calls nest on the C stack (see runCompiled() in vm.c), so the
+// script runs on a thread of its own with a stack about as deep as vm.frames
+// can get. It's only reserved, pages get used as deep as the recursion goes
+#define SCRIPT_STACK_SIZE ((size_t)512 * 1024 * 1024)
+#define STACK_RESERVE (256 * 1024) // left for the runtime under the last call
+
+typedef struct {
+  ObjFunction *script;
+  size_t stackRoom;
+  InterpretResult result;
+} ScriptRun;
+
+static void *runScript(void *arg) {
+  ScriptRun *run = arg;
+  run->result = aotInterpret(run->script, run->stackRoom);
+  return NULL;
+}
+
+/**
+ * Runs the script on its own big stack, or on this thread's if there can't be
+ * another one
+ */
+static InterpretResult runOnBigStack(ObjFunction *script) {
+  ScriptRun run = {script, SCRIPT_STACK_SIZE - STACK_RESERVE, INTERPRET_OK};
+  pthread_attr_t attr;
+  pthread_t thread;
+  pthread_attr_init(&attr);
+  if (pthread_attr_setstacksize(&attr, SCRIPT_STACK_SIZE) == 0 &&
+      pthread_create(&thread, &attr, runScript, &run) == 0) {
+    pthread_join(thread, NULL);
+  } else {
+    struct rlimit limit;
+    size_t size = 8 * 1024 * 1024; // the usual default
+    if (getrlimit(RLIMIT_STACK, &limit) == 0 &&
+        limit.rlim_cur != RLIM_INFINITY)
+      size = limit.rlim_cur;
+    run.stackRoom = size > 2 * STACK_RESERVE ? size - STACK_RESERVE : size / 2;
+    runScript(&run);
+  }
+  pthread_attr_destroy(&attr);
+  return run.result;
+}
+
+/**
+ * Makes program->functions[index] (and, through its constants, every
+ * function nested in it) into an ObjFunction, with the constants and inline
+ * caches at the same indexes the compiler gave them
+ */
+static ObjFunction *loadFunction(const AotProgram *program, int index) {
+  const AotFunction *source = &program->functions[index];
+  ObjFunction *function = newFunction();
+  push(OBJ_VAL(function)); // everything below can run the GC
+  function->arity = source->arity;
+  function->upvalueCount = source->upvalueCount;
+  function->maxStack = source->maxStack;
+  function->compiled = source->body;
+  if (source->name != NULL) {
+    ObjString *name = copyString(source->name, (int)strlen(source->name));
+    snapshotBarrier(&function->obj);
+    function->name = name;
+    writeBarrier(&function->obj, OBJ_VAL(name));
+  }
+
+  for (int i = 0; i < source->constantCount; i++) {
+    const AotConstant *constant = &source->constants[i];
+    Value value = NIL_VAL;
+    switch (constant->type) {
+    case AOT_NUMBER:
+      value = NUMBER_VAL(constant->number);
+      break;
+    case AOT_STRING:
+      value = OBJ_VAL(copyString(constant->chars, constant->length));
+      break;
+    case AOT_FUNCTION:
+      value = OBJ_VAL(loadFunction(program, constant->function));
+      break;
+    }
+    snapshotBarrier(&function->obj);
+    addConstant(&function->chunk, value);
+    writeBarrier(&function->obj, value);
+  }
+  snapshotBarrier(&function->obj);
+  for (int i = 0; i < source->cacheCount; i++) {
+    addCache(&function->chunk);
+  }
+  pop();
+  return function;
+}
+
+/**
+ * main() of a generated program
+ *
+ * @return int exit status, the same ones clox gives
+ */
+int aotMain(const AotProgram *program) {
+  initVM();
+  setGcMode(vm.gcMode); // see main()
+
+  // the natives initVM() defines come first, so as long as this is the same
+  // runtime the emitter ran on, every name lands on its old slot again
+  for (int i = 0; i < program->globalCount; i++) {
+    const char *name = program->globals[i];
+    if (globalSlot(copyString(name, (int)strlen(name))) != i) {
+      fprintf(stderr, "Global '%s' is not where the compiler put it.\n", name);
+      return 70;
+    }
+  }
+
+  ObjFunction *script = loadFunction(program, 0);
+  if (runOnBigStack(script) == INTERPRET_RUNTIME_ERROR)
+    return 65;
+  freeVM();
+  return 0;
+}
@@ -6,6 +6,9 @@
 #include "common.h"
 #include "chunk.h"
 #include "debug.h"
+#include "emitc.h"
+#include "opstats.h"
+#include "profile.h"
 #include "vm.h"
 
 
@@ -21,6 +24,7 @@ static void repl(){
             break;
         }
         interpret(line);
+        drainProfile(); // clox --profile, keeps the ring from filling up
     }
 }
 
@@ -60,20 +64,169 @@ static void runFile(const char* path){
     if(result == INTERPRET_RUNTIME_ERROR) exit (65);
 }
 
+// clox --emit-c out.c path: writes the script out as C, see emitc.c
+static void emitFile(const char* outPath, const char* path){
+    char* source = readFile(path);
+    FILE* out = fopen(outPath, "w");
+    if(out == NULL){
+        fprintf(stderr, "Could not open \"%s\".\n", outPath);
+        exit(74);
+    }
+    bool compiled = emitC(source, out);
+    fclose(out);
+    free(source);
+
+    if(!compiled) exit(65);
+}
+
+
+static const char* opStatsJsonPath = NULL;
+
+// clox --opstats: the counts go out once the script is done, however it ends
+static void reportOpStatsAtExit(){
+    reportOpStats(stderr);
+    if(opStatsJsonPath != NULL && !writeOpStatsJson(opStatsJsonPath)){
+        fprintf(stderr, "Could not write \"%s\".\n", opStatsJsonPath);
+    }
+    freeOpStats();
+}
+
+static void enableOpStats(){
+    if(vm.opStats) return;
+    vm.opStats = true;
+    vm.jitEnabled = false; // machine code would run past the counting
+    initOpStats();
+    atexit(reportOpStatsAtExit);
+}
+
+static const char* profilePath = "clox.folded";
+static bool profiling = false;
+
+// clox --profile: the flat report, and the stacks for a flame graph
+static void reportProfileAtExit(){
+    reportProfile(stderr);
+    if(writeFoldedStacks(profilePath)){
+        fprintf(stderr, "Collapsed stacks written to \"%s\".\n", profilePath);
+    }
+    else{
+        fprintf(stderr, "Could not write \"%s\".\n", profilePath);
+    }
+    freeProfile();
+}
+
+static void enableProfiler(){
+    if(profiling) return;
+    profiling = true;
+    if(!startProfiler()){
+        fprintf(stderr, "Could not start the profiler.\n");
+        exit(70);
+    }
+    atexit(reportProfileAtExit);
+}
+
+// clox --gc-stats: how many collections of each kind, and their pauses
+static void reportGcStatsAtExit(){
+    reportGcStats(stderr);
+}
 
 int main(int argc, const char *argv[]){
     initVM();
-    if(argc == 1){
+    int arg = 1;
+    const char* emitPath = NULL;
+    GcMode gcMode = vm.gcMode;
+    for(; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++){
+        if(strcmp(argv[arg], "--emit-c") == 0 && arg + 1 < argc){
+            emitPath = argv[++arg];
+        }
+        else if(strcmp(argv[arg], "--register") == 0){
+            vm.registerMode = true; // see regcode.c
+        }
+        else if(strcmp(argv[arg], "--no-jit") == 0){
+            vm.jitEnabled = false; // see jit.c
+        }
+        else if(strcmp(argv[arg], "--jit-eager") == 0){
+            vm.jitThreshold = 1; // everything compiles the first time in
+        }
+        else if(strcmp(argv[arg], "--opstats") == 0){
+            enableOpStats(); // see opstats.c
+        }
+        else if(strcmp(argv[arg], "--opstats-json") == 0 && arg + 1 < argc){
+            opStatsJsonPath = argv[++arg];
+            enableOpStats();
+        }
+        else if(strcmp(argv[arg], "--profile") == 0){
+            enableProfiler(); // see profile.c
+        }
+        else if(strcmp(argv[arg], "--profile-out") == 0 && arg + 1 < argc){
+            profilePath = argv[++arg];
+            enableProfiler();
+        }
+        else if(strcmp(argv[arg], "--gc") == 0 && arg + 1 < argc){
+            arg++;
+            if(strcmp(argv[arg], "full") == 0) gcMode = GC_FULL;
+            else if(strcmp(argv[arg], "generational") == 0) gcMode = GC_GENERATIONAL;
+            else if(strcmp(argv[arg], "incremental") == 0) gcMode = GC_INCREMENTAL;
+            else if(strcmp(argv[arg], "concurrent") == 0) gcMode = GC_CONCURRENT;
+            else{
+                fprintf(stderr, "Unknown --gc \"%s\", expected full, generational, incremental or concurrent.\n", argv[arg]);
+                exit(64);
+            }
+        }
+        else if(strcmp(argv[arg], "--gc-nursery") == 0 && arg + 1 < argc){
+            long kilobytes = strtol(argv[++arg], NULL, 10);
+            if(kilobytes <= 0){
+                fprintf(stderr, "--gc-nursery takes a size in KB.\n");
+                exit(64);
+            }
+            vm.nurserySize = (size_t)kilobytes * 1024;
+        }
+        else if(strcmp(argv[arg], "--gc-budget") == 0 && arg + 1 < argc){
+            long budget = strtol(argv[++arg], NULL, 10);
+            if(budget <= 0 || budget > 1000000000){
+                fprintf(stderr, "--gc-budget takes a number of objects.\n");
+                exit(64);
+            }
+            vm.gcBudget = (int)budget;
+        }
+        else if(strcmp(argv[arg], "--gc-threads") == 0 && arg + 1 < argc){
+            long threads = strtol(argv[++arg], NULL, 10);
+            if(threads <= 0 || threads > GC_THREADS_MAX){
+                fprintf(stderr, "--gc-threads takes 1 to %d threads.\n", GC_THREADS_MAX);
+                exit(64);
+            }
+            vm.gcThreads = (int)threads;
+        }
+        else if(strcmp(argv[arg], "--gc-stats") == 0){
+            atexit(reportGcStatsAtExit); // see memory.c
+        }
+        else{
+            break;
+        }
+    }
+    setGcMode(gcMode); // initVM() already allocated a few things
+
+    if(emitPath != NULL && arg + 1 == argc){
+        vm.registerMode = false; // only stack code gets written out as C
+        emitFile(emitPath, argv[arg]);
+    }
+    else if(emitPath == NULL && arg == argc){
         repl();
     }
-    else if(argc == 2){
-        runFile(argv[1]);
+    else if(emitPath == NULL && arg + 1 == argc){
+        runFile(argv[arg]);
     }
     else{
-        fprintf(stderr, "Usage: clox [path]\n");
+        fprintf(stderr, "Usage: clox [--register] [--no-jit] [--jit-eager] [--opstats]\n"
+                        "            [--opstats-json out.json] [--profile]\n"
+                        "            [--profile-out out.folded]\n"
+                        "            [--gc full|generational|incremental|concurrent]\n"
+                        "            [--gc-nursery KB] [--gc-budget objects]\n"
+                        "            [--gc-threads n] [--gc-stats] [path]\n"
+                        "       clox --emit-c out.c path\n");
         exit(64);
     }
 
+    stopProfiler(); // before the frames it samples go
     freeVM();
     return 0;
 }
\ No newline at end of file
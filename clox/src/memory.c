@@ -3,19 +3,148 @@
  * gray stack
  */
 
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "common.h"
 #include "compiler.h"
+#include "heap.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
 #include "vm.h"
 
-#ifdef DEBUG_LOG_GC
-#include <stdio.h>
-#endif
-
 #define GC_HEAP_GROWTH_FACTOR 2
+#define GC_MIN_MAJOR (1024 * 1024) // old bytes before the first major one
+#define GC_SLICE_BYTES (32 * 1024) // allocated between incremental slices
+#define PAUSE_BUCKETS 24 // [2^i, 2^(i+1)) microseconds, the last one open
+#define MARK_BATCH 64 // gray objects the background marker takes at a time
+#define GRAY_DEQUE_INIT 1024 // slots a parallel marker's deque starts with
+
+typedef enum {
+  PAUSE_FULL,
+  PAUSE_MINOR,
+  PAUSE_MAJOR,
+  PAUSE_SLICE,
+  PAUSE_REMARK,
+} PauseKind;
+
+/**
+ * How long collections of one kind held the program up, for clox --gc-stats
+ * total, longest -> in ms
+ * freed -> bytes
+ */
+typedef struct {
+  int count;
+  double total;
+  double longest;
+  size_t freed;
+} PauseStats;
+
+static PauseStats pauses[5];
+static int pauseHistogram[PAUSE_BUCKETS]; // every pause, whatever its kind
+static int cycles; // incremental (or concurrent) collections finished
+
+typedef enum {
+  TASK_NONE,
+  TASK_MARK,
+  TASK_SWEEP,
+  TASK_EXIT,
+} GcTask;
+
+/**
+ * The concurrent collector's thread, and what it shares with the program.
+ * lock guards task and vm.grayStack, work wakes the thread up for a task
+ * and done tells the program it's over. The sweep hands back what it kept
+ * as a list (survivors to lastSurvivor) and how many bytes it freed
+ */
+static struct {
+  pthread_t thread;
+  bool running;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  GcTask task;
+  size_t startBytes; // vm.bytesAllocated when the collection started
+  Obj **grayStack; // the marker's own, see pushGray()
+  int grayCount;
+  int grayCapacity;
+  Obj *survivors;
+  Obj *lastSurvivor;
+  size_t swept;
+  double markMs; // time the thread spent on each
+  double sweepMs;
+  long scanned;     // objects the marker traced
+  long snapshotted; // objects the program traced itself, see snapshotObject()
+} background = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static _Thread_local bool onGcThread;
+static bool atNewObject; // see allocateObjectMemory()
+static bool inBlocks; // new objects go into heap.c's blocks, see setGcMode()
+bool concurrentMarking = false;
+
+/**
+ * The slots of a parallel marker's gray deque, as many as capacity (a power
+ * of two) and indexed modulo that. Once they're outgrown the old ones stay
+ * around (older) until marking is over, a thief might still be reading them
+ */
+typedef struct GraySlots {
+  struct GraySlots *older;
+  long capacity;
+  Obj *slots[];
+} GraySlots;
+
+/**
+ * One of vm.gcThreads markers (the program's thread is the first) and its
+ * gray deque, after Chase and Lev: the marker pushes and pops at bottom,
+ * the others steal at top once they run out of their own
+ * round -> the last trace the thread took part in, see markerThread()
+ */
+typedef struct {
+  pthread_t thread;
+  long round;
+  long top;
+  long bottom;
+  GraySlots *slots;
+  long scanned; // objects this marker blackened
+  long stolen;  // how many of those it took off another one's deque
+} Marker;
+
+/**
+ * What the markers share. A trace bumps round and wakes the threads up with
+ * work, the last one to run out of gray objects (idle reaches count) ends it
+ * for all, then each one tells done. started counts the threads, count is
+ * them plus the program's thread
+ */
+static struct {
+  Marker markers[GC_THREADS_MAX];
+  int started;
+  int count;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  long round;
+  int finished;
+  bool exiting;
+  int idle;
+  double traceMs; // time spent tracing the full and major collections
+  long scanned;
+  long stolen;
+} parallel = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static _Thread_local Marker *marker; // this thread's, while it traces
+static bool parallelMarking;
 
 /**
  * Given a pointer, it's existing size and new desired size, this function
@@ -29,6 +158,11 @@
  * @return void*
  */
 void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+  if (onGcThread) { // the background sweep, which only frees
+    background.swept += oldSize;
+    free(pointer);
+    return NULL;
+  }
   vm.bytesAllocated += newSize - oldSize;
   if (newSize > oldSize) {
     if (vm.bytesAllocated > vm.nextGC) {
@@ -48,28 +182,199 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
   return result;
 } // this is for dynamic memory management so we can allocate memory at will.
 
+/**
+ * Accounts for freed bytes of dead objects the lazy sweep got to after the
+ * collection that found them: the next collection gets closer by as much as
+ * it would have if that one had freed them (twice that for a full one, the
+ * nursery is the same size either way), and for a minor one they were the
+ * dead young objects it counted as old
+ */
+static void lazilyFreed(size_t freed) {
+  size_t closer = vm.gcMode == GC_GENERATIONAL
+                      ? freed
+                      : freed * GC_HEAP_GROWTH_FACTOR;
+  vm.nextGC = closer < vm.nextGC ? vm.nextGC - closer : vm.bytesAllocated;
+  vm.oldBytes = freed < vm.oldBytes ? vm.oldBytes - freed : 0;
+}
+
+/**
+ * reallocate(NULL, 0, size) for a new object, or with clox --gc full and
+ * generational a cell in one of heap.c's blocks. A concurrent collection only
+ * starts here, never while some table or array of an object is growing: that
+ * object would be in the middle of changing without snapshotBarrier() having
+ * caught it
+ */
+void *allocateObjectMemory(size_t size) {
+  atNewObject = true;
+  Obj *object = NULL;
+  if (inBlocks && size <= CELL_MAX) {
+    vm.bytesAllocated += size;
+    if (vm.bytesAllocated > vm.nextGC) {
+      collectGarbage();
+    }
+    size_t before = vm.bytesAllocated;
+    object = (Obj *)heapAllocate(size);
+    lazilyFreed(before - vm.bytesAllocated);
+    object->inBlock = true;
+  } else {
+    object = (Obj *)reallocate(NULL, 0, size);
+    object->inBlock = false;
+  }
+  atNewObject = false;
+  return object;
+}
+
+/**
+ * FREE() for the object itself, the other end of allocateObjectMemory()
+ */
+static void freeObjectMemory(Obj *object, size_t size) {
+  if (!object->inBlock) {
+    reallocate(object, size, 0);
+    return;
+  }
+  vm.bytesAllocated -= size;
+  heapRelease(object);
+}
+
+static void pushStack(Obj ***stack, int *count, int *capacity,
+                      Obj *object) {
+  if (*capacity < *count + 1) {
+    *capacity = GROW_CAPACITY(*capacity);
+    *stack = (Obj **)realloc(*stack, sizeof(Obj *) * *capacity);
+    if (*stack == NULL)
+      exit(1);
+  }
+  (*stack)[(*count)++] = object;
+}
+
+static GraySlots *newSlots(long capacity) {
+  GraySlots *slots =
+      (GraySlots *)malloc(sizeof(GraySlots) + sizeof(Obj *) * capacity);
+  if (slots == NULL)
+    exit(1);
+  slots->older = NULL;
+  slots->capacity = capacity;
+  return slots;
+}
+
+/**
+ * Only ever called by the deque's own marker. bottom is published after the
+ * slot (release) so a thief that sees it sees what's in the slot
+ */
+static void pushWork(Marker *owner, Obj *object) {
+  long bottom = __atomic_load_n(&owner->bottom, __ATOMIC_RELAXED);
+  long top = __atomic_load_n(&owner->top, __ATOMIC_ACQUIRE);
+  GraySlots *slots = owner->slots;
+  if (bottom - top >= slots->capacity) {
+    GraySlots *grown = newSlots(slots->capacity * 2);
+    for (long i = top; i < bottom; i++) {
+      grown->slots[i & (grown->capacity - 1)] =
+          slots->slots[i & (slots->capacity - 1)];
+    }
+    grown->older = slots;
+    __atomic_store_n(&owner->slots, grown, __ATOMIC_RELEASE);
+    slots = grown;
+  }
+  __atomic_store_n(&slots->slots[bottom & (slots->capacity - 1)], object,
+                   __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&owner->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * The owner's end of its deque, NULL once it's empty. Only the last object
+ * left can be wanted by a thief at the same time, whoever moves top past it
+ * gets it
+ */
+static Obj *popWork(Marker *owner) {
+  long bottom = __atomic_load_n(&owner->bottom, __ATOMIC_RELAXED) - 1;
+  GraySlots *slots = owner->slots;
+  __atomic_store_n(&owner->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long top = __atomic_load_n(&owner->top, __ATOMIC_RELAXED);
+  if (top > bottom) {
+    __atomic_store_n(&owner->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  Obj *object = __atomic_load_n(&slots->slots[bottom & (slots->capacity - 1)],
+                                __ATOMIC_RELAXED);
+  if (top == bottom) {
+    if (!__atomic_compare_exchange_n(&owner->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      object = NULL;
+    __atomic_store_n(&owner->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return object;
+}
+
+/**
+ * The oldest object on victim's deque, NULL if there's none or another
+ * marker got to it first
+ */
+static Obj *stealWork(Marker *victim) {
+  long top = __atomic_load_n(&victim->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long bottom = __atomic_load_n(&victim->bottom, __ATOMIC_ACQUIRE);
+  if (top >= bottom)
+    return NULL;
+  GraySlots *slots = __atomic_load_n(&victim->slots, __ATOMIC_ACQUIRE);
+  Obj *object = __atomic_load_n(&slots->slots[top & (slots->capacity - 1)],
+                                __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&victim->top, &top, top + 1, false,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return NULL;
+  return object;
+}
+
+/**
+ * While markers trace in parallel each one has a deque of its own (see
+ * traceInParallel()). The background marker has a gray stack of its own
+ * (see concurrentMark()), the program shares vm.grayStack with it while it
+ * runs
+ */
+static void pushGray(Obj *object) {
+  if (marker != NULL) {
+    pushWork(marker, object);
+    return;
+  }
+  if (onGcThread) {
+    pushStack(&background.grayStack, &background.grayCount,
+              &background.grayCapacity, object);
+    return;
+  }
+  bool shared = vm.gcMode == GC_CONCURRENT;
+  if (shared)
+    pthread_mutex_lock(&background.lock);
+  pushStack(&vm.grayStack, &vm.grayCount, &vm.grayCapacity, object);
+  if (shared)
+    pthread_mutex_unlock(&background.lock);
+}
+
 void markObject(Obj *object) {
 
   if (object == NULL)
     return;
-  if (object->isMarked)
-    return;
+  if (object->inBlock) {
+    if (!heapMark(object, parallelMarking))
+      return;
+  } else if (vm.gcMode == GC_CONCURRENT || parallelMarking) {
+    // the background marker and the program (see snapshotObject()), or the
+    // parallel markers, race to it, only the one that flips the bit pushes it
+    if (__atomic_load_n(&object->isMarked, __ATOMIC_RELAXED) ||
+        __atomic_exchange_n(&object->isMarked, true, __ATOMIC_RELAXED))
+      return;
+  } else {
+    if (object->isMarked)
+      return;
+    object->isMarked = true;
+  }
 
 #ifdef DEBUG_LOG_GC
   printf("%p marked ", (void *)object);
   printValue(OBJ_VAL(object));
   printf("\n");
 #endif
-  object->isMarked = true;
-
-  if (vm.grayCapacity < vm.grayCount + 1) {
-    vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-    vm.grayStack =
-        (Obj **)realloc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity);
-    if (vm.grayStack == NULL)
-      exit(1);
-  }
-  vm.grayStack[vm.grayCount++] = object;
+  pushGray(object);
 }
 
 // We only worry about heap allocated values i.e objects
@@ -84,6 +389,21 @@ void markArray(ValueArray *array) {
   }
 }
 
+/**
+ * The inline caches hold on to the shapes and methods they remember, so
+ * those stay alive for as long as the function does
+ */
+static void markCaches(Chunk *chunk) {
+  for (int i = 0; i < chunk->cacheCount; i++) {
+    PropertyCache *cache = &chunk->caches[i];
+    for (int j = 0; j < PROPERTY_CACHE_WAYS; j++) {
+      markObject((Obj *)cache->entries[j].shape);
+      markObject((Obj *)cache->entries[j].transition);
+      markObject((Obj *)cache->entries[j].method);
+    }
+  }
+}
+
 /**
  * String and Native have no outgoing references, so nothing to traverse in them
  */
@@ -104,6 +424,8 @@ static void blackenObject(Obj *object) {
     ObjClass *klass = (ObjClass *)object;
     markObject((Obj *)klass->name);
     markTable(&klass->methods);
+    markObject((Obj *)klass->rootShape);
+    markObject((Obj *)klass->initializer);
     break;
   }
   case OBJ_CLOSURE: {
@@ -118,12 +440,30 @@ static void blackenObject(Obj *object) {
     ObjFunction *fn = (ObjFunction *)object;
     markObject((Obj *)fn->name);
     markArray(&fn->chunk.constants);
+    markCaches(&fn->chunk);
     break;
   }
   case OBJ_INSTANCE: {
     ObjInstance *instance = (ObjInstance *)object;
     markObject((Obj *)instance->klass);
-    markTable(&instance->fields);
+    if (instance->shape != NULL) {
+      markObject((Obj *)instance->shape);
+      for (int i = 0; i < instance->shape->fieldCount; i++) {
+        markValue(instance->fields[i]);
+      }
+    } else {
+      markTable(instance->dictionary);
+    }
+    break;
+  }
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    markObject((Obj *)shape->klass);
+    markObject((Obj *)shape->parent);
+    for (int i = 0; i < shape->fieldCount; i++) {
+      markObject((Obj *)shape->keys[i]);
+    }
+    markTable(&shape->transitions);
     break;
   }
   case OBJ_UPVALUE:
@@ -135,18 +475,18 @@ static void blackenObject(Obj *object) {
   }
 }
 
-static void freeObject(Obj *object) {
+void freeObject(Obj *object) {
 #ifdef DEBUG_LOG_GC
   printf("%p free type %d\n", (void *)object, object->type);
 #endif
   switch (object->type) {
   case OBJ_BOUND_METHOD:
-    FREE(ObjBoundMethod, object);
+    freeObjectMemory(object, sizeof(ObjBoundMethod));
     break;
   case OBJ_CLASS: {
     ObjClass *klass = (ObjClass *)object;
     freeTable(&klass->methods);
-    FREE(ObjClass, object);
+    freeObjectMemory(object, sizeof(ObjClass));
     break;
   }
   case OBJ_CLOSURE: { // we don't free the function objs in it cuz it doesn't
@@ -154,32 +494,46 @@ static void freeObject(Obj *object) {
                       // over same function
     ObjClosure *closure = (ObjClosure *)object;
     FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
-    FREE(ObjClosure, object);
+    freeObjectMemory(object, sizeof(ObjClosure));
     break;
   }
   case OBJ_FUNCTION: {
     ObjFunction *function = (ObjFunction *)object;
+#ifdef JIT_ENABLED
+    jitFree(function);
+#endif
     freeChunk(&function->chunk);
-    FREE(ObjFunction, object);
+    freeObjectMemory(object, sizeof(ObjFunction));
     break;
   }
   case OBJ_INSTANCE: {
     ObjInstance *instance = (ObjInstance *)object;
-    freeTable(&instance->fields);
-    FREE(ObjInstance, object);
+    FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+    if (instance->dictionary != NULL) {
+      freeTable(instance->dictionary);
+      FREE(Table, instance->dictionary);
+    }
+    freeObjectMemory(object, sizeof(ObjInstance));
+    break;
+  }
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    FREE_ARRAY(ObjString *, shape->keys, shape->fieldCount);
+    freeTable(&shape->transitions);
+    freeObjectMemory(object, sizeof(ObjShape));
     break;
   }
   case OBJ_NATIVE:
-    FREE(ObjNative, object);
+    freeObjectMemory(object, sizeof(ObjNative));
     break;
   case OBJ_STRING: {
     ObjString *string = (ObjString *)object;
     FREE_ARRAY(char, string->chars, string->length + 1);
-    FREE(ObjString, object);
+    freeObjectMemory(object, sizeof(ObjString));
     break;
   }
   case OBJ_UPVALUE:
-    FREE(ObjUpvalue, object);
+    freeObjectMemory(object, sizeof(ObjUpvalue));
     break;
   }
 }
@@ -197,24 +551,239 @@ static void markRoots() {
        upvalue = upvalue->next) {
     markObject((Obj *)upvalue);
   }
-  markTable(&vm.globals);
+  markArray(&vm.globalValues);
+  markArray(&vm.globalNames);
+  markTable(&vm.globalSlots);
   markCompilerRoots();
   markObject((Obj *)vm.initString);
 }
 
-static void traceReferences() {
+/**
+ * @return long how many objects it blackened
+ */
+static long traceReferences() {
+  long traced = 0;
   while (vm.grayCount > 0) {
     Obj *object = vm.grayStack[--vm.grayCount];
     blackenObject(object);
+    traced++;
+  }
+  return traced;
+}
+
+static double elapsedMs(struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (double)(end.tv_sec - start->tv_sec) * 1e3 +
+         (double)(end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/**
+ * pthread_create() for the collector's threads, which leave the signals to
+ * the program: clox --profile's SIGPROF samples vm.frames
+ */
+static bool startThread(pthread_t *thread, void *(*body)(void *), void *arg) {
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  bool started = pthread_create(thread, NULL, body, arg) == 0;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return started;
+}
+
+/**
+ * A gray object off some other marker's deque, NULL if none had one to
+ * spare just now
+ */
+static Obj *findWork(Marker *thief) {
+  int self = (int)(thief - parallel.markers);
+  for (int i = 1; i < parallel.count; i++) {
+    Obj *object = stealWork(&parallel.markers[(self + i) % parallel.count]);
+    if (object != NULL) {
+      thief->stolen++;
+      return object;
+    }
+  }
+  return NULL;
+}
+
+static bool workLeft() {
+  for (int i = 0; i < parallel.count; i++) {
+    Marker *other = &parallel.markers[i];
+    if (__atomic_load_n(&other->top, __ATOMIC_ACQUIRE) <
+        __atomic_load_n(&other->bottom, __ATOMIC_ACQUIRE))
+      return true;
+  }
+  return false;
+}
+
+/**
+ * One marker's share of a parallel trace: its own deque first, then what it
+ * can steal. Out of both it counts itself idle and waits for gray objects to
+ * show up on some deque again, or for every marker to be idle. An idle
+ * marker pushes nothing, so once they all are marking is over
+ */
+static void markInParallel(Marker *self) {
+  marker = self;
+  for (;;) {
+    Obj *object = popWork(self);
+    if (object == NULL)
+      object = findWork(self);
+    if (object != NULL) {
+      blackenObject(object);
+      self->scanned++;
+      continue;
+    }
+    __atomic_add_fetch(&parallel.idle, 1, __ATOMIC_SEQ_CST);
+    while (!workLeft()) {
+      if (__atomic_load_n(&parallel.idle, __ATOMIC_SEQ_CST) == parallel.count) {
+        marker = NULL;
+        return;
+      }
+      sched_yield();
+    }
+    __atomic_sub_fetch(&parallel.idle, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+static void *markerThread(void *arg) {
+  Marker *self = (Marker *)arg;
+  pthread_mutex_lock(&parallel.lock);
+  for (;;) {
+    while (parallel.round == self->round && !parallel.exiting) {
+      pthread_cond_wait(&parallel.work, &parallel.lock);
+    }
+    if (parallel.exiting)
+      break;
+    self->round = parallel.round;
+    pthread_mutex_unlock(&parallel.lock);
+
+    markInParallel(self);
+
+    pthread_mutex_lock(&parallel.lock);
+    parallel.finished++;
+    pthread_cond_signal(&parallel.done);
   }
+  pthread_mutex_unlock(&parallel.lock);
+  return NULL;
 }
 
-static void sweep() {
+/**
+ * Threads for the markers after the program's own, up to vm.gcThreads.
+ * Whatever number of them can be started is what vm.gcThreads is from then
+ * on
+ */
+static void startMarkers() {
+  while (parallel.started + 1 < vm.gcThreads) {
+    Marker *next = &parallel.markers[parallel.started + 1];
+    next->round = parallel.round;
+    if (!startThread(&next->thread, markerThread, next)) {
+      vm.gcThreads = parallel.started + 1;
+      break;
+    }
+    parallel.started++;
+  }
+  parallel.count = parallel.started + 1;
+  for (int i = 0; i < parallel.count; i++) {
+    if (parallel.markers[i].slots == NULL)
+      parallel.markers[i].slots = newSlots(GRAY_DEQUE_INIT);
+  }
+}
+
+static void freeSlots(GraySlots *slots) {
+  while (slots != NULL) {
+    GraySlots *older = slots->older;
+    free(slots);
+    slots = older;
+  }
+}
+
+static void stopMarkers() {
+  pthread_mutex_lock(&parallel.lock);
+  parallel.exiting = true;
+  pthread_cond_broadcast(&parallel.work);
+  pthread_mutex_unlock(&parallel.lock);
+  for (int i = 1; i <= parallel.started; i++) {
+    pthread_join(parallel.markers[i].thread, NULL);
+  }
+  parallel.started = 0;
+  parallel.exiting = false;
+  for (int i = 0; i < GC_THREADS_MAX; i++) {
+    freeSlots(parallel.markers[i].slots);
+    parallel.markers[i].slots = NULL;
+  }
+}
+
+/**
+ * traceReferences() with vm.gcThreads markers, the program's thread being
+ * one of them. The gray objects the roots left are dealt out to their
+ * deques, from there on each one pushes what it marks onto its own and
+ * steals once that runs dry. markObject() sets mark bits atomically
+ * meanwhile, so each object still gets blackened once
+ */
+static void traceInParallel() {
+  startMarkers();
+  for (int i = 0; vm.grayCount > 0; i++) {
+    pushWork(&parallel.markers[i % parallel.count],
+             vm.grayStack[--vm.grayCount]);
+  }
+  parallel.idle = 0;
+  parallelMarking = true;
+  pthread_mutex_lock(&parallel.lock);
+  parallel.finished = 0;
+  parallel.round++;
+  pthread_cond_broadcast(&parallel.work);
+  pthread_mutex_unlock(&parallel.lock);
+
+  markInParallel(&parallel.markers[0]);
+
+  pthread_mutex_lock(&parallel.lock);
+  while (parallel.finished < parallel.started) {
+    pthread_cond_wait(&parallel.done, &parallel.lock);
+  }
+  pthread_mutex_unlock(&parallel.lock);
+  parallelMarking = false;
+
+  for (int i = 0; i < parallel.count; i++) {
+    Marker *done = &parallel.markers[i];
+    done->top = 0;
+    done->bottom = 0;
+    freeSlots(done->slots->older); // the biggest ones are kept for next time
+    done->slots->older = NULL;
+    parallel.scanned += done->scanned;
+    parallel.stolen += done->stolen;
+    done->scanned = 0;
+    done->stolen = 0;
+  }
+}
+
+/**
+ * The trace of a full or major collection, over the whole heap. That's
+ * where parallel markers pay off, a minor one is over about as soon as the
+ * threads would be woken up
+ */
+static void traceHeap() {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (vm.gcThreads > 1) {
+    traceInParallel();
+  } else {
+    parallel.scanned += traceReferences();
+  }
+  parallel.traceMs += elapsedMs(&start);
+}
+
+/**
+ * Frees everything on the old object list that wasn't marked. The survivors
+ * keep their marks only if they stay old (generational), for a full
+ * collection they're white again
+ */
+static void sweep(bool keepMarks) {
   Obj *previous = NULL;
   Obj *object = vm.objects;
   while (object != NULL) {
     if (object->isMarked) {
-      object->isMarked = false;
+      object->isMarked = keepMarks;
       previous = object;
       object = object->next;
     } else {
@@ -230,32 +799,632 @@ static void sweep() {
   }
 }
 
-void collectGarbage() {
-#ifdef DEBUG_LOG_GC
-  printf("---gc begins\n");
-  size_t before = vm.bytesAllocated;
-#endif
+/**
+ * The young objects that got marked become old, as they are (marked), the
+ * rest is freed. Survivors aren't moved anywhere: the C stack of run(), the
+ * compiler and the natives hold raw pointers to objects all over the place,
+ * so promoting is only moving them from one list to the other
+ */
+static void promoteYoung() {
+  Obj *object = vm.youngObjects;
+  while (object != NULL) {
+    Obj *next = object->next;
+    if (object->isMarked) {
+      object->next = vm.objects;
+      vm.objects = object;
+    } else {
+      freeObject(object);
+    }
+    object = next;
+  }
+  vm.youngObjects = NULL;
+}
+
+/**
+ * Makes the collector look at all of object's references again, for where a
+ * whole lot of them get copied into it at once (tableAddAll()). Generational:
+ * puts object into vm.remembered, once, if it's old. Incremental: a marked
+ * object goes back on the gray stack while marking. Concurrent: nothing, the
+ * snapshotBarrier() before the copy did it
+ */
+void rememberObject(Obj *object) {
+  if (vm.gcMode == GC_CONCURRENT || !isMarkedObject(object))
+    return;
+  if (vm.gcMode == GC_INCREMENTAL) {
+    if (vm.gcPhase == GC_PHASE_MARK)
+      pushGray(object);
+    return;
+  }
+  if (vm.gcMode != GC_GENERATIONAL || object->isRemembered)
+    return;
+  // plain realloc(), reallocate() would run the GC in the middle of a store
+  if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+    vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+    vm.remembered =
+        (Obj **)realloc(vm.remembered, sizeof(Obj *) * vm.rememberedCapacity);
+    if (vm.remembered == NULL)
+      exit(1);
+  }
+  object->isRemembered = true;
+  vm.remembered[vm.rememberedCount++] = object;
+}
 
+/**
+ * writeBarrier() caught object, marked, getting value, unmarked. Incremental
+ * marking keeps to Dijkstra's rule: a black object never points at a white
+ * one, so value turns gray
+ */
+void writeBarrierSlow(Obj *object, Obj *value) {
+  if (vm.gcMode == GC_GENERATIONAL) {
+    rememberObject(object);
+  } else if (vm.gcMode == GC_INCREMENTAL && vm.gcPhase == GC_PHASE_MARK) {
+    markObject(value);
+  }
+}
+
+/**
+ * Only the young objects get traced: the roots and the remembered objects are
+ * where references into the young ones can come from, and marking stops at
+ * the old ones since they're already marked. The young ones in the blocks
+ * that got marked are old from now on, the rest is left to the lazy sweep
+ */
+static void minorCollection() {
   markRoots();
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    vm.remembered[i]->isRemembered = false;
+    blackenObject(vm.remembered[i]);
+  }
+  vm.rememberedCount = 0;
   traceReferences();
   tableRemoveWhite(&vm.strings);
-  sweep();
+  promoteYoung();
+  heapStartSweep(true);
+}
+
+static void majorCollection() {
+  heapSetMarks(false);
+  for (Obj *object = vm.objects; object != NULL; object = object->next) {
+    object->isMarked = false;
+  }
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    vm.remembered[i]->isRemembered = false;
+  }
+  vm.rememberedCount = 0;
+  markRoots();
+  traceHeap();
+  tableRemoveWhite(&vm.strings);
+  sweep(true);
+  promoteYoung();
+  heapStartSweep(true);
+}
+
+/**
+ * Marking's done, next are the strings nothing marked
+ */
+static void startStrings() {
+  vm.gcPhase = GC_PHASE_STRINGS;
+  vm.stringCursor = 0;
+  vm.stringCapacity = vm.strings.capacity;
+}
+
+/**
+ * Blackens up to budget gray objects. Once there are none left the roots get
+ * marked again, the stack and the globals have no barriers. If that doesn't
+ * turn up anything new either, everything reachable is marked: the program
+ * hasn't run since the roots were looked at, and no black object points at
+ * a white one. Otherwise it's back to tracing, in this slice or the next
+ *
+ * @return int what's left of budget
+ */
+static int markSlice(int budget) {
+  while (budget > 0) {
+    if (vm.grayCount == 0) {
+      markRoots();
+      if (vm.grayCount == 0) {
+        startStrings();
+        break;
+      }
+    }
+    blackenObject(vm.grayStack[--vm.grayCount]);
+    budget--;
+  }
+  return budget;
+}
+
+/**
+ * tableRemoveWhite() on vm.strings, budget entries at a time. New strings can
+ * grow (rehash) the table in between, which starts the scan over. A string
+ * copyString() finds meanwhile gets marked (see internedString()), it's in
+ * use again
+ */
+static int stringsSlice(int budget) {
+  while (budget > 0) {
+    if (vm.stringCapacity != vm.strings.capacity) {
+      vm.stringCursor = 0;
+      vm.stringCapacity = vm.strings.capacity;
+    }
+    if (vm.stringCursor == vm.stringCapacity) {
+      // from here on new objects are white, so they go where sweeping
+      // won't see them
+      vm.sweeping = vm.objects;
+      vm.objects = NULL;
+      vm.gcPhase = GC_PHASE_SWEEP;
+      break;
+    }
+    Entry *entry = &vm.strings.entries[vm.stringCursor++];
+    if (entry->key != NULL && !entry->key->obj.isMarked) {
+      tableDelete(&vm.strings, entry->key);
+    }
+    budget--;
+  }
+  return budget;
+}
+
+static int sweepSlice(int budget) {
+  while (budget > 0 && vm.sweeping != NULL) {
+    Obj *object = vm.sweeping;
+    vm.sweeping = object->next;
+    if (object->isMarked) {
+      object->isMarked = false;
+      object->next = vm.objects;
+      vm.objects = object;
+    } else {
+      freeObject(object);
+    }
+    budget--;
+  }
+  if (vm.sweeping == NULL) {
+    vm.gcPhase = GC_PHASE_IDLE;
+    cycles++;
+  }
+  return budget;
+}
+
+/**
+ * One slice of an incremental collection, starting one with the roots if
+ * none is going on. Nothing is freed before marking is all done, so the
+ * objects the program holds on to in C locals are as safe as with a full
+ * collection
+ */
+static void incrementalSlice() {
+  int budget = vm.gcBudget;
+  if (vm.gcPhase == GC_PHASE_IDLE) {
+    vm.gcPhase = GC_PHASE_MARK;
+    markRoots();
+  }
+  if (vm.gcPhase == GC_PHASE_MARK)
+    budget = markSlice(budget);
+  if (vm.gcPhase == GC_PHASE_STRINGS)
+    budget = stringsSlice(budget);
+  if (vm.gcPhase == GC_PHASE_SWEEP)
+    sweepSlice(budget);
+}
+
+static void recordPause(PauseKind kind, double pause, size_t freed) {
+  PauseStats *stats = &pauses[kind];
+  stats->count++;
+  stats->total += pause;
+  stats->longest = pause > stats->longest ? pause : stats->longest;
+  stats->freed += freed;
+
+  int bucket = 0;
+  for (double us = pause * 1e3; us >= 2 && bucket < PAUSE_BUCKETS - 1;
+       us /= 2) {
+    bucket++;
+  }
+  pauseHistogram[bucket]++;
+}
+
+/**
+ * Whether this is the one to trace object's references in the concurrent
+ * collection going on, the background marker and the program can't both be
+ */
+static bool claimScan(Obj *object) {
+  uint8_t none = SCAN_NONE;
+  return __atomic_compare_exchange_n(&object->scanState, &none, SCAN_BUSY,
+                                     false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_ACQUIRE);
+}
+
+static void scanObject(Obj *object) {
+  if (!claimScan(object))
+    return;
+  blackenObject(object);
+  __atomic_store_n(&object->scanState, SCAN_DONE, __ATOMIC_RELEASE);
+}
+
+/**
+ * snapshotBarrier() caught the program about to change object before the
+ * background marker got to it. Its references are traced here and now, or
+ * if the marker's in the middle of that, the program waits for it to finish
+ */
+void snapshotObject(Obj *object) {
+  while (!claimScan(object)) {
+    if (__atomic_load_n(&object->scanState, __ATOMIC_ACQUIRE) == SCAN_DONE)
+      return;
+    sched_yield();
+  }
+  // the program has it, so it's reachable
+  __atomic_store_n(&object->isMarked, true, __ATOMIC_RELAXED);
+  blackenObject(object);
+  background.snapshotted++;
+  __atomic_store_n(&object->scanState, SCAN_DONE, __ATOMIC_RELEASE);
+}
+
+/**
+ * The background marker, off a gray stack of its own so it doesn't need the
+ * lock for every object. Once that's empty it takes up to MARK_BATCH from
+ * vm.grayStack, what the program marked, until there are none left
+ */
+static void concurrentMark() {
+  for (;;) {
+    if (background.grayCount == 0) {
+      pthread_mutex_lock(&background.lock);
+      while (background.grayCount < MARK_BATCH && vm.grayCount > 0) {
+        pushGray(vm.grayStack[--vm.grayCount]);
+      }
+      pthread_mutex_unlock(&background.lock);
+      if (background.grayCount == 0)
+        return;
+    }
+    scanObject(background.grayStack[--background.grayCount]);
+    background.scanned++;
+  }
+}
 
-  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROWTH_FACTOR;
+/**
+ * The background sweep of vm.sweeping. Nothing on it is the program's to
+ * touch until the task's done, the survivors go back to vm.objects after
+ * (see concurrentSlice())
+ */
+static void concurrentSweep() {
+  Obj *kept = NULL;
+  background.lastSurvivor = NULL;
+  while (vm.sweeping != NULL) {
+    Obj *object = vm.sweeping;
+    vm.sweeping = object->next;
+    if (object->isMarked) {
+      __atomic_store_n(&object->isMarked, false, __ATOMIC_RELAXED);
+      __atomic_store_n(&object->scanState, SCAN_NONE, __ATOMIC_RELAXED);
+      if (kept == NULL)
+        background.lastSurvivor = object;
+      object->next = kept;
+      kept = object;
+    } else {
+      freeObject(object);
+    }
+  }
+  background.survivors = kept;
+}
+
+static void *collectorThread(void *unused) {
+  (void)unused;
+  onGcThread = true;
+  pthread_mutex_lock(&background.lock);
+  for (;;) {
+    while (background.task == TASK_NONE) {
+      pthread_cond_wait(&background.work, &background.lock);
+    }
+    GcTask task = background.task;
+    if (task == TASK_EXIT)
+      break;
+    pthread_mutex_unlock(&background.lock);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (task == TASK_MARK) {
+      concurrentMark();
+      background.markMs += elapsedMs(&start);
+    } else {
+      concurrentSweep();
+      background.sweepMs += elapsedMs(&start);
+    }
+
+    pthread_mutex_lock(&background.lock);
+    background.task = TASK_NONE;
+    pthread_cond_broadcast(&background.done);
+  }
+  pthread_mutex_unlock(&background.lock);
+  return NULL;
+}
+
+static void startTask(GcTask task) {
+  pthread_mutex_lock(&background.lock);
+  background.task = task;
+  pthread_cond_signal(&background.work);
+  pthread_mutex_unlock(&background.lock);
+}
+
+static bool collectorBusy(bool wait) {
+  pthread_mutex_lock(&background.lock);
+  while (wait && background.task != TASK_NONE) {
+    pthread_cond_wait(&background.done, &background.lock);
+  }
+  bool busy = background.task != TASK_NONE;
+  pthread_mutex_unlock(&background.lock);
+  return busy;
+}
+
+/**
+ * The program's side of a concurrent collection, once every GC_SLICE_BYTES.
+ * It starts one by marking the roots, and once the background marker ran
+ * out of gray objects marks them again (the remark): if that turns up
+ * nothing, marking is over, else it's the marker's again. After that it
+ * drops the unmarked strings a slice at a time, hands the sweep to the
+ * thread and takes back the survivors. While the thread's busy there's
+ * nothing to do, unless the heap doubled since the collection started, then
+ * it waits for it
+ *
+ * @return bool whether there was anything to do, and kind tells what
+ */
+static bool concurrentSlice(bool wait, PauseKind *kind) {
+  wait = wait || vm.bytesAllocated > 2 * background.startBytes;
+  if (collectorBusy(wait))
+    return false;
+
+  *kind = PAUSE_SLICE;
+  switch (vm.gcPhase) {
+  case GC_PHASE_IDLE:
+    background.startBytes = vm.bytesAllocated;
+    concurrentMarking = true;
+    vm.gcPhase = GC_PHASE_MARK;
+    markRoots();
+    startTask(TASK_MARK);
+    *kind = PAUSE_REMARK;
+    break;
+  case GC_PHASE_MARK:
+    markRoots();
+    if (vm.grayCount > 0) {
+      startTask(TASK_MARK);
+    } else {
+      concurrentMarking = false;
+      startStrings();
+    }
+    *kind = PAUSE_REMARK;
+    break;
+  case GC_PHASE_STRINGS:
+    stringsSlice(vm.gcBudget);
+    if (vm.gcPhase == GC_PHASE_SWEEP)
+      startTask(TASK_SWEEP);
+    break;
+  case GC_PHASE_SWEEP:
+    if (background.survivors != NULL) {
+      background.lastSurvivor->next = vm.objects;
+      vm.objects = background.survivors;
+      background.survivors = NULL;
+    }
+    vm.bytesAllocated -= background.swept;
+    background.swept = 0;
+    vm.gcPhase = GC_PHASE_IDLE;
+    cycles++;
+    break;
+  }
+  return true;
+}
+
+/**
+ * Gets the concurrent collector's thread going, false if it can't be
+ */
+static bool startCollector() {
+  if (background.running)
+    return true;
+  background.running =
+      startThread(&background.thread, collectorThread, NULL);
+  return background.running;
+}
+
+static void stopCollector() {
+  if (!background.running)
+    return;
+  collectorBusy(true);
+  startTask(TASK_EXIT);
+  pthread_join(background.thread, NULL);
+  background.running = false;
+  background.task = TASK_NONE;
+}
+
+/**
+ * In generational mode this is a minor collection, or a major one when the
+ * old objects grew past vm.nextMajorGC since the last one. Between
+ * collections the old objects stay marked, that's how marking (and
+ * writeBarrier()) tells them apart from the young ones. In incremental and
+ * concurrent mode it's only the next slice of the collection, with the next
+ * one due after another GC_SLICE_BYTES
+ */
+void collectGarbage() {
+  if (vm.gcMode == GC_CONCURRENT && vm.gcPhase == GC_PHASE_IDLE &&
+      !atNewObject)
+    return; // see allocateObjectMemory()
+  size_t before = vm.bytesAllocated;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (vm.gcMode == GC_FULL) {
+    // what the program didn't get to since the last one, its sweep is what
+    // clears the marks. Generational marks only add up until a major
+    // collection clears them all, an unswept dead object stays unmarked
+    // either way and can wait for heapAllocate() past this one
+    heapFinishSweep();
+    lazilyFreed(before - vm.bytesAllocated);
+  }
+  PauseKind kind = vm.gcMode == GC_FULL            ? PAUSE_FULL
+                   : vm.gcMode != GC_GENERATIONAL ? PAUSE_SLICE
+                   : vm.oldBytes > vm.nextMajorGC ? PAUSE_MAJOR
+                                                  : PAUSE_MINOR;
+#ifdef DEBUG_LOG_GC
+  static const char *kinds[] = {"gc", "minor gc", "major gc", "gc slice",
+                                "gc remark"};
+  printf("---%s begins\n", kinds[kind]);
+#endif
+
+  bool paused = true; // concurrent: not if the thread was still busy
+  if (vm.gcMode == GC_CONCURRENT) {
+    paused = concurrentSlice(false, &kind);
+  } else if (kind == PAUSE_SLICE) {
+    incrementalSlice();
+  } else if (kind == PAUSE_MINOR) {
+    minorCollection();
+  } else if (kind == PAUSE_MAJOR) {
+    majorCollection();
+    vm.nextMajorGC = vm.bytesAllocated * GC_HEAP_GROWTH_FACTOR;
+    if (vm.nextMajorGC < GC_MIN_MAJOR)
+      vm.nextMajorGC = GC_MIN_MAJOR;
+  } else {
+    markRoots();
+    traceHeap();
+    tableRemoveWhite(&vm.strings);
+    sweep(false); // what's not in the blocks
+    heapStartSweep(false);
+  }
+
+  if (vm.gcMode == GC_GENERATIONAL) {
+    vm.oldBytes = vm.bytesAllocated;
+    vm.nextGC = vm.bytesAllocated + vm.nurserySize;
+  } else if (vm.gcPhase != GC_PHASE_IDLE) {
+    vm.nextGC = vm.bytesAllocated + GC_SLICE_BYTES;
+  } else {
+    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROWTH_FACTOR;
+  }
+
+  if (paused)
+    recordPause(kind, elapsedMs(&start), before - vm.bytesAllocated);
 
 #ifdef DEBUG_LOG_GC
-  printf("---gc ends\n");
+  printf("---%s ends\n", kinds[kind]);
   printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
          before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
 #endif
 }
 
-void freeObjects() {
-  Obj *object = vm.objects;
+/**
+ * Switches the collector over, with everything allocated so far counting as
+ * old (generational) or all of it white (the others). Without a thread for
+ * it, concurrent is incremental instead. Full and generational put new
+ * objects into heap.c's blocks from here on, the incremental and concurrent
+ * collectors only know about the object lists, and nothing can be moved out
+ * of the blocks: once there's something in them the collector stays one of
+ * the first two. clox picks its collector before it runs anything, so up to
+ * then objects go on the lists
+ */
+void setGcMode(GcMode mode) {
+  bool blocks = mode == GC_FULL || mode == GC_GENERATIONAL;
+  if (!blocks && heapInUse()) {
+    fprintf(stderr, "Objects are in heap blocks already, the collector "
+                    "stays %s.\n",
+            vm.gcMode == GC_FULL ? "full" : "generational");
+    return;
+  }
+  while (vm.gcPhase != GC_PHASE_IDLE) {
+    PauseKind kind;
+    if (vm.gcMode == GC_CONCURRENT) {
+      concurrentSlice(true, &kind);
+    } else {
+      incrementalSlice();
+    }
+  }
+  if (mode != GC_CONCURRENT) {
+    stopCollector();
+  } else if (!startCollector()) {
+    fprintf(stderr, "No thread for the concurrent collector, the "
+                    "incremental one it is.\n");
+    mode = GC_INCREMENTAL;
+  }
+  while (vm.youngObjects != NULL) {
+    Obj *object = vm.youngObjects;
+    vm.youngObjects = object->next;
+    object->next = vm.objects;
+    vm.objects = object;
+  }
+  for (Obj *object = vm.objects; object != NULL; object = object->next) {
+    object->isMarked = mode == GC_GENERATIONAL;
+  }
+  heapFinishSweep();
+  heapSetMarks(mode == GC_GENERATIONAL);
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    vm.remembered[i]->isRemembered = false;
+  }
+  vm.rememberedCount = 0;
+  vm.gcMode = mode;
+  inBlocks = blocks;
+  if (mode == GC_GENERATIONAL) {
+    vm.oldBytes = vm.bytesAllocated;
+    vm.nextGC = vm.bytesAllocated + vm.nurserySize;
+  }
+}
+
+/**
+ * What clox --gc-stats prints at exit: per kind of collection how many there
+ * were and how long they took, then how the pauses were spread out
+ */
+void reportGcStats(FILE *out) {
+  static const char *modes[] = {"full", "generational", "incremental",
+                                "concurrent"};
+  static const char *names[] = {"full", "minor", "major", "slice", "remark"};
+  fprintf(out, "== gc (%s) ==\n", modes[vm.gcMode]);
+  fprintf(out, "%-6s %8s %12s %10s %10s %14s\n", "kind", "count", "total ms",
+          "mean ms", "max ms", "freed bytes");
+  int total = 0;
+  for (int kind = 0; kind < 5; kind++) {
+    PauseStats *stats = &pauses[kind];
+    total += stats->count;
+    if (stats->count == 0)
+      continue;
+    fprintf(out, "%-6s %8d %12.3f %10.4f %10.4f %14zu\n", names[kind],
+            stats->count, stats->total, stats->total / stats->count,
+            stats->longest, stats->freed);
+  }
+  if (vm.gcMode == GC_INCREMENTAL) {
+    fprintf(out, "%d collections finished, budget %d\n", cycles, vm.gcBudget);
+  } else if (vm.gcMode == GC_CONCURRENT) {
+    fprintf(out, "%d collections finished, on the thread: marking %.3f ms, "
+                 "sweeping %.3f ms\n",
+            cycles, background.markMs, background.sweepMs);
+    fprintf(out, "%ld objects traced by the marker, %ld by the program\n",
+            background.scanned, background.snapshotted);
+  } else {
+    reportHeap(out);
+  }
+  if (parallel.scanned > 0) {
+    fprintf(out, "tracing %.3f ms with %d thread%s, %ld objects, %ld stolen\n",
+            parallel.traceMs, vm.gcThreads, vm.gcThreads == 1 ? "" : "s",
+            parallel.scanned, parallel.stolen);
+  }
+  if (total == 0)
+    return;
+
+  fprintf(out, "-- pauses (us)\n");
+  int seen = 0;
+  for (int i = 0; i < PAUSE_BUCKETS; i++) {
+    if (pauseHistogram[i] == 0)
+      continue;
+    seen += pauseHistogram[i];
+    if (i == PAUSE_BUCKETS - 1) {
+      fprintf(out, "%9d+        ", 1 << i);
+    } else {
+      fprintf(out, "%9d - %-6d", i == 0 ? 0 : 1 << i, 1 << (i + 1));
+    }
+    fprintf(out, " %8d %7.2f%% %7.2f%%\n", pauseHistogram[i],
+            100.0 * pauseHistogram[i] / total, 100.0 * seen / total);
+  }
+}
+
+static void freeList(Obj *object) {
   while (object != NULL) {
     Obj *next = object->next;
     freeObject(object);
     object = next;
   }
+}
+
+void freeObjects() {
+  stopCollector();
+  stopMarkers();
+  freeList(vm.objects);
+  freeList(vm.youngObjects);
+  freeList(vm.sweeping);
+  freeList(background.survivors);
+  heapForEach(freeObject);
+  freeHeap();
+  free(background.grayStack);
   free(vm.grayStack);
+  free(vm.remembered);
 }
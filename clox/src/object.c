@@ -11,11 +11,23 @@
   (type *)allocateObject(sizeof(type), objectType)
 
 static Obj *allocateObject(size_t size, ObjType type) {
-  Obj *object = (Obj *)reallocate(NULL, 0, size);
+  Obj *object = (Obj *)allocateObjectMemory(size);
   object->type = type;
-  object->isMarked = false;
-  object->next = vm.objects;
-  vm.objects = object;
+  // incremental: black while the collection in progress still marks, the
+  // marker has no way to find out about it otherwise
+  object->isMarked =
+      vm.gcPhase == GC_PHASE_MARK || vm.gcPhase == GC_PHASE_STRINGS;
+  // concurrent: nothing in it to trace for the marker, see snapshotBarrier()
+  object->scanState = concurrentMarking ? SCAN_DONE : SCAN_NONE;
+  object->isRemembered = false;
+  // generational: young until it survives a collection. Full: the blocks
+  // keep track of their objects
+  if (!object->inBlock) {
+    Obj **list =
+        vm.gcMode == GC_GENERATIONAL ? &vm.youngObjects : &vm.objects;
+    object->next = *list;
+    *list = object;
+  }
 #ifdef DEBUG_LOG_GC
   printf("%p allocated %zu for %d\n", (void *)object, size, type);
 #endif
@@ -26,13 +38,25 @@ ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method) {
   ObjBoundMethod *bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
   bound->method = method;
   bound->receiver = receiver;
+  writeBarrier(&bound->obj, OBJ_VAL(method));
+  writeBarrier(&bound->obj, receiver);
   return bound;
 }
 
 ObjClass *newClass(ObjString *name) {
   ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
   klass->name = name;
+  writeBarrier(&klass->obj, OBJ_VAL(name));
   initTable(&klass->methods);
+  klass->rootShape = NULL;
+  klass->initializer = NULL;
+  klass->fieldHint = 0;
+  push(OBJ_VAL(klass)); // newShape() can run the GC
+  ObjShape *rootShape = newShape(klass);
+  snapshotBarrier(&klass->obj); // and start a concurrent one
+  klass->rootShape = rootShape;
+  writeBarrier(&klass->obj, OBJ_VAL(rootShape));
+  pop();
   return klass;
 }
 
@@ -45,6 +69,7 @@ ObjClosure *newClosure(ObjFunction *function) {
   closure->function = function;
   closure->upvalues = upvalues;
   closure->upvalueCount = function->upvalueCount;
+  writeBarrier(&closure->obj, OBJ_VAL(function));
   return closure;
 }
 
@@ -53,14 +78,31 @@ ObjFunction *newFunction() {
   function->arity = 0;
   function->upvalueCount = 0;
   function->name = NULL;
+  function->jit = NULL;
+  function->hotness = 0;
+  function->compiled = NULL;
+  function->maxStack = 0;
+  function->opStatsIndex = -1;
   initChunk(&function->chunk);
   return function;
 }
 
+/**
+ * Makes an instance with room for as many fields as the class's instances
+ * have needed so far, so filling them in (init, usually) never has to grow
+ * the fields and the inline caches can add every one of them in place
+ */
 ObjInstance *newInstance(ObjClass *klass) {
+  // the fields go first, the instance would be unreachable while they're made
+  Value *fields = klass->fieldHint > 0 ? ALLOCATE(Value, klass->fieldHint) : NULL;
   ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
   instance->klass = klass;
-  initTable(&instance->fields);
+  instance->shape = klass->rootShape;
+  instance->fields = fields;
+  instance->fieldCapacity = klass->fieldHint;
+  instance->dictionary = NULL;
+  writeBarrier(&instance->obj, OBJ_VAL(klass));
+  writeBarrier(&instance->obj, OBJ_VAL(klass->rootShape));
   return instance;
 }
 
@@ -69,6 +111,142 @@ ObjNative *newNative(NativeFn function) {
   native->function = function;
   return native;
 }
+
+/**
+ * Makes the root shape (no fields) of klass
+ */
+ObjShape *newShape(ObjClass *klass) {
+  ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+  shape->klass = klass;
+  shape->parent = NULL;
+  shape->keys = NULL;
+  shape->fieldCount = 0;
+  initTable(&shape->transitions);
+  writeBarrier(&shape->obj, OBJ_VAL(klass));
+  return shape;
+}
+
+/**
+ * Gives back the shape an instance of shape ends up with after adding the
+ * field key. The child is made the first time someone adds key here, after
+ * that everyone gets the same one out of the transitions table
+ */
+ObjShape *shapeAddField(ObjShape *shape, ObjString *key) {
+  Value existing;
+  if (tableGet(&shape->transitions, key, &existing)) {
+    return AS_SHAPE(existing);
+  }
+
+  // every shape has its own copy of the keys so looking up a name is a short
+  // scan of one array instead of a walk up the parents
+  ObjString **keys = ALLOCATE(ObjString *, shape->fieldCount + 1);
+  for (int i = 0; i < shape->fieldCount; i++) {
+    keys[i] = shape->keys[i];
+  }
+  keys[shape->fieldCount] = key;
+
+  ObjShape *child = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+  child->klass = shape->klass;
+  child->parent = shape;
+  child->keys = keys;
+  child->fieldCount = shape->fieldCount + 1;
+  initTable(&child->transitions);
+  // the parent has all the other keys, and the class
+  writeBarrier(&child->obj, OBJ_VAL(shape));
+  writeBarrier(&child->obj, OBJ_VAL(key));
+
+  push(OBJ_VAL(child)); // not reachable from shape until tableSet() is done
+  snapshotBarrier(&shape->obj);
+  tableSet(&shape->transitions, key, OBJ_VAL(child));
+  writeBarrier(&shape->obj, OBJ_VAL(key));
+  writeBarrier(&shape->obj, OBJ_VAL(child));
+  pop();
+  return child;
+}
+
+/**
+ * Index of key in the fields of instances with this shape, -1 if they don't
+ * have it. The keys are interned, so comparing pointers is enough
+ */
+int shapeFindSlot(ObjShape *shape, ObjString *key) {
+  for (int i = shape->fieldCount - 1; i >= 0; i--) {
+    if (shape->keys[i] == key)
+      return i;
+  }
+  return -1;
+}
+
+bool instanceGetField(ObjInstance *instance, ObjString *name, Value *value) {
+  if (instance->shape == NULL) {
+    return tableGet(instance->dictionary, name, value);
+  }
+  int slot = shapeFindSlot(instance->shape, name);
+  if (slot == -1)
+    return false;
+  *value = instance->fields[slot];
+  return true;
+}
+
+/**
+ * Moves all fields of instance into a table of its own and leaves the shapes
+ * for good
+ */
+static void makeDictionary(ObjInstance *instance) {
+  Table *dictionary = ALLOCATE(Table, 1);
+  initTable(dictionary);
+  // the instance keeps its shape and fields until the copy is done, so a GC in
+  // the middle of it still finds every value
+  for (int i = 0; i < instance->shape->fieldCount; i++) {
+    tableSet(dictionary, instance->shape->keys[i], instance->fields[i]);
+  }
+  FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+  instance->fields = NULL;
+  instance->fieldCapacity = 0;
+  instance->shape = NULL;
+  instance->dictionary = dictionary;
+}
+
+/**
+ * Sets (or adds) a field. Adding moves the instance to the child shape, with
+ * the fields array growing a few slots at a time since most instances only
+ * ever get a handful of fields. The class remembers how far its instances
+ * got (see newInstance()).
+ * NOTE: can run the GC, so both instance and value have to be on the stack
+ */
+void instanceSetField(ObjInstance *instance, ObjString *name, Value value) {
+  snapshotBarrier(&instance->obj);
+  if (instance->shape != NULL) {
+    int slot = shapeFindSlot(instance->shape, name);
+    if (slot != -1) {
+      instance->fields[slot] = value;
+      writeBarrier(&instance->obj, value);
+      return;
+    }
+    if (instance->shape->fieldCount < SHAPE_MAX_FIELDS) {
+      ObjShape *next = shapeAddField(instance->shape, name);
+      snapshotBarrier(&instance->obj); // the new shape can start a collection
+      slot = instance->shape->fieldCount;
+      if (slot == instance->fieldCapacity) {
+        int oldCapacity = instance->fieldCapacity;
+        instance->fieldCapacity = oldCapacity < 4 ? 4 : oldCapacity * 2;
+        instance->fields = GROW_ARRAY(Value, instance->fields, oldCapacity,
+                                      instance->fieldCapacity);
+      }
+      if (slot >= instance->klass->fieldHint) {
+        instance->klass->fieldHint = slot + 1;
+      }
+      instance->fields[slot] = value;
+      instance->shape = next;
+      writeBarrier(&instance->obj, value);
+      writeBarrier(&instance->obj, OBJ_VAL(next));
+      return;
+    }
+    makeDictionary(instance);
+  }
+  tableSet(instance->dictionary, name, value);
+  writeBarrier(&instance->obj, OBJ_VAL(name));
+  writeBarrier(&instance->obj, value);
+}
 static ObjString *allocateString(char *chars, int length, uint32_t hash) {
   ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
   string->length = length;
@@ -91,10 +269,27 @@ static uint32_t hashString(const char *key, int length) { // hashing given
   return hash;
 }
 
+/**
+ * The interned copy of chars, if there is one. An incremental collection that
+ * finished marking hasn't necessarily dropped every unmarked string from
+ * vm.strings yet, so one that turns up is marked now, it's about to be used.
+ * So is one the concurrent marker might not get to: a string nothing
+ * referenced when it started isn't part of what it marks
+ */
+static ObjString *internedString(const char *chars, int length,
+                                 uint32_t hash) {
+  ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+  if (interned != NULL &&
+      (vm.gcPhase == GC_PHASE_STRINGS || concurrentMarking)) {
+    __atomic_store_n(&interned->obj.isMarked, true, __ATOMIC_RELAXED);
+  }
+  return interned;
+}
+
 ObjString *takeString(char *chars,
                       int length) { // for new string after concatination
   uint32_t hash = hashString(chars, length);
-  ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+  ObjString *interned = internedString(chars, length, hash);
   if (interned !=
       NULL) { // if the concatinated string's already interned, free the current
               // one and return the reference to interned one
@@ -107,8 +302,8 @@ ObjString *takeString(char *chars,
 ObjString *copyString(const char *chars, int length) {
   uint32_t hash = hashString(chars, length);
   ObjString *interned =
-      tableFindString(&vm.strings, chars, length,
-                      hash); // checking if the string's already interned, if
+      internedString(chars, length,
+                     hash); // checking if the string's already interned, if
                              // yes return that reference, else fall through
   if (interned != NULL)
     return interned;
@@ -135,7 +330,7 @@ static void printFunction(ObjFunction *function) {
 }
 
 void printObject(Value value) {
-  Obj *obj = value.as.obj;
+  Obj *obj = AS_OBJ(value);
   switch (obj->type) {
   case OBJ_BOUND_METHOD:
     printFunction(AS_BOUND_METHOD(value)->method->function);
@@ -163,6 +358,9 @@ void printObject(Value value) {
   case OBJ_NATIVE:
     printf("<native fn>");
     break;
+  case OBJ_SHAPE:
+    printf("shape");
+    break;
   case OBJ_STRING: {
     ObjString *string = (ObjString *)obj;
     printf("%s", string->chars);
@@ -0,0 +1,299 @@
+// Execution counts for clox --opstats: how often each opcode ran, how often
+// each pair and trigram of opcodes ran back to back (the sequences worth
+// fusing into a superinstruction, see peephole.c) and how many instructions
+// each function ran. run() and run_reg() only call recordOp() while
+// vm.opStats is on, see DISPATCH() there.
+//
+// Everything here is plain malloc()ed, reallocate() could run the GC right in
+// the middle of a dispatch
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "opstats.h"
+
+#define TOP_ROWS 20 // rows per section of the text report, the JSON has all
+
+/**
+ * key -> one opcode, a pair (first << 8 | second) or a trigram (first << 16 |
+ *        second << 8 | third)
+ */
+typedef struct {
+  uint32_t key;
+  uint64_t count;
+} OpCount;
+
+typedef struct {
+  char *name;
+  int line; // where it starts
+  uint64_t count;
+} FunctionCount;
+
+/**
+ * previous  -> the last two opcodes run, previous[0] the very last one, -1
+ *              until there were any
+ * trigrams  -> open addressing on key + 1, so a 0 key is an empty entry
+ * functions -> ObjFunction.opStatsIndex indexes into it
+ */
+typedef struct {
+  uint64_t total;
+  uint64_t opcodes[UINT8_COUNT];
+  uint64_t *pairs; // [first << 8 | second]
+  OpCount *trigrams;
+  int trigramCount;
+  int trigramCapacity;
+  FunctionCount *functions;
+  int functionCount;
+  int functionCapacity;
+  int previous[2];
+} OpStats;
+
+static OpStats stats;
+
+void initOpStats() {
+  memset(&stats, 0, sizeof(stats));
+  stats.pairs = calloc(UINT8_COUNT * UINT8_COUNT, sizeof(uint64_t));
+  stats.trigramCapacity = 1024;
+  stats.trigrams = calloc(stats.trigramCapacity, sizeof(OpCount));
+  stats.previous[0] = -1;
+  stats.previous[1] = -1;
+  if (stats.pairs == NULL || stats.trigrams == NULL) {
+    fprintf(stderr, "Not enough memory for --opstats.\n");
+    exit(74);
+  }
+}
+
+static OpCount *findTrigram(OpCount *trigrams, int capacity, uint32_t key) {
+  uint32_t index = (key * 2654435761u) & (capacity - 1);
+  for (;;) {
+    OpCount *entry = &trigrams[index];
+    if (entry->key == 0 || entry->key == key + 1)
+      return entry;
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+static void countTrigram(uint32_t key) {
+  if ((stats.trigramCount + 1) * 2 > stats.trigramCapacity) {
+    int capacity = stats.trigramCapacity * 2;
+    OpCount *trigrams = calloc(capacity, sizeof(OpCount));
+    if (trigrams == NULL) {
+      fprintf(stderr, "Not enough memory for --opstats.\n");
+      exit(74);
+    }
+    for (int i = 0; i < stats.trigramCapacity; i++) {
+      OpCount *entry = &stats.trigrams[i];
+      if (entry->key != 0)
+        *findTrigram(trigrams, capacity, entry->key - 1) = *entry;
+    }
+    free(stats.trigrams);
+    stats.trigrams = trigrams;
+    stats.trigramCapacity = capacity;
+  }
+
+  OpCount *entry = findTrigram(stats.trigrams, stats.trigramCapacity, key);
+  if (entry->key == 0) {
+    entry->key = key + 1;
+    stats.trigramCount++;
+  }
+  entry->count++;
+}
+
+/**
+ * Gives the function its row in the report, the first time it runs anything.
+ * The name gets copied, the function may well be collected before the end
+ */
+static int addFunction(ObjFunction *function) {
+  if (stats.functionCount == stats.functionCapacity) {
+    stats.functionCapacity =
+        stats.functionCapacity < 8 ? 8 : stats.functionCapacity * 2;
+    stats.functions = realloc(stats.functions,
+                              stats.functionCapacity * sizeof(FunctionCount));
+    if (stats.functions == NULL) {
+      fprintf(stderr, "Not enough memory for --opstats.\n");
+      exit(74);
+    }
+  }
+  const char *name =
+      function->name != NULL ? function->name->chars : "<script>";
+  FunctionCount *row = &stats.functions[stats.functionCount];
+  row->name = malloc(strlen(name) + 1);
+  strcpy(row->name, name);
+  row->line = function->chunk.LineIndex > 0 ? getAt(&function->chunk, 0) : 0;
+  row->count = 0;
+  return stats.functionCount++;
+}
+
+/**
+ * Counts instruction, which function is about to run
+ */
+void recordOp(ObjFunction *function, uint8_t instruction) {
+  stats.total++;
+  stats.opcodes[instruction]++;
+  if (stats.previous[0] != -1) {
+    stats.pairs[stats.previous[0] << 8 | instruction]++;
+    if (stats.previous[1] != -1) {
+      countTrigram((uint32_t)(stats.previous[1] << 16 |
+                              stats.previous[0] << 8 | instruction));
+    }
+  }
+  stats.previous[1] = stats.previous[0];
+  stats.previous[0] = instruction;
+
+  if (function->opStatsIndex == -1) {
+    function->opStatsIndex = addFunction(function);
+  }
+  stats.functions[function->opStatsIndex].count++;
+}
+
+// most first, ties in key order so the report comes out the same every time
+static int compareCounts(const void *a, const void *b) {
+  const OpCount *left = a;
+  const OpCount *right = b;
+  if (left->count != right->count)
+    return left->count < right->count ? 1 : -1;
+  return left->key < right->key ? -1 : left->key > right->key;
+}
+
+static int compareFunctions(const void *a, const void *b) {
+  const FunctionCount *left = a;
+  const FunctionCount *right = b;
+  if (left->count != right->count)
+    return left->count < right->count ? 1 : -1;
+  return left->line - right->line;
+}
+
+/**
+ * The opcodes (ops 1), pairs (2) or trigrams (3) that ran, most run first
+ *
+ * @return OpCount* malloc()ed, *count long
+ */
+static OpCount *sortedCounts(int ops, int *count) {
+  int capacity = ops == 1   ? UINT8_COUNT
+                 : ops == 2 ? UINT8_COUNT * UINT8_COUNT
+                            : stats.trigramCapacity;
+  OpCount *sorted = malloc((capacity > 0 ? capacity : 1) * sizeof(OpCount));
+  *count = 0;
+  for (int i = 0; i < capacity; i++) {
+    OpCount row;
+    if (ops == 1) {
+      row = (OpCount){(uint32_t)i, stats.opcodes[i]};
+    } else if (ops == 2) {
+      row = (OpCount){(uint32_t)i, stats.pairs[i]};
+    } else if (stats.trigrams[i].key != 0) {
+      row = (OpCount){stats.trigrams[i].key - 1, stats.trigrams[i].count};
+    } else {
+      continue;
+    }
+    if (row.count > 0)
+      sorted[(*count)++] = row;
+  }
+  qsort(sorted, *count, sizeof(OpCount), compareCounts);
+  return sorted;
+}
+
+static FunctionCount *sortedFunctions() {
+  FunctionCount *sorted =
+      malloc((stats.functionCount > 0 ? stats.functionCount : 1) *
+             sizeof(FunctionCount));
+  memcpy(sorted, stats.functions, stats.functionCount * sizeof(FunctionCount));
+  qsort(sorted, stats.functionCount, sizeof(FunctionCount), compareFunctions);
+  return sorted;
+}
+
+/**
+ * Writes the opcodes in key (ops of them) out, separated by separator
+ */
+static void printOps(FILE *out, uint32_t key, int ops, const char *separator) {
+  for (int i = ops - 1; i >= 0; i--) {
+    fprintf(out, "%s%s", opcodeName((key >> (8 * i)) & 0xff),
+            i > 0 ? separator : "");
+  }
+}
+
+static double percent(uint64_t count) {
+  return stats.total > 0 ? 100.0 * (double)count / (double)stats.total : 0;
+}
+
+/**
+ * The text report: every opcode that ran, then the most run pairs, trigrams
+ * and functions
+ */
+void reportOpStats(FILE *out) {
+  static const char *sections[] = {"opcodes", "pairs", "trigrams"};
+  fprintf(out, "== opstats: %llu instructions ==\n",
+          (unsigned long long)stats.total);
+  for (int ops = 1; ops <= 3; ops++) {
+    int count;
+    OpCount *sorted = sortedCounts(ops, &count);
+    int shown = ops == 1 || count < TOP_ROWS ? count : TOP_ROWS;
+    fprintf(out, "-- %s (%d of %d)\n", sections[ops - 1], shown, count);
+    for (int i = 0; i < shown; i++) {
+      fprintf(out, "%14llu %6.2f%%  ", (unsigned long long)sorted[i].count,
+              percent(sorted[i].count));
+      printOps(out, sorted[i].key, ops, " ");
+      fprintf(out, "\n");
+    }
+    free(sorted);
+  }
+
+  FunctionCount *functions = sortedFunctions();
+  int shown = stats.functionCount < TOP_ROWS ? stats.functionCount : TOP_ROWS;
+  fprintf(out, "-- functions (%d of %d)\n", shown, stats.functionCount);
+  for (int i = 0; i < shown; i++) {
+    fprintf(out, "%14llu %6.2f%%  %s (line %d)\n",
+            (unsigned long long)functions[i].count,
+            percent(functions[i].count), functions[i].name, functions[i].line);
+  }
+  free(functions);
+}
+
+/**
+ * The same as reportOpStats() in JSON, with every row instead of the top ones
+ *
+ * @return bool false if path couldn't be written
+ */
+bool writeOpStatsJson(const char *path) {
+  static const char *sections[] = {"opcodes", "pairs", "trigrams"};
+  FILE *out = fopen(path, "w");
+  if (out == NULL)
+    return false;
+
+  fprintf(out, "{\n  \"instructions\": %llu", (unsigned long long)stats.total);
+  for (int ops = 1; ops <= 3; ops++) {
+    int count;
+    OpCount *sorted = sortedCounts(ops, &count);
+    fprintf(out, ",\n  \"%s\": [", sections[ops - 1]);
+    for (int i = 0; i < count; i++) {
+      fprintf(out, "%s\n    {\"ops\": [\"", i > 0 ? "," : "");
+      printOps(out, sorted[i].key, ops, "\", \"");
+      fprintf(out, "\"], \"count\": %llu}",
+              (unsigned long long)sorted[i].count);
+    }
+    fprintf(out, "%s]", count > 0 ? "\n  " : "");
+    free(sorted);
+  }
+
+  // names are identifiers (or <script>), nothing in them needs escaping
+  FunctionCount *functions = sortedFunctions();
+  fprintf(out, ",\n  \"functions\": [");
+  for (int i = 0; i < stats.functionCount; i++) {
+    fprintf(out, "%s\n    {\"name\": \"%s\", \"line\": %d, \"count\": %llu}",
+            i > 0 ? "," : "", functions[i].name, functions[i].line,
+            (unsigned long long)functions[i].count);
+  }
+  fprintf(out, "%s]\n}\n", stats.functionCount > 0 ? "\n  " : "");
+  free(functions);
+  return fclose(out) == 0;
+}
+
+void freeOpStats() {
+  for (int i = 0; i < stats.functionCount; i++) {
+    free(stats.functions[i].name);
+  }
+  free(stats.functions);
+  free(stats.pairs);
+  free(stats.trigrams);
+  memset(&stats, 0, sizeof(stats));
+}
@@ -0,0 +1,180 @@
+// Peephole pass over a finished chunk: fuses the short instruction sequences
+// the compiler keeps emitting into single superinstructions, so run() pays for
+// one dispatch where it used to pay for three or four
+
+#include "chunk.h"
+#include "debug.h"
+#include "memory.h"
+#include "peephole.h"
+
+static void patchShort(uint8_t *code, int offset, int value) {
+  code[offset] = (value >> 8) & 0xff;
+  code[offset + 1] = value & 0xff;
+}
+
+/**
+ * Checks that the instructions starting at offset are exactly ops[0..n) and
+ * that nothing jumps into the middle of them (the first one can be a jump
+ * target, the sequence still starts there).
+ *
+ * @return int the no. of bytes the whole sequence takes, 0 if it didn't match
+ */
+static int matchSequence(Chunk *chunk, bool *isTarget, int offset,
+                         const uint8_t *ops, int n) {
+  int start = offset;
+  for (int i = 0; i < n; i++) {
+    if (offset >= chunk->count || chunk->code[offset] != ops[i])
+      return 0;
+    if (i > 0 && isTarget[offset])
+      return 0;
+    offset += instructionLength(chunk, offset);
+  }
+  return offset - start;
+}
+
+/**
+ * Rewrites chunk in place with the superinstructions fused in:
+ *
+ *   OP_GET_LOCAL a, OP_GET_LOCAL b, OP_ADD       -> OP_ADD_LL a b
+ *   OP_GET_LOCAL a, OP_CONSTANT c, OP_ADD        -> OP_ADD_LC a c
+ *   OP_GET_LOCAL a, OP_CONSTANT c, OP_LESS,
+ *   OP_JUMP_IF_FALSE offset, OP_POP              -> OP_LESS_LC_JIF a c offset
+ *   OP_GET_LOCAL a, OP_GET_LOCAL b, OP_LESS,
+ *   OP_JUMP_IF_FALSE offset, OP_POP              -> OP_LESS_LL_JIF a b offset
+ *   OP_SET_LOCAL a, OP_POP (assignment statement) -> OP_SET_LOCAL_POP a
+ *   OP_POP x n (e.g from endScope())             -> OP_POPN n
+ *
+ * The condition of a while/for/if is always followed by that OP_POP on the
+ * fall through path, so the OP_LESS_*_JIF forms swallow it and only leave the
+ * false behind when they jump (where the old OP_JUMP_IF_FALSE would have left
+ * it too).
+ *
+ * The new code is written out into a scratch chunk, remembering where every
+ * old offset ended up, and then every jump gets its distance worked out again
+ * from the old target. Fused instructions keep the line of their first
+ * instruction.
+ *
+ * @param chunk a function's chunk, right after endCompiler() is done with it
+ *
+ * @return void
+ */
+void optimizeChunk(Chunk *chunk) {
+  static const uint8_t lessJump[] = {OP_GET_LOCAL, OP_CONSTANT, OP_LESS,
+                                     OP_JUMP_IF_FALSE, OP_POP};
+  static const uint8_t lessLocalsJump[] = {OP_GET_LOCAL, OP_GET_LOCAL, OP_LESS,
+                                           OP_JUMP_IF_FALSE, OP_POP};
+  static const uint8_t setLocalPop[] = {OP_SET_LOCAL, OP_POP};
+  static const uint8_t addLocals[] = {OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD};
+  static const uint8_t addConstant[] = {OP_GET_LOCAL, OP_CONSTANT, OP_ADD};
+
+  int count = chunk->count;
+  bool *isTarget = ALLOCATE(bool, count + 1);
+  int *newOffset = ALLOCATE(int, count + 1); // old offset -> new offset
+  int *jumpFrom = ALLOCATE(int, count);      // new offsets of the jumps
+  int *jumpTo = ALLOCATE(int, count);        // and their old targets
+  int jumpCount = 0;
+
+  for (int offset = 0; offset <= count; offset++) {
+    isTarget[offset] = false;
+    newOffset[offset] = -1;
+  }
+  for (int offset = 0; offset < count;
+       offset += instructionLength(chunk, offset)) {
+    int target = jumpTarget(chunk->code, offset);
+    if (target != -1)
+      isTarget[target] = true;
+  }
+
+  Chunk out;
+  initChunk(&out);
+  uint8_t *code = chunk->code;
+  for (int offset = 0; offset < count;) {
+    int line = getAt(chunk, offset);
+    int length;
+    newOffset[offset] = out.count;
+
+    if ((length = matchSequence(chunk, isTarget, offset, lessJump, 5)) ||
+        (length = matchSequence(chunk, isTarget, offset, lessLocalsJump, 5))) {
+      jumpFrom[jumpCount] = out.count;
+      jumpTo[jumpCount++] = jumpTarget(code, offset + 5);
+      writeChunk(&out,
+                 code[offset + 2] == OP_CONSTANT ? OP_LESS_LC_JIF
+                                                 : OP_LESS_LL_JIF,
+                 line);
+      writeChunk(&out, code[offset + 1], line);
+      writeChunk(&out, code[offset + 3], line);
+      writeChunk(&out, 0xff, line); // patched below
+      writeChunk(&out, 0xff, line);
+    } else if ((length =
+                    matchSequence(chunk, isTarget, offset, setLocalPop, 2))) {
+      writeChunk(&out, OP_SET_LOCAL_POP, line);
+      writeChunk(&out, code[offset + 1], line);
+    } else if ((length =
+                    matchSequence(chunk, isTarget, offset, addLocals, 3))) {
+      writeChunk(&out, OP_ADD_LL, line);
+      writeChunk(&out, code[offset + 1], line);
+      writeChunk(&out, code[offset + 3], line);
+    } else if ((length = matchSequence(chunk, isTarget, offset, addConstant,
+                                       3))) {
+      writeChunk(&out, OP_ADD_LC, line);
+      writeChunk(&out, code[offset + 1], line);
+      writeChunk(&out, code[offset + 3], line);
+    } else if (code[offset] == OP_POP && offset + 1 < count &&
+               code[offset + 1] == OP_POP && !isTarget[offset + 1]) {
+      int n = 0;
+      while (offset + n < count && code[offset + n] == OP_POP &&
+             (n == 0 || !isTarget[offset + n]) && n < UINT8_MAX) {
+        n++;
+      }
+      writeChunk(&out, OP_POPN, line);
+      writeChunk(&out, (uint8_t)n, line);
+      length = n;
+    } else {
+      length = instructionLength(chunk, offset);
+      if (jumpTarget(code, offset) != -1) {
+        jumpFrom[jumpCount] = out.count;
+        jumpTo[jumpCount++] = jumpTarget(code, offset);
+      }
+      for (int i = 0; i < length; i++) {
+        writeChunk(&out, code[offset + i], line);
+      }
+    }
+    offset += length;
+  }
+  newOffset[count] = out.count;
+
+  for (int i = 0; i < jumpCount; i++) {
+    int from = jumpFrom[i];
+    int to = newOffset[jumpTo[i]];
+    switch (out.code[from]) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+      patchShort(out.code, from + 1, to - (from + 3));
+      break;
+    case OP_LOOP:
+      patchShort(out.code, from + 1, (from + 3) - to);
+      break;
+    case OP_LESS_LC_JIF:
+    case OP_LESS_LL_JIF:
+      patchShort(out.code, from + 3, to - (from + 5));
+      break;
+    }
+  }
+
+  FREE_ARRAY(bool, isTarget, count + 1);
+  FREE_ARRAY(int, newOffset, count + 1);
+  FREE_ARRAY(int, jumpFrom, count);
+  FREE_ARRAY(int, jumpTo, count);
+
+  // the fused code only ever got shorter, so every jump still fits in 16 bits
+  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(int, chunk->lines, chunk->LineCapacity);
+  FREE_ARRAY(int, chunk->new_lines, chunk->LineCapacity);
+  chunk->code = out.code;
+  chunk->count = out.count;
+  chunk->capacity = out.capacity;
+  chunk->lines = out.lines;
+  chunk->new_lines = out.new_lines;
+  chunk->LineIndex = out.LineIndex;
+  chunk->LineCapacity = out.LineCapacity;
+}
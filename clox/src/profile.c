@@ -0,0 +1,435 @@
+// The sampling profiler behind clox --profile. A CPU-time timer sends SIGPROF
+// every PROFILE_INTERVAL_NS, and the handler (takeSample()) writes down the
+// whole vm.frames chain at that moment, the function and line of each frame,
+// into a ring buffer that's allocated up front. Nothing in the handler
+// allocates or takes a lock, it only reads vm.frames and copies names into
+// tables made by startProfiler(). drainProfile() moves the samples out of the
+// ring into the counts the reports are made of, outside the handler.
+//
+// The callers' lines are exact, they are where each of them made its call.
+// The innermost frame's ip is only stored back now and then (calls, anything
+// that can run the GC, see STORE_FRAME() in vm.c), and never while it runs as
+// machine code, so its line is where it last did that.
+
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "debug.h"
+#include "profile.h"
+#include "vm.h"
+
+#define PROFILE_INTERVAL_NS 1000000 // 1ms of CPU time between samples
+#define PROFILE_MAX_DEPTH 256 // innermost frames kept of deeper stacks
+#define PROFILE_FUNCTIONS 4096 // distinct functions it can tell apart
+#define NAME_POOL (PROFILE_FUNCTIONS * 32) // bytes for all of their names
+#define RING_WORDS ((size_t)1 << 22) // must be a power of 2
+#define TOP_ROWS 20 // functions in the flat report
+
+/**
+ * A function as the samples name it, told apart by name and first line
+ * (methods of different classes share names). The entries are only ever
+ * written by the handler, used tells whether one is
+ * name -> into the name pool, '\0' terminated
+ */
+typedef struct {
+  bool used;
+  uint32_t hash;
+  int line;
+  int length;
+  int name;
+} ProfiledFunction;
+
+/**
+ * A distinct call stack, as a line of the collapsed stacks file would have it
+ * ("outer:line;inner:line")
+ */
+typedef struct {
+  char *key;
+  uint64_t count;
+} StackCount;
+
+/**
+ * ring      -> every sample is its depth and then (function, line) for each
+ *              frame from the outermost in. The handler only ever moves head
+ *              and drainProfile() only tail, both just keep counting up
+ * dropped   -> samples that found the ring full
+ * other     -> stands for any function once the function table is full
+ * outside   -> where a sample lands with no frames at all (compiling, or
+ *              clox itself starting up / finishing)
+ * truncated -> root of the stacks deeper than PROFILE_MAX_DEPTH
+ * self      -> samples with the function innermost, total -> samples with
+ *              it anywhere in the stack, both by function index
+ * seen      -> last sample each function was counted in total for, so
+ *              recursion doesn't count it twice
+ */
+typedef struct {
+  timer_t timer;
+  bool running;
+  uint32_t *ring;
+  _Atomic size_t head;
+  _Atomic size_t tail;
+  volatile uint64_t dropped;
+
+  ProfiledFunction *functions;
+  int functionCount;
+  char *names;
+  int namesUsed;
+  int other;
+  int outside;
+  int truncated;
+
+  uint64_t samples;
+  uint64_t *self;
+  uint64_t *total;
+  uint64_t *seen;
+  StackCount *stacks;
+  int stackCount;
+  int stackCapacity;
+  char *key; // the stack drainProfile() is putting together
+  size_t keyCapacity;
+} Profile;
+
+static Profile profile;
+
+/**
+ * The index of the function, which gets a row the first time it's seen.
+ * Runs in the handler too, so a full table just makes it profile.other
+ */
+static int functionIndex(const char *name, int length, uint32_t hash,
+                         int line) {
+  hash ^= (uint32_t)line * 2654435761u;
+  uint32_t index = hash & (PROFILE_FUNCTIONS - 1);
+  for (;;) {
+    ProfiledFunction *function = &profile.functions[index];
+    if (!function->used)
+      break;
+    if (function->hash == hash && function->line == line &&
+        function->length == length &&
+        memcmp(profile.names + function->name, name, length) == 0)
+      return (int)index;
+    index = (index + 1) & (PROFILE_FUNCTIONS - 1);
+  }
+
+  if (profile.functionCount >= PROFILE_FUNCTIONS * 3 / 4 ||
+      profile.namesUsed + length + 1 > NAME_POOL)
+    return profile.other;
+  ProfiledFunction *function = &profile.functions[index];
+  function->hash = hash;
+  function->line = line;
+  function->length = length;
+  function->name = profile.namesUsed;
+  memcpy(profile.names + profile.namesUsed, name, length);
+  profile.names[profile.namesUsed + length] = '\0';
+  profile.namesUsed += length + 1;
+  profile.functionCount++;
+  function->used = true;
+  return (int)index;
+}
+
+static int namedIndex(const char *name) {
+  return functionIndex(name, (int)strlen(name), 0, 0);
+}
+
+/**
+ * The line the frame is at, going by the instruction before its ip (the one
+ * it's in the middle of, or for callers the call)
+ */
+static int frameLine(CallFrame *frame, Chunk *chunk) {
+  if (chunk->LineIndex == 0)
+    return 0;
+  long offset = (long)(frame->ip - chunk->code) - 1;
+  if (offset < 0 || offset >= chunk->count)
+    offset = 0;
+  return getAt(chunk, (int)offset);
+}
+
+static inline void ringPut(size_t at, uint32_t word) {
+  profile.ring[at & (RING_WORDS - 1)] = word;
+}
+
+/**
+ * The SIGPROF handler
+ */
+static void takeSample(int signal) {
+  (void)signal;
+  CallFrame *frames = vm.frames;
+  int count = vm.frameCount;
+  int first = count > PROFILE_MAX_DEPTH ? count - PROFILE_MAX_DEPTH : 0;
+  uint32_t depth = (uint32_t)(count - first) + (count == 0 || first > 0);
+  size_t head = atomic_load_explicit(&profile.head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&profile.tail, memory_order_acquire);
+  if (RING_WORDS - (head - tail) < 1 + 2 * (size_t)depth) {
+    profile.dropped++;
+    return;
+  }
+
+  ringPut(head++, depth);
+  if (count == 0 || first > 0) {
+    ringPut(head++, (uint32_t)(count == 0 ? profile.outside : profile.truncated));
+    ringPut(head++, 0);
+  }
+  for (int i = first; i < count; i++) {
+    CallFrame *frame = &frames[i];
+    ObjFunction *function = frame->closure->function;
+    Chunk *chunk = &function->chunk;
+    int index = function->name != NULL
+                    ? functionIndex(function->name->chars,
+                                    function->name->length,
+                                    function->name->hash,
+                                    chunk->LineIndex > 0 ? chunk->lines[0] : 0)
+                    : functionIndex("<script>", 8, 0, 0);
+    ringPut(head++, (uint32_t)index);
+    ringPut(head++, (uint32_t)frameLine(frame, chunk));
+  }
+  atomic_store_explicit(&profile.head, head, memory_order_release);
+}
+
+/**
+ * Sets everything up and starts the timer
+ *
+ * @return bool false if there's no memory or no timer for it
+ */
+bool startProfiler() {
+  memset(&profile, 0, sizeof(profile));
+  profile.ring = malloc(RING_WORDS * sizeof(uint32_t));
+  profile.functions = calloc(PROFILE_FUNCTIONS, sizeof(ProfiledFunction));
+  profile.names = malloc(NAME_POOL);
+  profile.self = calloc(PROFILE_FUNCTIONS, sizeof(uint64_t));
+  profile.total = calloc(PROFILE_FUNCTIONS, sizeof(uint64_t));
+  profile.seen = calloc(PROFILE_FUNCTIONS, sizeof(uint64_t));
+  if (profile.ring == NULL || profile.functions == NULL ||
+      profile.names == NULL || profile.self == NULL || profile.total == NULL ||
+      profile.seen == NULL)
+    return false;
+  profile.other = namedIndex("[other]");
+  profile.outside = namedIndex("[clox]");
+  profile.truncated = namedIndex("[truncated]");
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = takeSample;
+  action.sa_flags = SA_RESTART; // the script's reads and writes carry on
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, NULL) != 0)
+    return false;
+
+  struct sigevent event;
+  memset(&event, 0, sizeof(event));
+  event.sigev_notify = SIGEV_SIGNAL;
+  event.sigev_signo = SIGPROF;
+  if (timer_create(CLOCK_PROCESS_CPUTIME_ID, &event, &profile.timer) != 0)
+    return false;
+  struct itimerspec interval = {{0, PROFILE_INTERVAL_NS},
+                                {0, PROFILE_INTERVAL_NS}};
+  if (timer_settime(profile.timer, 0, &interval, NULL) != 0) {
+    timer_delete(profile.timer);
+    return false;
+  }
+  profile.running = true;
+  return true;
+}
+
+/**
+ * Stops the samples, the ones still in the ring get drained
+ */
+void stopProfiler() {
+  if (!profile.running)
+    return;
+  timer_delete(profile.timer);
+  signal(SIGPROF, SIG_IGN); // one may still be on its way
+  profile.running = false;
+  drainProfile();
+}
+
+static uint32_t hashKey(const char *key) {
+  uint32_t hash = 2166136261u; // FNV-1a, like hashString() in object.c
+  for (; *key != '\0'; key++) {
+    hash ^= (uint8_t)*key;
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static StackCount *findStack(StackCount *stacks, int capacity,
+                             const char *key) {
+  uint32_t index = hashKey(key) & (capacity - 1);
+  for (;;) {
+    StackCount *entry = &stacks[index];
+    if (entry->key == NULL || strcmp(entry->key, key) == 0)
+      return entry;
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+static void countStack(const char *key) {
+  if ((profile.stackCount + 1) * 2 > profile.stackCapacity) {
+    int capacity = profile.stackCapacity < 64 ? 64 : profile.stackCapacity * 2;
+    StackCount *stacks = calloc(capacity, sizeof(StackCount));
+    if (stacks == NULL) {
+      fprintf(stderr, "Not enough memory for --profile.\n");
+      exit(74);
+    }
+    for (int i = 0; i < profile.stackCapacity; i++) {
+      if (profile.stacks[i].key != NULL)
+        *findStack(stacks, capacity, profile.stacks[i].key) = profile.stacks[i];
+    }
+    free(profile.stacks);
+    profile.stacks = stacks;
+    profile.stackCapacity = capacity;
+  }
+
+  StackCount *entry = findStack(profile.stacks, profile.stackCapacity, key);
+  if (entry->key == NULL) {
+    entry->key = malloc(strlen(key) + 1);
+    strcpy(entry->key, key);
+    profile.stackCount++;
+  }
+  entry->count++;
+}
+
+static const char *functionName(int index) {
+  return profile.names + profile.functions[index].name;
+}
+
+/**
+ * Moves every sample in the ring into the counts. Safe to run while the timer
+ * is still going, the handler just keeps adding behind it
+ */
+void drainProfile() {
+  if (profile.ring == NULL)
+    return;
+
+  size_t tail = atomic_load_explicit(&profile.tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&profile.head, memory_order_acquire);
+  while (tail != head) {
+    uint32_t depth = profile.ring[tail++ & (RING_WORDS - 1)];
+    uint64_t sample = ++profile.samples;
+    size_t length = 0;
+    int index = 0;
+    for (uint32_t i = 0; i < depth; i++) {
+      index = (int)profile.ring[tail++ & (RING_WORDS - 1)];
+      int line = (int)profile.ring[tail++ & (RING_WORDS - 1)];
+      const char *name = functionName(index);
+
+      size_t needed = length + strlen(name) + 16;
+      if (needed > profile.keyCapacity) {
+        profile.keyCapacity = needed * 2;
+        profile.key = realloc(profile.key, profile.keyCapacity);
+        if (profile.key == NULL) {
+          fprintf(stderr, "Not enough memory for --profile.\n");
+          exit(74);
+        }
+      }
+      length += (size_t)sprintf(profile.key + length, "%s%s", i > 0 ? ";" : "",
+                                name);
+      if (line > 0) // [clox] and [truncated] have none
+        length += (size_t)sprintf(profile.key + length, ":%d", line);
+      if (profile.seen[index] != sample) {
+        profile.seen[index] = sample;
+        profile.total[index]++;
+      }
+    }
+    profile.self[index]++; // the innermost one
+    countStack(profile.key);
+  }
+  atomic_store_explicit(&profile.tail, tail, memory_order_release);
+}
+
+static int compareFunctions(const void *a, const void *b) {
+  int left = *(const int *)a;
+  int right = *(const int *)b;
+  if (profile.self[left] != profile.self[right])
+    return profile.self[left] < profile.self[right] ? 1 : -1;
+  if (profile.total[left] != profile.total[right])
+    return profile.total[left] < profile.total[right] ? 1 : -1;
+  return strcmp(functionName(left), functionName(right));
+}
+
+static int compareStacks(const void *a, const void *b) {
+  return strcmp(((const StackCount *)a)->key, ((const StackCount *)b)->key);
+}
+
+static double percent(uint64_t count) {
+  return profile.samples > 0 ? 100.0 * (double)count / (double)profile.samples
+                             : 0;
+}
+
+/**
+ * The flat report: the functions the most samples landed in, with how many
+ * landed in them directly (self) and anywhere under them (total)
+ */
+void reportProfile(FILE *out) {
+  if (profile.ring == NULL)
+    return;
+  stopProfiler();
+  int rows[PROFILE_FUNCTIONS];
+  int count = 0;
+  for (int i = 0; i < PROFILE_FUNCTIONS; i++) {
+    if (profile.total[i] > 0)
+      rows[count++] = i;
+  }
+  qsort(rows, count, sizeof(int), compareFunctions);
+
+  fprintf(out, "== profile: %llu samples, %d us of CPU apart",
+          (unsigned long long)profile.samples, PROFILE_INTERVAL_NS / 1000);
+  if (profile.dropped > 0)
+    fprintf(out, ", %llu dropped", (unsigned long long)profile.dropped);
+  fprintf(out, " ==\n%8s %8s %10s  function\n", "self", "total", "samples");
+  for (int i = 0; i < count && i < TOP_ROWS; i++) {
+    int index = rows[i];
+    fprintf(out, "%7.2f%% %7.2f%% %10llu  %s", percent(profile.self[index]),
+            percent(profile.total[index]),
+            (unsigned long long)profile.self[index], functionName(index));
+    if (profile.functions[index].line > 0)
+      fprintf(out, " (line %d)", profile.functions[index].line);
+    fprintf(out, "\n");
+  }
+}
+
+/**
+ * Every distinct stack and its samples in the collapsed format flame graph
+ * tools (flamegraph.pl, speedscope, inferno) read: frames outermost first,
+ * as function:line, separated by ';', then the count
+ *
+ * @return bool false if path couldn't be written
+ */
+bool writeFoldedStacks(const char *path) {
+  stopProfiler();
+  FILE *out = fopen(path, "w");
+  if (out == NULL)
+    return false;
+  StackCount *sorted =
+      malloc((profile.stackCount > 0 ? profile.stackCount : 1) *
+             sizeof(StackCount));
+  int count = 0;
+  for (int i = 0; i < profile.stackCapacity; i++) {
+    if (profile.stacks[i].key != NULL)
+      sorted[count++] = profile.stacks[i];
+  }
+  qsort(sorted, count, sizeof(StackCount), compareStacks);
+  for (int i = 0; i < count; i++) {
+    fprintf(out, "%s %llu\n", sorted[i].key,
+            (unsigned long long)sorted[i].count);
+  }
+  free(sorted);
+  return fclose(out) == 0;
+}
+
+void freeProfile() {
+  stopProfiler();
+  for (int i = 0; i < profile.stackCapacity; i++) {
+    free(profile.stacks[i].key);
+  }
+  free(profile.stacks);
+  free(profile.key);
+  free(profile.ring);
+  free(profile.functions);
+  free(profile.names);
+  free(profile.self);
+  free(profile.total);
+  free(profile.seen);
+  memset(&profile, 0, sizeof(profile));
+}
@@ -0,0 +1,502 @@
+// Register form of a function: rewrites the stack code the compiler emitted
+// into three address instructions that name their operands by frame slot, so
+// run_reg() doesn't have to push and pop a temporary for every operand.
+//
+// Registers are simply the stack slots the stack code would have used, i.e
+// the value the stack code keeps at depth d of the frame lives in register d.
+// Locals already sit at fixed depths, so they are registers for free, and the
+// frame's layout (closure/receiver in 0, then the args) is the same in both
+// forms, which is what lets the two kinds of frames call into each other.
+
+#include <limits.h>
+
+#include "chunk.h"
+#include "debug.h"
+#include "memory.h"
+#include "object.h"
+#include "regcode.h"
+
+/**
+ * What the translator knows about the value the stack code keeps at a depth.
+ * Operands get read straight from where they already are instead of being
+ * copied to the top first, so a slot only gets written (materialized) when
+ * something needs the value to actually be in that register
+ *  ENTRY_REG   -> it's in its own register
+ *  ENTRY_LOCAL -> it's a copy of register operand (OP_GET_LOCAL)
+ *  ENTRY_CONST -> it's constants[operand] (OP_CONSTANT)
+ */
+typedef enum {
+  ENTRY_REG,
+  ENTRY_LOCAL,
+  ENTRY_CONST,
+} StackEntryKind;
+
+typedef struct {
+  StackEntryKind kind;
+  uint8_t operand;
+} StackEntry;
+
+typedef struct {
+  Chunk *chunk; // the stack code
+  Chunk out;    // the register code
+  StackEntry entries[UINT8_COUNT];
+  int depth;    // no. of values the stack code has in the frame right now
+  int maxDepth; // and the most it ever has, i.e the no. of registers
+  int line;     // line of the stack instruction being translated
+  int lastDst;  // offset of the destination operand of the last instruction
+                // emitted, if it wrote the top of the stack, else -1
+  bool failed;
+} Translator;
+
+static void patchShort(uint8_t *code, int offset, int value) {
+  code[offset] = (value >> 8) & 0xff;
+  code[offset + 1] = value & 0xff;
+}
+
+/**
+ * Where the stack jump at offset lands, -1 if it isn't a jump. Only the plain
+ * jumps, the chunk's still peephole free when it gets translated
+ */
+static int stackJumpTarget(uint8_t *code, int offset) {
+  switch (code[offset]) {
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+    return jumpTarget(code, offset);
+  default:
+    return -1;
+  }
+}
+
+static void emit(Translator *t, uint8_t byte) {
+  writeChunk(&t->out, byte, t->line);
+}
+
+/**
+ * Emits a one register instruction, every emit*() forgets lastDst, the ones
+ * that leave a result on the top set it again
+ */
+static void emitR(Translator *t, uint8_t op, uint8_t a) {
+  emit(t, op);
+  emit(t, a);
+  t->lastDst = -1;
+}
+
+static void emitRR(Translator *t, uint8_t op, uint8_t a, uint8_t b) {
+  emitR(t, op, a);
+  emit(t, b);
+}
+
+static void emitRRR(Translator *t, uint8_t op, uint8_t a, uint8_t b,
+                    uint8_t c) {
+  emitRR(t, op, a, b);
+  emit(t, c);
+}
+
+static void emitRShort(Translator *t, uint8_t op, uint8_t a, uint16_t b) {
+  emitR(t, op, a);
+  emit(t, (b >> 8) & 0xff);
+  emit(t, b & 0xff);
+}
+
+/**
+ * Marks the instruction that was just emitted as the one that computed the
+ * top of the stack, its first operand being the destination
+ */
+static void resultOnTop(Translator *t, int start) { t->lastDst = start + 1; }
+
+/**
+ * Makes sure the value at depth slot is really in register slot
+ */
+static void materialize(Translator *t, int slot) {
+  StackEntry *entry = &t->entries[slot];
+  if (entry->kind == ENTRY_LOCAL) {
+    emitRR(t, OP_R_MOVE, slot, entry->operand);
+  } else if (entry->kind == ENTRY_CONST) {
+    emitRR(t, OP_R_LOADK, slot, entry->operand);
+  }
+  entry->kind = ENTRY_REG;
+}
+
+static void materializeAll(Translator *t) {
+  for (int slot = 0; slot < t->depth; slot++) {
+    materialize(t, slot);
+  }
+}
+
+/**
+ * Register slot's about to be overwritten, so everything still pretending to
+ * be a copy of it needs its own copy now. OP_GET_LOCAL can only copy a slot
+ * below the top, so those can only sit above slot
+ */
+static void materializeCopiesOf(Translator *t, int slot) {
+  for (int i = slot + 1; i < t->depth; i++) {
+    if (t->entries[i].kind == ENTRY_LOCAL && t->entries[i].operand == slot) {
+      materialize(t, i);
+    }
+  }
+}
+
+/**
+ * The register to read the value at depth slot from
+ */
+static uint8_t source(Translator *t, int slot) {
+  if (t->entries[slot].kind == ENTRY_LOCAL)
+    return t->entries[slot].operand;
+  materialize(t, slot);
+  return (uint8_t)slot;
+}
+
+static void pushEntry(Translator *t, StackEntryKind kind, uint8_t operand) {
+  if (t->depth == UINT8_COUNT) {
+    t->failed = true; // more temporaries than a byte can name
+    return;
+  }
+  t->entries[t->depth].kind = kind;
+  t->entries[t->depth].operand = operand;
+  t->depth++;
+  if (t->depth > t->maxDepth)
+    t->maxDepth = t->depth;
+}
+
+/**
+ * a op b, for the two values on top. A constant right operand is read from
+ * the constant table by the _K form (opcode + 1)
+ */
+static void binary(Translator *t, OpCode op) {
+  int a = t->depth - 2;
+  int b = t->depth - 1;
+  uint8_t left = source(t, a);
+  int start = t->out.count;
+  if (t->entries[b].kind == ENTRY_CONST) {
+    emitRRR(t, op + 1, a, left, t->entries[b].operand);
+  } else {
+    uint8_t right = source(t, b);
+    start = t->out.count;
+    emitRRR(t, op, a, left, right);
+  }
+  resultOnTop(t, start);
+  t->depth--;
+  t->entries[a].kind = ENTRY_REG;
+}
+
+static void unary(Translator *t, OpCode op) {
+  int a = t->depth - 1;
+  uint8_t operand = source(t, a);
+  int start = t->out.count;
+  emitRR(t, op, a, operand);
+  resultOnTop(t, start);
+  t->entries[a].kind = ENTRY_REG;
+}
+
+/**
+ * OP_SET_LOCAL slot: if whatever's on top was only just computed into its
+ * register, that instruction's simply told to put it in slot instead
+ */
+static void setLocal(Translator *t, uint8_t slot) {
+  int top = t->depth - 1;
+  materializeCopiesOf(t, slot);
+  StackEntry *entry = &t->entries[top];
+  if (entry->kind == ENTRY_REG && t->lastDst != -1 &&
+      t->out.code[t->lastDst] == top) {
+    t->out.code[t->lastDst] = slot;
+    t->lastDst = -1;
+    entry->kind = ENTRY_LOCAL;
+    entry->operand = slot;
+  } else if (entry->kind == ENTRY_CONST) {
+    emitRR(t, OP_R_LOADK, slot, entry->operand);
+  } else {
+    emitRR(t, OP_R_MOVE, slot, source(t, top));
+  }
+  t->entries[slot].kind = ENTRY_REG;
+}
+
+/**
+ * Translates chunk (stack code of a function taking arity args) in place into
+ * register code. Only the core of the language is covered (no classes or
+ * properties, and no more than 256 constants), anything else keeps its stack
+ * code and runs in run() as usual.
+ *
+ * Every jump target starts with all of the frame in registers (everything's
+ * materialized before a jump and before a label), so the only thing carried
+ * over a jump is the depth, which a forward jump records for its target. Calls
+ * materialize everything too, since the callee can change a local through an
+ * upvalue behind our back.
+ *
+ * @return bool false if it gave up, chunk's untouched in that case
+ */
+bool translateChunk(Chunk *chunk, int arity) {
+  int count = chunk->count;
+  for (int offset = 0; offset < count;
+       offset += instructionLength(chunk, offset)) {
+    switch (chunk->code[offset]) {
+    case OP_CONSTANT_LONG:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_INVOKE:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_INHERIT:
+    case OP_GET_SUPER:
+    case OP_SUPER_INVOKE:
+      return false;
+    default:
+      break;
+    }
+  }
+
+  Translator t;
+  t.chunk = chunk;
+  initChunk(&t.out);
+  t.depth = arity + 1; // the closure (or receiver) and the args
+  t.maxDepth = t.depth;
+  t.lastDst = -1;
+  t.failed = false;
+  for (int slot = 0; slot < t.depth; slot++) {
+    t.entries[slot].kind = ENTRY_REG;
+  }
+
+  int *targetDepth = ALLOCATE(int, count + 1); // -1 if not a jump target,
+                                               // INT_MAX if only a loop's
+  int *newOffset = ALLOCATE(int, count + 1);
+  int *jumpFrom = ALLOCATE(int, count);
+  int *jumpTo = ALLOCATE(int, count);
+  int jumpCount = 0;
+
+  for (int offset = 0; offset <= count; offset++) {
+    targetDepth[offset] = -1;
+    newOffset[offset] = -1;
+  }
+  for (int offset = 0; offset < count;
+       offset += instructionLength(chunk, offset)) {
+    int target = stackJumpTarget(chunk->code, offset);
+    if (target != -1)
+      targetDepth[target] = INT_MAX;
+  }
+
+  uint8_t *code = chunk->code;
+  for (int offset = 0; offset < count && !t.failed;) {
+    t.line = getAt(chunk, offset);
+    if (targetDepth[offset] != -1) {
+      materializeAll(&t);
+      t.lastDst = -1;
+      if (targetDepth[offset] != INT_MAX) {
+        // right after an unconditional jump the depth we've been tracking
+        // belongs to a path that never gets here
+        t.depth = targetDepth[offset];
+        for (int slot = 0; slot < t.depth; slot++) {
+          t.entries[slot].kind = ENTRY_REG;
+        }
+      }
+    }
+    newOffset[offset] = t.out.count;
+
+    uint8_t instruction = code[offset];
+    int top = t.depth - 1;
+    int start = t.out.count;
+    switch (instruction) {
+    case OP_CONSTANT:
+      pushEntry(&t, ENTRY_CONST, code[offset + 1]);
+      break;
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      emitR(&t,
+            instruction == OP_NIL    ? OP_R_NIL
+            : instruction == OP_TRUE ? OP_R_TRUE
+                                     : OP_R_FALSE,
+            t.depth);
+      pushEntry(&t, ENTRY_REG, 0);
+      resultOnTop(&t, start);
+      break;
+    case OP_POP:
+      t.depth--;
+      t.lastDst = -1;
+      break;
+    case OP_GET_LOCAL: {
+      uint8_t slot = code[offset + 1];
+      materialize(&t, slot);
+      pushEntry(&t, ENTRY_LOCAL, slot);
+      break;
+    }
+    case OP_SET_LOCAL:
+      setLocal(&t, code[offset + 1]);
+      break;
+    case OP_GET_GLOBAL:
+      emitRShort(&t, OP_R_GET_GLOBAL, t.depth, readShort(code, offset + 1));
+      pushEntry(&t, ENTRY_REG, 0);
+      resultOnTop(&t, start);
+      break;
+    case OP_DEFINE_GLOBAL:
+      emitRShort(&t, OP_R_DEFINE_GLOBAL, source(&t, top),
+                 readShort(code, offset + 1));
+      t.depth--;
+      break;
+    case OP_SET_GLOBAL:
+      emitRShort(&t, OP_R_SET_GLOBAL, source(&t, top),
+                 readShort(code, offset + 1));
+      break;
+    case OP_GET_UPVALUE:
+      emitRR(&t, OP_R_GET_UPVALUE, t.depth, code[offset + 1]);
+      pushEntry(&t, ENTRY_REG, 0);
+      resultOnTop(&t, start);
+      break;
+    case OP_SET_UPVALUE:
+      emitRR(&t, OP_R_SET_UPVALUE, source(&t, top), code[offset + 1]);
+      break;
+    case OP_EQUAL:
+      binary(&t, OP_R_EQUAL);
+      break;
+    case OP_GREATER:
+      binary(&t, OP_R_GREATER);
+      break;
+    case OP_LESS:
+      binary(&t, OP_R_LESS);
+      break;
+    case OP_ADD:
+      binary(&t, OP_R_ADD);
+      break;
+    case OP_SUBTRACT:
+      binary(&t, OP_R_SUBTRACT);
+      break;
+    case OP_MULTIPLY:
+      binary(&t, OP_R_MULTIPLY);
+      break;
+    case OP_DIVIDE:
+      binary(&t, OP_R_DIVIDE);
+      break;
+    case OP_NOT:
+      unary(&t, OP_R_NOT);
+      break;
+    case OP_NEGATE:
+      unary(&t, OP_R_NEGATE);
+      break;
+    case OP_PRINT:
+      emitR(&t, OP_R_PRINT, source(&t, top));
+      t.depth--;
+      break;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP: {
+      int target = jumpTarget(code, offset);
+      materializeAll(&t);
+      jumpFrom[jumpCount] = t.out.count;
+      jumpTo[jumpCount++] = target;
+      if (instruction == OP_JUMP_IF_FALSE) {
+        emitRShort(&t, OP_R_JUMP_IF_FALSE, top, 0xffff); // patched below
+      } else {
+        emit(&t, instruction == OP_JUMP ? OP_R_JUMP : OP_R_LOOP);
+        emit(&t, 0xff);
+        emit(&t, 0xff);
+        t.lastDst = -1;
+      }
+      if (target > offset) {
+        targetDepth[target] = t.depth;
+      }
+      break;
+    }
+    case OP_CALL:
+    case OP_CALL_0:
+    case OP_CALL_1:
+    case OP_CALL_2:
+    case OP_CALL_3: {
+      uint8_t argCount = instruction == OP_CALL ? code[offset + 1]
+                                                : instruction - OP_CALL_0;
+      int base = t.depth - 1 - argCount;
+      materializeAll(&t);
+      emitRR(&t, OP_R_CALL, base, argCount);
+      t.depth = base + 1; // the result replaces the callee
+      break;
+    }
+    case OP_CLOSURE: {
+      uint8_t constant = code[offset + 1];
+      ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+      for (int i = 0; i < function->upvalueCount; i++) {
+        if (code[offset + 2 + 2 * i])
+          materialize(&t, code[offset + 3 + 2 * i]); // captured in place
+      }
+      emitRR(&t, OP_R_CLOSURE, t.depth, constant);
+      for (int i = 0; i < 2 * function->upvalueCount; i++) {
+        emit(&t, code[offset + 2 + i]);
+      }
+      pushEntry(&t, ENTRY_REG, 0);
+      break;
+    }
+    case OP_CLOSE_UPVALUE:
+      materialize(&t, top);
+      emitR(&t, OP_R_CLOSE_UPVALUE, top);
+      t.depth--;
+      break;
+    case OP_RETURN:
+      emitR(&t, OP_R_RETURN, source(&t, top));
+      t.depth--; // the code that follows (if any) never runs
+      break;
+    case OP_RETURN_NIL:
+      emitR(&t, OP_R_NIL, t.depth);
+      pushEntry(&t, ENTRY_REG, 0);
+      emitR(&t, OP_R_RETURN, t.depth - 1);
+      t.depth--;
+      break;
+    case OP_RETURN_LOCAL: {
+      uint8_t slot = code[offset + 1];
+      materialize(&t, slot);
+      emitR(&t, OP_R_RETURN, slot);
+      break;
+    }
+    default:
+      t.failed = true; // anything the pre-scan didn't already turn down
+      break;
+    }
+    if (t.depth < 1) {
+      t.failed = true;
+    }
+    offset += instructionLength(chunk, offset);
+  }
+  newOffset[count] = t.out.count;
+
+  for (int i = 0; i < jumpCount && !t.failed; i++) {
+    int from = jumpFrom[i];
+    int to = newOffset[jumpTo[i]];
+    int distance;
+    switch (t.out.code[from]) {
+    case OP_R_JUMP:
+      distance = to - (from + 3);
+      patchShort(t.out.code, from + 1, distance);
+      break;
+    case OP_R_LOOP:
+      distance = (from + 3) - to;
+      patchShort(t.out.code, from + 1, distance);
+      break;
+    default: // OP_R_JUMP_IF_FALSE
+      distance = to - (from + 4);
+      patchShort(t.out.code, from + 2, distance);
+      break;
+    }
+    if (to == -1 || distance < 0 || distance > UINT16_MAX) {
+      t.failed = true;
+    }
+  }
+
+  FREE_ARRAY(int, targetDepth, count + 1);
+  FREE_ARRAY(int, newOffset, count + 1);
+  FREE_ARRAY(int, jumpFrom, count);
+  FREE_ARRAY(int, jumpTo, count);
+
+  if (t.failed) {
+    freeChunk(&t.out);
+    return false;
+  }
+
+  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(int, chunk->lines, chunk->LineCapacity);
+  FREE_ARRAY(int, chunk->new_lines, chunk->LineCapacity);
+  chunk->code = t.out.code;
+  chunk->count = t.out.count;
+  chunk->capacity = t.out.capacity;
+  chunk->lines = t.out.lines;
+  chunk->new_lines = t.out.new_lines;
+  chunk->LineIndex = t.out.LineIndex;
+  chunk->LineCapacity = t.out.LineCapacity;
+  chunk->maxRegisters = t.maxDepth;
+  return true;
+}
@@ -38,6 +38,19 @@ void freeValueArray(ValueArray* array){
 }
 
 void printValue(Value value){
+#ifdef NAN_BOXING
+    if(IS_BOOL(value)){
+        printf(AS_BOOL(value) ? "true" : "false");
+    }else if(IS_NIL(value)){
+        printf("nil");
+    }else if(IS_NUMBER(value)){
+        printf("%g", AS_NUMBER(value));
+    }else if(IS_OBJ(value)){
+        printObject(value);
+    }else if(IS_EMPTY(value)){
+        printf("<empty>");
+    }
+#else
     switch (value.type){
         case VAL_BOOL:
             printf(AS_BOOL(value) ? "true" : "false");
@@ -45,10 +58,19 @@ void printValue(Value value){
         case VAL_NIL: printf("nil"); break;
         case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
         case VAL_OBJ: printObject(value); break;
+        case VAL_EMPTY: printf("<empty>"); break;
     }
+#endif
 }
 
 bool valuesEqual(Value a, Value b){
+#ifdef NAN_BOXING
+    //compared as doubles so NaN still isn't equal to itself
+    if(IS_NUMBER(a) && IS_NUMBER(b)){
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    return a == b;
+#else
     if(a.type != b.type) return false;
     switch(a.type){
         case VAL_BOOL:  return AS_BOOL(a) == AS_BOOL(b);
@@ -57,4 +79,5 @@ bool valuesEqual(Value a, Value b){
         case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
         default:        return false; 
     }
+#endif
 }
@@ -23,7 +23,9 @@ For expression that's +1
 
 */
 
+#include <assert.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,11 +36,17 @@ For expression that's +1
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
+#include "loxrt.h"
 #include "memory.h"
 #include "object.h"
+#include "opstats.h"
 #include "vm.h"
 
 VM vm;
+#ifdef DEBUG_COUNT_DISPATCH
+static uint64_t dispatchCount; // instructions run() and run_reg() dispatched
+#endif
 
 static Value clockNative(int argCount, Value *args) {
   return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
@@ -51,13 +59,37 @@ struct timespec start, end;
  * @return void
  */
 static void resetStack() {
-  vm.stack = malloc(INIT_STACK * sizeof(Value));
-  vm.stack_size = INIT_STACK;
   vm.stack_count = 0;
   vm.frameCount = 0;
   vm.openUpvalues = 0;
 }
 
+#define TRACE_FRAMES 10 // innermost and outermost frames a trace shows
+
+static void printFrame(CallFrame *frame) {
+  ObjFunction *function = frame->closure->function;
+  if (function->compiled != NULL) {
+    fprintf(stderr, "[compiled] in "); // no bytecode left to get a line from
+  } else {
+    Chunk *chunk = &function->chunk;
+    long instruction = (long)(frame->ip - chunk->code) - 1;
+    if (instruction < 0 || instruction >= chunk->count)
+      instruction = 0;
+    fprintf(stderr, "[line %d] in ",
+            chunk->LineIndex > 0 ? getAt(chunk, (int)instruction) : 0);
+  }
+  if (function->name == NULL) {
+    fprintf(stderr, "script\n");
+  } else {
+    fprintf(stderr, "%s()\n", function->name->chars);
+  }
+}
+
+/**
+ * Reports the error with a trace of the frames, innermost first. A deep one
+ * (a "Stack Overflow." has FRAMES_MAX of them) only shows TRACE_FRAMES at
+ * each end
+ */
 static void runtimeError(const char *format, ...) {
   va_list args;
   va_start(args, format);
@@ -66,28 +98,49 @@ static void runtimeError(const char *format, ...) {
   fputs("\n", stderr);
 
   for (int i = vm.frameCount - 1; i >= 0; i--) {
-    CallFrame *frame = &vm.frames[i];
-    ObjFunction *function = frame->closure->function;
-    size_t instruction = frame->ip - function->chunk.code - 1;
-    fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
-    if (function->name == NULL) {
-      fprintf(stderr, "script\n");
-    } else {
-      fprintf(stderr, "%s()\n", function->name->chars);
+    if (i == vm.frameCount - 1 - TRACE_FRAMES && i >= TRACE_FRAMES) {
+      fprintf(stderr, "... %d more frames ...\n", i + 1 - TRACE_FRAMES);
+      i = TRACE_FRAMES - 1;
     }
+    printFrame(&vm.frames[i]);
   }
   resetStack();
 }
 
+/**
+ * Gives back the slot of the global variable name in vm.globalValues, handing
+ * out a new one (EMPTY_VAL until the variable gets defined) the first time a
+ * name is seen. Both the compiler and defineNative() go through here, so one
+ * name always means one slot, across REPL lines too.
+ */
+int globalSlot(ObjString *name) {
+  Value slot;
+  if (tableGet(&vm.globalSlots, name, &slot)) {
+    return (int)AS_NUMBER(slot);
+  }
+  push(OBJ_VAL(name)); // growing the arrays and the table can run the GC
+  int index = vm.globalValues.count;
+  writeValueArray(&vm.globalValues, EMPTY_VAL);
+  writeValueArray(&vm.globalNames, OBJ_VAL(name));
+  tableSet(&vm.globalSlots, name, NUMBER_VAL(index));
+  pop();
+  return index;
+}
+
 static void defineNative(const char *name, NativeFn function) {
   push(OBJ_VAL(copyString(name, (int)strlen(name))));
   push(OBJ_VAL(newNative(function)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  int slot = globalSlot(AS_STRING(vm.stack[0]));
+  vm.globalValues.values[slot] = vm.stack[1];
   pop();
   pop();
 }
 
 void initVM() {
+  vm.stack = malloc(INIT_STACK * sizeof(Value));
+  vm.stack_size = INIT_STACK;
+  vm.frames = malloc(INIT_FRAMES * sizeof(CallFrame));
+  vm.frameCapacity = INIT_FRAMES;
   resetStack();
   vm.objects = NULL; // no obj allocated for first initialization
   vm.bytesAllocated = 0;
@@ -95,8 +148,28 @@ void initVM() {
   vm.grayCapacity = 0;
   vm.grayCount = 0;
   vm.grayStack = NULL;
+  vm.gcMode = GC_GENERATIONAL;
+  vm.youngObjects = NULL;
+  vm.nurserySize = GC_NURSERY;
+  vm.oldBytes = 0;
+  vm.nextMajorGC = vm.nextGC;
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
+  vm.remembered = NULL;
+  vm.gcPhase = GC_PHASE_IDLE;
+  vm.gcBudget = GC_BUDGET;
+  vm.sweeping = NULL;
+  vm.stringCursor = 0;
+  vm.stringCapacity = 0;
+  vm.gcThreads = 1;
 
-  initTable(&vm.globals);
+  initValueArray(&vm.globalValues);
+  initValueArray(&vm.globalNames);
+  initTable(&vm.globalSlots);
+  vm.registerMode = false;
+  vm.jitEnabled = true;
+  vm.jitThreshold = JIT_THRESHOLD;
+  vm.opStats = false;
   initTable(&vm.strings);
   vm.initString = NULL;
 
@@ -106,19 +179,36 @@ void initVM() {
 }
 
 void freeVM() {
-  freeTable(&vm.globals);
+  freeValueArray(&vm.globalValues);
+  freeValueArray(&vm.globalNames);
+  freeTable(&vm.globalSlots);
   freeTable(&vm.strings);
   freeObjects();
   free(vm.stack);
   vm.stack = NULL;
   vm.stack_size = 0;
   vm.stack_count = 0;
+  free(vm.frames);
+  vm.frames = NULL;
+  vm.frameCapacity = 0;
+  vm.frameCount = 0;
 }
 
+/**
+ * Grows (moves) the vm stack. Frames and the interpreters only keep offsets
+ * into it, or reload their pointers after anything that can grow it, but the
+ * open upvalues point right at the locals they capture, so those are moved
+ * along with it
+ */
 void resize_vm() {
   int oldCapacity = vm.stack_size;
+  Value *oldStack = vm.stack;
   vm.stack_size = GROW_CAPACITY(oldCapacity);
   vm.stack = GROW_ARRAY(Value, vm.stack, oldCapacity, vm.stack_size);
+  for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->location = vm.stack + (upvalue->location - oldStack);
+  }
 }
 
 void push(Value value) {
@@ -150,14 +240,47 @@ static bool call(ObjClosure *closure, int argCount) {
                  argCount);
     return false;
   }
-  if (vm.frameCount == FRAMES_MAX) {
-    runtimeError("Stack Overflow.");
-    return false;
+  if (vm.frameCount == vm.frameCapacity) {
+    if (vm.frameCapacity == FRAMES_MAX) {
+      runtimeError("Stack Overflow.");
+      return false;
+    }
+    // copied rather than realloc()ed, so vm.frames is a whole array at every
+    // point, the profiler's SIGPROF handler can walk it any time (see
+    // profile.c)
+    int oldCapacity = vm.frameCapacity;
+    int capacity = GROW_CAPACITY(oldCapacity);
+    CallFrame *frames = GROW_ARRAY(CallFrame, NULL, 0, capacity);
+    memcpy(frames, vm.frames, vm.frameCount * sizeof(CallFrame));
+    CallFrame *old = vm.frames;
+    vm.frames = frames;
+    vm.frameCapacity = capacity;
+    FREE_ARRAY(CallFrame, old, oldCapacity);
   }
-  CallFrame *frame = &vm.frames[vm.frameCount++];
+  // and a frame's filled in before it's counted, so it never sees one half
+  // made
+  CallFrame *frame = &vm.frames[vm.frameCount];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
   frame->slots = vm.stack_count - argCount - 1;
+  atomic_signal_fence(memory_order_release);
+  vm.frameCount++;
+
+  // room for the whole frame, once, so nothing that pushes inside it (run(),
+  // the JIT's machine code, compiled C) has to check for it
+  int registers = closure->function->chunk.maxRegisters;
+  int top = frame->slots + (registers > 0 ? registers : closure->function->maxStack);
+  while (vm.stack_size < top) {
+    resize_vm();
+  }
+  if (registers > 0) {
+    // a register frame owns all of its registers from the start, the stack top
+    // sits right above them for as long as it runs, so the GC sees them all
+    for (int i = vm.stack_count; i < top; i++) {
+      vm.stack[i] = NIL_VAL;
+    }
+    vm.stack_count = top;
+  }
   return true;
 }
 
@@ -173,9 +296,8 @@ static bool callValue(Value callee, int argCount) {
       ObjClass *klass = AS_CLASS(callee);
       vm.stack[vm.stack_count - argCount - 1] = OBJ_VAL(newInstance(klass));
 
-      Value initializer;
-      if (tableGet(&klass->methods, vm.initString, &initializer)) {
-        return call(AS_CLOSURE(initializer), argCount);
+      if (klass->initializer != NULL) {
+        return call(klass->initializer, argCount);
       } else if (argCount != 0) {
         runtimeError("Expected 0 arguments, got %d", argCount);
         return false;
@@ -188,8 +310,9 @@ static bool callValue(Value callee, int argCount) {
     case OBJ_NATIVE: {
       NativeFn native = AS_NATIVE(callee);
       Value result = native(argCount, vm.stack + vm.stack_count - argCount);
-      vm.stack_count -= argCount + 1;
-      push(result);
+      // the result takes the callee's slot
+      vm.stack_count -= argCount;
+      vm.stack[vm.stack_count - 1] = result;
       return true;
     }
     default:
@@ -201,36 +324,115 @@ static bool callValue(Value callee, int argCount) {
   return false;
 }
 
-static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount) {
+/**
+ * Remembers that at this site, instances with shape keep name at
+ * fields[slot] (moving on to transition if the field had to be added), or
+ * (slot = -1) get it from method. Does nothing for dictionary mode instances
+ * (no shape), if the site already knows this, or if it has no empty ways
+ * left, in which case it's megamorphic and stays on the slow path for any
+ * shape it hasn't seen
+ */
+static void fillCache(PropertyCache *cache, ObjShape *shape, int slot,
+                      ObjShape *transition, ObjClosure *method) {
+  if (shape == NULL)
+    return;
+  for (int i = 0; i < PROPERTY_CACHE_WAYS; i++) {
+    PropertyCacheEntry *entry = &cache->entries[i];
+    if (entry->shape == NULL) {
+      // the cache belongs to the function running in the top frame, it's
+      // the one that keeps these alive (see markCaches())
+      Obj *owner = &vm.frames[vm.frameCount - 1].closure->function->obj;
+      snapshotBarrier(owner);
+      entry->shape = shape;
+      entry->slot = slot;
+      entry->transition = transition;
+      entry->method = method;
+      writeBarrier(owner, OBJ_VAL(shape));
+      if (transition != NULL)
+        writeBarrier(owner, OBJ_VAL(transition));
+      if (method != NULL)
+        writeBarrier(owner, OBJ_VAL(method));
+      return;
+    }
+    if (entry->shape == shape && entry->slot == slot &&
+        entry->transition == transition && entry->method == method) {
+      return;
+    }
+  }
+}
+
+/**
+ * Calls klass's method name on the receiver sitting under the arguments. The
+ * callers have already checked the receiver has no field called name, so its
+ * shape is enough to guard the cached method
+ */
+static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount,
+                            PropertyCache *cache) {
   Value method;
   if (!tableGet(&klass->methods, name, &method)) {
     runtimeError("Undefined property '%s'.", name->chars);
     return false;
   }
+  if (cache != NULL) {
+    fillCache(cache, AS_INSTANCE(peek(argCount))->shape, -1, NULL,
+              AS_CLOSURE(method));
+  }
   return call(AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString *name, int argCount) {
+/**
+ * Slow path of OP_INVOKE. A field holding something callable wins over a
+ * method of the same name, so only real method calls get to fill the cache
+ */
+static bool invoke(ObjString *name, int argCount, PropertyCache *cache) {
   Value receiver = peek(argCount);
+  if (!IS_INSTANCE(receiver)) {
+    runtimeError("Only instances have methods.");
+    return false;
+  }
   ObjInstance *instance = AS_INSTANCE(receiver);
   Value value;
-  if (tableGet(&instance->fields, name, &value)) {
+  if (instanceGetField(instance, name, &value)) {
     vm.stack[vm.stack_count - argCount - 1] = value;
     return callValue(value, argCount);
   }
-  if (!IS_INSTANCE(receiver)) {
-    runtimeError("Only instances have methods.");
+  return invokeFromClass(instance->klass, name, argCount, cache);
+}
+
+/**
+ * Slow path of OP_SUPER_INVOKE, calls superclass's method name on this (under
+ * the arguments). Methods are copied down and a class's methods don't change
+ * once its declaration is done, so the superclass (its root shape) is all the
+ * cache needs to remember the method by. Each run of a class declaration
+ * makes a new class, which just takes another way of the cache
+ */
+static bool superInvoke(ObjClass *superclass, ObjString *name, int argCount,
+                        PropertyCache *cache) {
+  Value method;
+  if (!tableGet(&superclass->methods, name, &method)) {
+    runtimeError("Undefined property '%s'.", name->chars);
     return false;
   }
-  return invokeFromClass(instance->klass, name, argCount);
+  fillCache(cache, superclass->rootShape, -1, NULL, AS_CLOSURE(method));
+  return call(AS_CLOSURE(method), argCount);
 }
 
-static bool bindMethod(ObjClass *klass, ObjString *name) {
+/**
+ * Replaces the instance on top of the stack with its method name bound to it.
+ * Like invokeFromClass(), only called once the instance turned out to have no
+ * such field
+ */
+static bool bindMethod(ObjClass *klass, ObjString *name,
+                       PropertyCache *cache) {
   Value method;
   if (!tableGet(&klass->methods, name, &method)) {
     runtimeError("Undefined property '%s'.", name->chars);
     return false;
   }
+  if (cache != NULL) {
+    fillCache(cache, AS_INSTANCE(peek(0))->shape, -1, NULL,
+              AS_CLOSURE(method));
+  }
   ObjBoundMethod *bound = newBoundMethod(peek(0), AS_CLOSURE(method));
   pop();
   push(OBJ_VAL(bound));
@@ -266,16 +468,100 @@ static ObjUpvalue *captureUpvalue(Value *local) {
 static void closeUpvalues(Value *last) {
   while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
     ObjUpvalue *upvalue = vm.openUpvalues;
+    snapshotBarrier(&upvalue->obj);
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
+    writeBarrier(&upvalue->obj, upvalue->closed);
     vm.openUpvalues = upvalue->next;
   }
 }
 
+/**
+ * OP_TAIL_CALL, with the callee and its arguments on top of the stack. Nothing
+ * is left to do in the top frame once the callee returns, so a closure (bound
+ * method, initializer) takes the frame over: the frame's locals are dropped,
+ * the callee and its arguments slide down to where they were and the frame
+ * starts running the callee. Recursion in tail position then runs in one frame
+ * instead of piling up frames. Anything else is called just like OP_CALL,
+ * its result left for the OP_RETURN that follows.
+ *
+ * @param reused set to whether the top frame now runs the callee
+ *
+ * @return bool false after a runtime error
+ */
+static bool tailCall(int argCount, bool *reused) {
+  Value callee = peek(argCount);
+  int base = vm.stack_count - argCount - 1;
+  ObjClosure *closure = NULL;
+  *reused = false;
+  if (IS_CLOSURE(callee)) {
+    closure = AS_CLOSURE(callee);
+  } else if (IS_BOUND_METHOD(callee)) {
+    ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
+    vm.stack[base] = bound->receiver;
+    closure = bound->method;
+  } else if (IS_CLASS(callee)) {
+    ObjClass *klass = AS_CLASS(callee);
+    if (klass->initializer != NULL) {
+      vm.stack[base] = OBJ_VAL(newInstance(klass));
+      closure = klass->initializer;
+    }
+  }
+  if (closure == NULL) {
+    return callValue(callee, argCount);
+  }
+
+  // checked before the frame goes, so the error still shows where it was
+  if (argCount != closure->function->arity) {
+    runtimeError("Expected %d arguments but got %d.", closure->function->arity,
+                 argCount);
+    return false;
+  }
+  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  closeUpvalues(vm.stack + frame->slots);
+  memmove(vm.stack + frame->slots, vm.stack + base,
+          (argCount + 1) * sizeof(Value));
+  vm.stack_count = frame->slots + argCount + 1;
+  vm.frameCount--;
+  *reused = true;
+  return call(closure, argCount);
+}
+
+/**
+ * OP_INHERIT, with the superclass under the subclass on top of the stack.
+ * Every method of the superclass is copied down into the subclass before the
+ * subclass's own ones get defined (and override them), so looking a method up
+ * is always one table lookup, however deep the hierarchy. Pops the subclass
+ *
+ * @return bool false after a runtime error
+ */
+static bool inherit() {
+  Value superclass = peek(1);
+  if (!IS_CLASS(superclass)) {
+    runtimeError("Superclass must be a class.");
+    return false;
+  }
+  ObjClass *subclass = AS_CLASS(peek(0));
+  snapshotBarrier(&subclass->obj);
+  tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+  subclass->initializer = AS_CLASS(superclass)->initializer;
+  rememberObject(&subclass->obj);
+  // its instances start out with at least the superclass's fields, as a rule
+  subclass->fieldHint = AS_CLASS(superclass)->fieldHint;
+  pop();
+  return true;
+}
+
 static void defineMethod(ObjString *name) {
   Value method = peek(0);
   ObjClass *klass = AS_CLASS(peek(1));
+  snapshotBarrier(&klass->obj);
   tableSet(&klass->methods, name, method);
+  if (name == vm.initString) {
+    klass->initializer = AS_CLOSURE(method); // what calling the class runs
+  }
+  writeBarrier(&klass->obj, OBJ_VAL(name));
+  writeBarrier(&klass->obj, method);
   pop();
 }
 /**
@@ -289,6 +575,22 @@ static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+/**
+ * a + b as a new string. Both have to be reachable by the GC (on the stack, in
+ * a register or in a constant table) since the result's allocation can run it
+ *
+ * @return ObjString*
+ */
+static ObjString *joinStrings(ObjString *a, ObjString *b) {
+  int length = a->length + b->length;
+  char *chars = ALLOCATE(char, length + 1);
+  memcpy(chars, a->chars, a->length);
+  memcpy(chars + a->length, b->chars, b->length);
+  chars[length] = '\0';
+
+  return takeString(chars, length);
+}
+
 /**
  * concatenates any two strings that's in the stack consecutively and pushing
  * the final result to stack
@@ -303,18 +605,20 @@ static void concatenate() {
   // later when we truely don't need them!!
   ObjString *a = AS_STRING(peek(1));
 
-  int length = a->length + b->length;
-  char *chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
-
-  ObjString *result = takeString(chars, length);
+  ObjString *result = joinStrings(a, b);
   pop();
   pop();
   push(OBJ_VAL(result));
 }
 
+/**
+ * Whether the frame runs register code, i.e has to be run by run_reg()
+ * instead of run()
+ */
+static inline bool isRegisterFrame(CallFrame *frame) {
+  return frame->closure->function->chunk.maxRegisters > 0;
+}
+
 /**
  * The core of the Bytecode VM.
  *
@@ -324,24 +628,61 @@ static void concatenate() {
  * itself since it's so big
  */
 static InterpretResult run() {
-  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  /**
+   * The hot state of the loop lives in locals, so the C compiler can keep it
+   * in registers instead of going through vm.frames / vm.stack_count on every
+   * single instruction:
+   *  ip         -> the frame's instruction pointer
+   *  sp         -> one past the top of the vm stack (vm.stack + stack_count)
+   *  slots      -> the current frame's slot 0 on the vm stack
+   *  constants  -> the current closure's constant table
+ *  caches     -> the current closure's inline caches
+   *
+   * They are only written back to the CallFrame and VM (STORE_FRAME) right
+   * before anything that looks at those, i.e calls, returns, anything that can
+   * allocate (and therefore run the GC) and runtime errors. Anything that can
+   * move or change the stack or the frame reloads them after (LOAD_FRAME).
+   */
+  CallFrame *frame;
+  uint8_t *ip;
+  Value *sp;
+  Value *slots;
+  Value *constants;
+  PropertyCache *caches;
+
+#define STORE_FRAME()                                                          \
+  do {                                                                         \
+    frame->ip = ip;                                                            \
+    vm.stack_count = (int)(sp - vm.stack);                                     \
+  } while (false)
+
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    frame = &vm.frames[vm.frameCount - 1];                                     \
+    ip = frame->ip;                                                            \
+    sp = vm.stack + vm.stack_count;                                            \
+    slots = vm.stack + frame->slots;                                           \
+    constants = frame->closure->function->chunk.constants.values;              \
+    caches = frame->closure->function->chunk.caches;                           \
+  } while (false)
+
+  LOAD_FRAME();
+
 /**
  * Reads the current vm.ip's value (a location in vm.chunk->code) and increment
  * it by one i.e making the pointer point to the next bytecode chunk
  */
-#define READ_BYTE() (*frame->ip++)
+#define READ_BYTE() (*ip++)
 
   /**
    * Yanks the next 2 bytes from the chunk and builds a 16 bit integer out of it
    */
-#define READ_SHORT()                                                           \
-  (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8 | frame->ip[-1])))
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8 | ip[-1])))
 /**
  * Reads the constants from vm.chunk->constant.values array that corresponds to
  * the index in bytecode chunk and returns the Value
  */
-#define READ_CONSTANT()                                                        \
-  (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_CONSTANT() (constants[READ_BYTE()])
   /**
    * Does the same as READ_CONSTANT(), just turns the corresponding value to
    * OP_STRING object
@@ -349,21 +690,161 @@ static InterpretResult run() {
 
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 /**
- * As long as the current and the next character were numbers, all arithmetic
- * except addition's performed in this macro
+ * Reads a property instruction's 2 byte cache operand and gives back the
+ * inline cache it points at
+ */
+#define READ_CACHE() (&caches[READ_SHORT()])
+
+/**
+ * push(), pop() and peek() on the cached stack top. call() already made room
+ * for the deepest the frame's stack gets (ObjFunction.maxStack), so PUSH is
+ * a plain store. Debug builds check that the compiler got that right
+ */
+#ifdef DEBUG_CHECK_STACK
+#define PUSH(value)                                                            \
+  do {                                                                         \
+    assert(sp < slots + frame->closure->function->maxStack);                   \
+    *sp++ = (value);                                                           \
+  } while (false)
+#else
+#define PUSH(value) (*sp++ = (value))
+#endif
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+
+/**
+ * Reports the error with the frame written back first, so runtimeError() can
+ * work out the line from every frame's ip
  */
-#define BINARY_OP(valueType, op)                                               \
+#define RUNTIME_ERROR(...)                                                     \
   do {                                                                         \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
-      runtimeError("Operands must be numbers.");                               \
+    STORE_FRAME();                                                             \
+    runtimeError(__VA_ARGS__);                                                 \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
+
+/**
+ * Calls and returns can leave a frame with register code on top, which only
+ * run_reg() can run, so run() hands it back to interpret() to switch over
+ * (everything's already been written back by then)
+ */
+#define SWITCH_IF_REGISTER_FRAME()                                             \
+  do {                                                                         \
+    if (isRegisterFrame(frame))                                                \
+      return INTERPRET_SWITCH;                                                 \
+  } while (false)
+
+/**
+ * Hands the frame over to its machine code (see jit.c), compiling it first
+ * once the function's been entered or looped vm.jitThreshold times. The
+ * machine code comes back at the first instruction it leaves to run(), with
+ * the frame written back, so run() just carries on from there. Done wherever
+ * run() (re)enters a frame or loops, which is where the machine code always
+ * gets back to
+ */
+#ifdef JIT_ENABLED
+#define ENTER_JIT()                                                            \
+  do {                                                                         \
+    ObjFunction *function = frame->closure->function;                          \
+    if (function->jit != NULL                                                  \
+            ? jitCanEnter(function, ip)                                        \
+            : (vm.jitEnabled && ++function->hotness == vm.jitThreshold &&      \
+               jitCompile(function) && jitCanEnter(function, ip))) {           \
+      STORE_FRAME();                                                           \
+      jitRun(frame);                                                           \
+      LOAD_FRAME();                                                            \
+    }                                                                          \
+  } while (false)
+#else
+#define ENTER_JIT()                                                            \
+  do {                                                                         \
+  } while (false)
+#endif
+
+/**
+ * OP_CALL and OP_CALL_n. A closure, by far the most common callee, goes
+ * straight to call() without callValue()'s switch over the object type
+ */
+#define CALL_VALUE(argCount)                                                   \
+  do {                                                                         \
+    Value callee = PEEK(argCount);                                             \
+    STORE_FRAME();                                                             \
+    if (!(IS_CLOSURE(callee) ? call(AS_CLOSURE(callee), (argCount))           \
+                             : callValue(callee, (argCount)))) {               \
       return INTERPRET_RUNTIME_ERROR;                                          \
     }                                                                          \
-    double b = AS_NUMBER(pop());                                               \
-    double a = AS_NUMBER(pop());                                               \
-    push(valueType(a op b));                                                   \
+    LOAD_FRAME();                                                              \
+    SWITCH_IF_REGISTER_FRAME();                                                \
+    ENTER_JIT();                                                               \
+    DISPATCH();                                                                \
+  } while (false)
+
+/**
+ * OP_RETURN and its specialized forms: pops the frame and leaves result in
+ * the caller's slot for the callee
+ */
+#define RETURN(result)                                                         \
+  do {                                                                         \
+    closeUpvalues(slots);                                                      \
+    vm.frameCount--;                                                           \
+    if (vm.frameCount == 0) {                                                  \
+      vm.stack_count = 0; /* pops the script closure in slot 0 */              \
+      return INTERPRET_OK;                                                     \
+    }                                                                          \
+    *slots = (result);                                                         \
+    vm.stack_count = (int)(slots - vm.stack) + 1;                              \
+    LOAD_FRAME();                                                              \
+    SWITCH_IF_REGISTER_FRAME();                                                \
+    ENTER_JIT();                                                               \
+    DISPATCH();                                                                \
+  } while (false)
+
+/**
+ * Quickening: the instruction that's executing rewrites its own opcode (the
+ * byte right behind ip) into a form specialized for the operand types it just
+ * saw, so next time around it goes straight to the fast version. A specialized
+ * form that gets operands it wasn't made for puts the generic opcode back and
+ * runs that instead, which does the full type checks and errors.
+ */
+#define QUICKEN(opcode) (ip[-1] = (opcode))
+#define DEOPTIMIZE(opcode)                                                     \
+  do {                                                                         \
+    ip[-1] = (opcode);                                                         \
+    ip--;                                                                      \
+    DISPATCH();                                                                \
+  } while (false)
+
+/**
+ * As long as the current and the next character were numbers, all arithmetic
+ * except addition's performed in this macro. The result goes straight into
+ * the left operand's slot, so no push is needed. Once it's seen numbers the
+ * instruction becomes quickOp
+ */
+#define BINARY_OP(valueType, op, quickOp)                                      \
+  do {                                                                         \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                          \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    QUICKEN(quickOp);                                                          \
+    double b = AS_NUMBER(POP());                                               \
+    double a = AS_NUMBER(PEEK(0));                                             \
+    PEEK(0) = valueType(a op b);                                               \
+  } while (false)
+
+/**
+ * BINARY_OP for the quickened number forms, the only check left is the one
+ * that sends it back to genericOp
+ */
+#define NUMBER_OP(valueType, op, genericOp)                                    \
+  do {                                                                         \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                          \
+      DEOPTIMIZE(genericOp);                                                   \
+    }                                                                          \
+    double b = AS_NUMBER(POP());                                               \
+    double a = AS_NUMBER(PEEK(0));                                             \
+    PEEK(0) = valueType(a op b);                                               \
   } while (false)
 
-  for (;;) {
 /**
  * When DEBUG_TRACE_EXECUTION flag is turned on, these lines are executed
  * Goes for each bytecode at a time. First it prints whatever's in the vm.stack
@@ -374,278 +855,1121 @@ static InterpretResult run() {
  * the offset i.e the position of the said bytecode from the starting position
  */
 #ifdef DEBUG_TRACE_EXECUTION
-    printf("    ");
-    for (Value *slot = vm.stack; slot < vm.stack + vm.stack_count; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassembleInstruction(
-        &frame->closure->function->chunk,
-        (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION()                                                    \
+  do {                                                                         \
+    printf("    ");                                                            \
+    for (Value *slot = vm.stack; slot < sp; slot++) {                          \
+      printf("[ ");                                                            \
+      printValue(*slot);                                                       \
+      printf(" ]");                                                            \
+    }                                                                          \
+    printf("\n");                                                              \
+    disassembleInstruction(                                                    \
+        &frame->closure->function->chunk,                                      \
+        (int)(ip - frame->closure->function->chunk.code));                     \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION()                                                    \
+  do {                                                                         \
+  } while (false)
+#endif
+
+/**
+ * With DEBUG_COUNT_DISPATCH every dispatch bumps dispatchCount, which
+ * interpret() reports once the script is done
+ */
+#ifdef DEBUG_COUNT_DISPATCH
+#define COUNT_DISPATCH() (dispatchCount++)
+#else
+#define COUNT_DISPATCH()                                                       \
+  do {                                                                         \
+  } while (false)
+#endif
+
+/**
+ * Dispatch comes in two flavours, picked at compile time (see common.h).
+ *
+ * With COMPUTED_GOTO every handler ends in its own copy of DISPATCH(), an
+ * indirect jump through dispatchTable, so the branch predictor gets one jump
+ * site per opcode and can learn which handler usually follows which.
+ *
+ * Without it we fall back to the plain portable switch, where every handler
+ * funnels back through the same single indirect jump at the top.
+ *
+ * With clox --opstats (vm.opStats) every instruction is counted first, see
+ * opstats.c. The goto flavour gets there by dispatching through countTable,
+ * whose every entry leads to op_COUNT, so when it's off nothing but which
+ * table dispatch points at tells the two apart
+ */
+#ifdef COMPUTED_GOTO
+  // any byte that's not a real opcode lands on op_UNKNOWN
+  static void *dispatchTable[UINT8_COUNT] = {
+      [0 ... UINT8_MAX] = &&op_UNKNOWN,
+      [OP_CONSTANT] = &&op_OP_CONSTANT,
+      [OP_NIL] = &&op_OP_NIL,
+      [OP_TRUE] = &&op_OP_TRUE,
+      [OP_FALSE] = &&op_OP_FALSE,
+      [OP_POP] = &&op_OP_POP,
+      [OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+      [OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+      [OP_GET_GLOBAL] = &&op_OP_GET_GLOBAL,
+      [OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+      [OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+      [OP_GET_UPVALUE] = &&op_OP_GET_UPVALUE,
+      [OP_SET_UPVALUE] = &&op_OP_SET_UPVALUE,
+      [OP_SET_PROPERTY] = &&op_OP_SET_PROPERTY,
+      [OP_GET_PROPERTY] = &&op_OP_GET_PROPERTY,
+      [OP_EQUAL] = &&op_OP_EQUAL,
+      [OP_GREATER] = &&op_OP_GREATER,
+      [OP_LESS] = &&op_OP_LESS,
+      [OP_ADD] = &&op_OP_ADD,
+      [OP_SUBTRACT] = &&op_OP_SUBTRACT,
+      [OP_MULTIPLY] = &&op_OP_MULTIPLY,
+      [OP_DIVIDE] = &&op_OP_DIVIDE,
+      [OP_NOT] = &&op_OP_NOT,
+      [OP_NEGATE] = &&op_OP_NEGATE,
+      [OP_PRINT] = &&op_OP_PRINT,
+      [OP_JUMP] = &&op_OP_JUMP,
+      [OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+      [OP_LOOP] = &&op_OP_LOOP,
+      [OP_CALL] = &&op_OP_CALL,
+      [OP_CALL_0] = &&op_OP_CALL_0,
+      [OP_CALL_1] = &&op_OP_CALL_1,
+      [OP_CALL_2] = &&op_OP_CALL_2,
+      [OP_CALL_3] = &&op_OP_CALL_3,
+      [OP_TAIL_CALL] = &&op_OP_TAIL_CALL,
+      [OP_INVOKE] = &&op_OP_INVOKE,
+      [OP_CLOSURE] = &&op_OP_CLOSURE,
+      [OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+      [OP_RETURN] = &&op_OP_RETURN,
+      [OP_RETURN_NIL] = &&op_OP_RETURN_NIL,
+      [OP_RETURN_LOCAL] = &&op_OP_RETURN_LOCAL,
+      [OP_CLASS] = &&op_OP_CLASS,
+      [OP_METHOD] = &&op_OP_METHOD,
+      [OP_INHERIT] = &&op_OP_INHERIT,
+      [OP_GET_SUPER] = &&op_OP_GET_SUPER,
+      [OP_SUPER_INVOKE] = &&op_OP_SUPER_INVOKE,
+      [OP_ADD_NUM] = &&op_OP_ADD_NUM,
+      [OP_ADD_STR] = &&op_OP_ADD_STR,
+      [OP_SUBTRACT_NUM] = &&op_OP_SUBTRACT_NUM,
+      [OP_MULTIPLY_NUM] = &&op_OP_MULTIPLY_NUM,
+      [OP_DIVIDE_NUM] = &&op_OP_DIVIDE_NUM,
+      [OP_GREATER_NUM] = &&op_OP_GREATER_NUM,
+      [OP_LESS_NUM] = &&op_OP_LESS_NUM,
+      [OP_ADD_LL] = &&op_OP_ADD_LL,
+      [OP_ADD_LC] = &&op_OP_ADD_LC,
+      [OP_LESS_LC_JIF] = &&op_OP_LESS_LC_JIF,
+      [OP_LESS_LL_JIF] = &&op_OP_LESS_LL_JIF,
+      [OP_SET_LOCAL_POP] = &&op_OP_SET_LOCAL_POP,
+      [OP_POPN] = &&op_OP_POPN,
+  };
+  static void *countTable[UINT8_COUNT] = {[0 ... UINT8_MAX] = &&op_COUNT};
+  void **dispatch = vm.opStats ? countTable : dispatchTable;
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(opcode) op_##opcode:
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    TRACE_INSTRUCTION();                                                       \
+    COUNT_DISPATCH();                                                          \
+    goto *dispatch[instruction = READ_BYTE()];                                 \
+  } while (false)
+#define UNKNOWN_OPCODE op_UNKNOWN:
+#else
+#define INTERPRET_LOOP                                                         \
+  dispatch:                                                                    \
+  TRACE_INSTRUCTION();                                                         \
+  COUNT_DISPATCH();                                                            \
+  instruction = READ_BYTE();                                                   \
+  if (vm.opStats)                                                              \
+    recordOp(frame->closure->function, instruction);                           \
+  switch (instruction)
+#define CASE(opcode) case opcode:
+#define DISPATCH() goto dispatch
+#define UNKNOWN_OPCODE default:
 #endif
-    /**
-     * Execution of bytecodes happens here, one at a time
-     */
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
+
+  /**
+   * Execution of bytecodes happens here, one at a time
+   */
+  uint8_t instruction;
+  INTERPRET_LOOP {
     // If the current bytecode is OP_CONSTANT, it looks to next bytecode which
     // is a ValueArray index. Then uses this index to look up the value in
     // ValueArray and push that value in the vm stack
-    case OP_CONSTANT: { // values pushed when we see constant
+    CASE(OP_CONSTANT) { // values pushed when we see constant
       Value constant = READ_CONSTANT();
-      push(constant);
-      printf("\n");
-      break;
+      PUSH(constant);
+      DISPATCH();
     }
     // For OP_NIL, pushes NIL_VAL, for OP_TRUE pushes Lox_type true and
     // corresponding false for OP_FALSE. For OP_POP, it simpley pops the last
     // value in the stack
-    case OP_NIL:
-      push(NIL_VAL);
-      break;
-    case OP_TRUE:
-      push(BOOL_VAL(true));
-      break;
-    case OP_FALSE:
-      push(BOOL_VAL(false));
-      break;
-    case OP_POP:
-      pop();
-      break;
+    CASE(OP_NIL) {
+      PUSH(NIL_VAL);
+      DISPATCH();
+    }
+    CASE(OP_TRUE) {
+      PUSH(BOOL_VAL(true));
+      DISPATCH();
+    }
+    CASE(OP_FALSE) {
+      PUSH(BOOL_VAL(false));
+      DISPATCH();
+    }
+    CASE(OP_POP) {
+      sp--;
+      DISPATCH();
+    }
     // here slot is the actual byte (a uint_8 just an integer), it is the index
     // which points where in the vm stack the value required is
-    case OP_GET_LOCAL: {
+    CASE(OP_GET_LOCAL) {
       uint8_t slot = READ_BYTE();
-      push(vm.stack[frame->slots + slot]);
-      break;
+      PUSH(slots[slot]);
+      DISPATCH();
     }
     // just like OP_GET_LOCAL, except that chenges the value in the vm stack
     // where the variable's value is to the latest value in the vm stack NOTE:
     // This is an exprStatement, so OP_POP is emitted right after so after
     // assignment the number used for assignment is poped i.e peek(0) is popped
     // right after
-    case OP_SET_LOCAL: {
+    CASE(OP_SET_LOCAL) {
       uint8_t slot = READ_BYTE();
-      vm.stack[frame->slots + slot] = peek(0);
-      break;
+      slots[slot] = PEEK(0);
+      DISPATCH();
     }
-    case OP_GET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      Value value;
-      if (!tableGet(&vm.globals, name, &value)) {
-        runtimeError("Undefined variable '%s'", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
+    // Globals are resolved to their slot in vm.globalValues by the compiler,
+    // so no hashing here. A slot still holding EMPTY_VAL is a global that's
+    // been named somewhere but not defined (yet).
+    CASE(OP_GET_GLOBAL) {
+      uint16_t slot = READ_SHORT();
+      Value value = vm.globalValues.values[slot];
+      if (IS_EMPTY(value)) {
+        RUNTIME_ERROR("Undefined variable '%s'",
+                      AS_CSTRING(vm.globalNames.values[slot]));
       }
-      push(value);
-      break;
+      PUSH(value);
+      DISPATCH();
     }
-    case OP_DEFINE_GLOBAL: {
-      ObjString *name = READ_STRING();
-      tableSet(&vm.globals, name, peek(0));
-      pop(); // does not pop until added to hash table just in case the garbage
-             // collector triggers in the middle of this process.
-      break;
+    CASE(OP_DEFINE_GLOBAL) {
+      uint16_t slot = READ_SHORT();
+      vm.globalValues.values[slot] = POP();
+      DISPATCH();
     }
-    case OP_SET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      if (tableSet(
-              &vm.globals, name,
-              peek(0))) { // if this is true that means we don't have that
-                          // specific variable in the table, so we return error.
-        tableDelete(
-            &vm.globals,
-            name); // Also when checking if value exist we created a ghost
-                   // value. We are deleting the same key for that reason.
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_SET_GLOBAL) {
+      uint16_t slot = READ_SHORT();
+      if (IS_EMPTY(vm.globalValues.values[slot])) {
+        RUNTIME_ERROR("Undefined variable '%s'.",
+                      AS_CSTRING(vm.globalNames.values[slot]));
       }
-      break;
+      vm.globalValues.values[slot] = PEEK(0);
+      DISPATCH();
     }
-    case OP_GET_UPVALUE: {
+    CASE(OP_GET_UPVALUE) {
       uint8_t slot = READ_BYTE();
-      push(*frame->closure->upvalues[slot]->location);
-      break;
+      PUSH(*frame->closure->upvalues[slot]->location);
+      DISPATCH();
     }
-    case OP_SET_UPVALUE: {
-      uint8_t slot = READ_BYTE();
-      printValue(peek(0));
-      *frame->closure->upvalues[slot]->location = peek(0);
-      break;
+    CASE(OP_SET_UPVALUE) {
+      ObjUpvalue *upvalue = frame->closure->upvalues[READ_BYTE()];
+      snapshotBarrier(&upvalue->obj);
+      *upvalue->location = PEEK(0);
+      writeBarrier(&upvalue->obj, PEEK(0));
+      DISPATCH();
     }
-    case OP_GET_PROPERTY: {
-      if (!IS_INSTANCE(peek(0))) {
-        runtimeError("Only instances have property.");
-        return INTERPRET_RUNTIME_ERROR;
+    // Both property instructions first try the site's inline cache. A way
+    // hits when the instance's shape is the one it remembers, which also
+    // means the field sits at the same index of instance->fields. Misses
+    // look the name up in the shape (or the dictionary) and teach the cache
+    // what they found.
+    CASE(OP_GET_PROPERTY) {
+      if (!IS_INSTANCE(PEEK(0))) {
+        RUNTIME_ERROR("Only instances have property.");
       }
-      ObjInstance *instance = AS_INSTANCE(peek(0));
+      ObjInstance *instance = AS_INSTANCE(PEEK(0));
       ObjString *name = READ_STRING();
+      PropertyCache *cache = READ_CACHE();
+      ObjShape *shape = instance->shape;
+
+      if (shape != NULL) {
+        for (int i = 0; i < PROPERTY_CACHE_WAYS; i++) {
+          PropertyCacheEntry *entry = &cache->entries[i];
+          if (entry->shape != shape)
+            continue;
+          if (entry->slot >= 0) {
+            PEEK(0) = instance->fields[entry->slot];
+            DISPATCH();
+          }
+          STORE_FRAME();
+          ObjBoundMethod *bound = newBoundMethod(PEEK(0), entry->method);
+          PEEK(0) = OBJ_VAL(bound);
+          DISPATCH();
+        }
 
-      Value value;
-      if (tableGet(&instance->fields, name, &value)) {
-        pop();
-        push(value);
-        break;
+        int slot = shapeFindSlot(shape, name);
+        if (slot != -1) {
+          fillCache(cache, shape, slot, NULL, NULL);
+          PEEK(0) = instance->fields[slot];
+          DISPATCH();
+        }
+      } else {
+        Value value;
+        if (tableGet(instance->dictionary, name, &value)) {
+          PEEK(0) = value;
+          DISPATCH();
+        }
       }
-      if (!bindMethod(instance->klass, name)) {
+      STORE_FRAME();
+      if (!bindMethod(instance->klass, name, cache)) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      break;
+      LOAD_FRAME();
+      DISPATCH();
     }
-    case OP_SET_PROPERTY: {
-      if (!IS_INSTANCE(peek(1))) {
-        runtimeError("Only instances have property.");
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_SET_PROPERTY) {
+      if (!IS_INSTANCE(PEEK(1))) {
+        RUNTIME_ERROR("Only instances have property.");
       }
-      ObjInstance *instance = AS_INSTANCE(peek(1));
-      tableSet(&instance->fields, READ_STRING(), peek(0));
-      Value value = pop();
-      pop();
-      push(value);
-      break;
+      ObjInstance *instance = AS_INSTANCE(PEEK(1));
+      ObjString *name = READ_STRING();
+      PropertyCache *cache = READ_CACHE();
+      ObjShape *shape = instance->shape;
+      Value value = POP();
+
+      if (shape != NULL) {
+        snapshotBarrier(&instance->obj);
+        for (int i = 0; i < PROPERTY_CACHE_WAYS; i++) {
+          PropertyCacheEntry *entry = &cache->entries[i];
+          if (entry->shape != shape)
+            continue;
+          if (entry->transition == NULL) {
+            instance->fields[entry->slot] = value;
+            writeBarrier(&instance->obj, value);
+            PEEK(0) = value;
+            DISPATCH();
+          }
+          if (entry->slot < instance->fieldCapacity) {
+            // adds the field, as long as there's room left for it
+            instance->fields[entry->slot] = value;
+            instance->shape = entry->transition;
+            writeBarrier(&instance->obj, value);
+            writeBarrier(&instance->obj, OBJ_VAL(entry->transition));
+            PEEK(0) = value;
+            DISPATCH();
+          }
+          break;
+        }
+      }
+
+      sp++; // keep the value on the stack while instanceSetField() can run
+            // the GC
+      STORE_FRAME();
+      instanceSetField(instance, name, value);
+      if (shape != NULL && instance->shape != NULL) {
+        fillCache(cache, shape, shapeFindSlot(instance->shape, name),
+                  instance->shape == shape ? NULL : instance->shape, NULL);
+      }
+      sp--;
+      PEEK(0) = value;
+      DISPATCH();
     }
-    case OP_EQUAL: {
-      Value b = pop();
-      Value a = pop();
-      push(BOOL_VAL(valuesEqual(a, b)));
-      break;
+    CASE(OP_EQUAL) {
+      Value b = POP();
+      Value a = PEEK(0);
+      PEEK(0) = BOOL_VAL(valuesEqual(a, b));
+      DISPATCH();
     }
-    case OP_GREATER:
-      BINARY_OP(BOOL_VAL, >);
-      break;
-    case OP_LESS:
-      BINARY_OP(BOOL_VAL, <);
-      break;
-    case OP_ADD: {
-      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+    CASE(OP_GREATER) {
+      BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM);
+      DISPATCH();
+    }
+    CASE(OP_LESS) {
+      BINARY_OP(BOOL_VAL, <, OP_LESS_NUM);
+      DISPATCH();
+    }
+    CASE(OP_ADD) {
+      if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+        QUICKEN(OP_ADD_STR);
+        STORE_FRAME();
         concatenate();
-      } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-        double b = AS_NUMBER(pop());
-        double a = AS_NUMBER(pop());
-        push(NUMBER_VAL(a + b));
+        LOAD_FRAME();
+      } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+        QUICKEN(OP_ADD_NUM);
+        double b = AS_NUMBER(POP());
+        double a = AS_NUMBER(PEEK(0));
+        PEEK(0) = NUMBER_VAL(a + b);
       } else {
-        runtimeError("Operands must be two numbers or two strings.");
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
       }
-      break;
+      DISPATCH();
     }
-    case OP_SUBTRACT:
-      BINARY_OP(NUMBER_VAL, -);
-      break;
-    case OP_MULTIPLY:
-      BINARY_OP(NUMBER_VAL, *);
-      break;
-    case OP_DIVIDE:
-      BINARY_OP(NUMBER_VAL, /);
-      break;
-    case OP_NOT:
-      push(BOOL_VAL(isFalsey(pop())));
-      break;
-    case OP_NEGATE: {
-      if (!IS_NUMBER(peek(0))) { // check is the value right about in the stack
-                                 // is a number...
-        runtimeError("Operant must be a number.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-
-      push(NUMBER_VAL(-AS_NUMBER(pop())));
-      break;
+    CASE(OP_SUBTRACT) {
+      BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM);
+      DISPATCH();
     }
-    case OP_PRINT: {
-      printValue(pop());
-      printf("\n");
-      break;
+    CASE(OP_MULTIPLY) {
+      BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM);
+      DISPATCH();
     }
-    // Note that if OP_JUMP_IF_FALSE increaes the vm.ip's count, it's directly
-    // set to be inside the else condition so it will skip this bytecode
-    case OP_JUMP: {
-      uint16_t offset = READ_SHORT();
-      frame->ip += offset;
-      break;
+    CASE(OP_DIVIDE) {
+      BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM);
+      DISPATCH();
     }
-    // Here this jump instruction does not automaticaly pops condition value, we
+    CASE(OP_ADD_NUM) {
+      NUMBER_OP(NUMBER_VAL, +, OP_ADD);
+      DISPATCH();
+    }
+    CASE(OP_ADD_STR) {
+      if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1))) {
+        DEOPTIMIZE(OP_ADD);
+      }
+      STORE_FRAME();
+      concatenate();
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE(OP_SUBTRACT_NUM) {
+      NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT);
+      DISPATCH();
+    }
+    CASE(OP_MULTIPLY_NUM) {
+      NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY);
+      DISPATCH();
+    }
+    CASE(OP_DIVIDE_NUM) {
+      NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE);
+      DISPATCH();
+    }
+    CASE(OP_GREATER_NUM) {
+      NUMBER_OP(BOOL_VAL, >, OP_GREATER);
+      DISPATCH();
+    }
+    CASE(OP_LESS_NUM) {
+      NUMBER_OP(BOOL_VAL, <, OP_LESS);
+      DISPATCH();
+    }
+    // Superinstructions from the peephole pass, each one does what the
+    // sequence it replaced did (see peephole.c), errors included
+    CASE(OP_ADD_LL) {
+      Value a = slots[READ_BYTE()];
+      Value b = slots[READ_BYTE()];
+      if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+        DISPATCH();
+      }
+      PUSH(a);
+      PUSH(b);
+      if (!IS_STRING(a) || !IS_STRING(b)) {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
+      }
+      STORE_FRAME();
+      concatenate();
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE(OP_ADD_LC) {
+      Value a = slots[READ_BYTE()];
+      Value b = READ_CONSTANT();
+      if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+        DISPATCH();
+      }
+      PUSH(a);
+      PUSH(b);
+      if (!IS_STRING(a) || !IS_STRING(b)) {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
+      }
+      STORE_FRAME();
+      concatenate();
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE(OP_LESS_LC_JIF) {
+      Value a = slots[READ_BYTE()];
+      Value b = READ_CONSTANT();
+      uint16_t offset = READ_SHORT();
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+        RUNTIME_ERROR("Operands must be numbers.");
+      }
+      if (!(AS_NUMBER(a) < AS_NUMBER(b))) {
+        PUSH(BOOL_VAL(false)); // the condition the jump target pops
+        ip += offset;
+      }
+      DISPATCH();
+    }
+    CASE(OP_LESS_LL_JIF) {
+      Value a = slots[READ_BYTE()];
+      Value b = slots[READ_BYTE()];
+      uint16_t offset = READ_SHORT();
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+        RUNTIME_ERROR("Operands must be numbers.");
+      }
+      if (!(AS_NUMBER(a) < AS_NUMBER(b))) {
+        PUSH(BOOL_VAL(false));
+        ip += offset;
+      }
+      DISPATCH();
+    }
+    CASE(OP_SET_LOCAL_POP) {
+      uint8_t slot = READ_BYTE();
+      slots[slot] = POP();
+      DISPATCH();
+    }
+    CASE(OP_POPN) {
+      sp -= READ_BYTE();
+      DISPATCH();
+    }
+    CASE(OP_NOT) {
+      PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
+      DISPATCH();
+    }
+    CASE(OP_NEGATE) {
+      if (!IS_NUMBER(PEEK(0))) { // check is the value right about in the stack
+                                 // is a number...
+        RUNTIME_ERROR("Operant must be a number.");
+      }
+
+      PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+      DISPATCH();
+    }
+    CASE(OP_PRINT) {
+      printValue(POP());
+      printf("\n");
+      DISPATCH();
+    }
+    // Note that if OP_JUMP_IF_FALSE increaes the vm.ip's count, it's directly
+    // set to be inside the else condition so it will skip this bytecode
+    CASE(OP_JUMP) {
+      uint16_t offset = READ_SHORT();
+      ip += offset;
+      DISPATCH();
+    }
+    // Here this jump instruction does not automaticaly pops condition value, we
     // still need to operate on that
-    case OP_JUMP_IF_FALSE: {
+    CASE(OP_JUMP_IF_FALSE) {
       uint16_t offset = READ_SHORT();
-      if (isFalsey(peek(0)))
-        frame->ip += offset;
-      break;
+      if (isFalsey(PEEK(0)))
+        ip += offset;
+      DISPATCH();
     }
-    case OP_LOOP: {
+    CASE(OP_LOOP) {
       uint16_t offset = READ_SHORT();
-      frame->ip -= offset;
-      break;
+      ip -= offset;
+      ENTER_JIT();
+      DISPATCH();
+    }
+    CASE(OP_CALL) {
+      int argCount = READ_BYTE();
+      CALL_VALUE(argCount);
+    }
+    CASE(OP_CALL_0) {
+      CALL_VALUE(0);
+    }
+    CASE(OP_CALL_1) {
+      CALL_VALUE(1);
     }
-    case OP_CALL: {
+    CASE(OP_CALL_2) {
+      CALL_VALUE(2);
+    }
+    CASE(OP_CALL_3) {
+      CALL_VALUE(3);
+    }
+    CASE(OP_TAIL_CALL) {
       int argCount = READ_BYTE();
-      if (!callValue(peek(argCount), argCount)) {
+      bool reused;
+      STORE_FRAME();
+      if (!tailCall(argCount, &reused)) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      LOAD_FRAME();
+      if (reused) {
+        SWITCH_IF_REGISTER_FRAME();
+        ENTER_JIT();
+      }
+      DISPATCH();
     }
-    case OP_INVOKE: {
+    // With a cache hit the receiver's shape already told us which closure
+    // name resolves to, so we go straight to call() without touching either
+    // the fields or the methods table
+    CASE(OP_INVOKE) {
       ObjString *method = READ_STRING();
       int argCount = READ_BYTE();
-      if (!invoke(method, argCount)) {
+      PropertyCache *cache = READ_CACHE();
+      Value receiver = PEEK(argCount);
+      if (IS_INSTANCE(receiver) && AS_INSTANCE(receiver)->shape != NULL) {
+        ObjShape *shape = AS_INSTANCE(receiver)->shape;
+        for (int i = 0; i < PROPERTY_CACHE_WAYS; i++) {
+          PropertyCacheEntry *entry = &cache->entries[i];
+          if (entry->shape == shape && entry->slot < 0) {
+            STORE_FRAME();
+            if (!call(entry->method, argCount)) {
+              return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            SWITCH_IF_REGISTER_FRAME();
+            ENTER_JIT();
+            DISPATCH();
+          }
+        }
+      }
+      STORE_FRAME();
+      if (!invoke(method, argCount, cache)) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      LOAD_FRAME();
+      SWITCH_IF_REGISTER_FRAME();
+      ENTER_JIT();
+      DISPATCH();
     }
-    case OP_CLOSURE: {
+    CASE(OP_CLOSURE) {
       ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+      STORE_FRAME();
       ObjClosure *closure = newClosure(function);
       push(OBJ_VAL(closure));
       for (int i = 0; i < closure->upvalueCount; i++) {
         uint8_t isLocal = READ_BYTE();
         uint8_t index = READ_BYTE();
-        if (isLocal) {
-          closure->upvalues[i] =
-              captureUpvalue((Value *)(vm.stack + frame->slots + index));
-        } else {
-          closure->upvalues[i] = frame->closure->upvalues[index];
-        }
+        ObjUpvalue *upvalue =
+            isLocal ? captureUpvalue(vm.stack + frame->slots + index)
+                    : frame->closure->upvalues[index];
+        // capturing allocates, the closure may be old by now, or in the
+        // middle of a concurrent collection
+        snapshotBarrier(&closure->obj);
+        closure->upvalues[i] = upvalue;
+        writeBarrier(&closure->obj, OBJ_VAL(upvalue));
       }
-      break;
+      frame->ip = ip;
+      LOAD_FRAME();
+      DISPATCH();
     }
-    case OP_CLOSE_UPVALUE: { // it's emitted right before end of the function
+    CASE(OP_CLOSE_UPVALUE) { // it's emitted right before end of the function
                              // call where the the local equivalent of our
                              // upvalue lives
-      closeUpvalues(vm.stack + vm.stack_count - 1);
-      pop();
-      break;
+      closeUpvalues(sp - 1);
+      sp--;
+      DISPATCH();
+    }
+    CASE(OP_RETURN) {
+      Value result = POP();
+      RETURN(result);
+    }
+    CASE(OP_RETURN_NIL) {
+      RETURN(NIL_VAL);
+    }
+    CASE(OP_RETURN_LOCAL) {
+      Value result = slots[READ_BYTE()];
+      RETURN(result);
+    }
+    CASE(OP_CLASS) {
+      ObjString *name = READ_STRING();
+      STORE_FRAME();
+      push(OBJ_VAL(newClass(name)));
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE(OP_METHOD) {
+      ObjString *name = READ_STRING();
+      STORE_FRAME();
+      defineMethod(name);
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE(OP_INHERIT) {
+      STORE_FRAME();
+      if (!inherit()) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE(OP_GET_SUPER) {
+      ObjString *name = READ_STRING();
+      ObjClass *superclass = AS_CLASS(POP());
+      STORE_FRAME();
+      if (!bindMethod(superclass, name, NULL)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    // The superclass is fixed by where the code is, so the cache is keyed by
+    // it (its root shape) instead of the receiver's shape, and a hit calls
+    // the method it remembered straight away
+    CASE(OP_SUPER_INVOKE) {
+      ObjString *method = READ_STRING();
+      int argCount = READ_BYTE();
+      PropertyCache *cache = READ_CACHE();
+      ObjClass *superclass = AS_CLASS(POP());
+      ObjClosure *closure = NULL;
+      for (int i = 0; i < PROPERTY_CACHE_WAYS; i++) {
+        PropertyCacheEntry *entry = &cache->entries[i];
+        if (entry->shape == superclass->rootShape) {
+          closure = entry->method;
+          break;
+        }
+      }
+      STORE_FRAME();
+      if (!(closure != NULL ? call(closure, argCount)
+                            : superInvoke(superclass, method, argCount, cache))) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_FRAME();
+      SWITCH_IF_REGISTER_FRAME();
+      ENTER_JIT();
+      DISPATCH();
+    }
+    UNKNOWN_OPCODE {
+      RUNTIME_ERROR("Unknown opcode %d.", instruction);
+    }
+  }
+#ifdef COMPUTED_GOTO
+op_COUNT:
+  recordOp(frame->closure->function, instruction);
+  goto *dispatchTable[instruction];
+#endif
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_CONSTANT
+#undef READ_STRING
+#undef READ_CACHE
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef RUNTIME_ERROR
+#undef SWITCH_IF_REGISTER_FRAME
+#undef ENTER_JIT
+#undef CALL_VALUE
+#undef RETURN
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef BINARY_OP
+#undef NUMBER_OP
+#undef TRACE_INSTRUCTION
+#undef COUNT_DISPATCH
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
+#undef UNKNOWN_OPCODE
+}
+
+/**
+ * run() for frames whose function was translated to register code (see
+ * regcode.c). Every operand names a register, i.e a slot of the frame, so
+ * nothing gets pushed or popped except around calls, and vm.stack_count stays
+ * right above the frame's last register the whole time.
+ *
+ * Calls into (and returns to) frames with stack code can't go on in here,
+ * those hand back to interpret() with INTERPRET_SWITCH, which picks run() for
+ * the new top frame. run() does the same the other way around.
+ *
+ * @return InterpretResult
+ */
+static InterpretResult run_reg() {
+  CallFrame *frame;
+  uint8_t *ip;
+  Value *slots; // register 0
+  Value *constants;
+
+#define STORE_FRAME() (frame->ip = ip)
+
+  // besides reloading, puts the stack top back above the frame's registers
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    frame = &vm.frames[vm.frameCount - 1];                                     \
+    ip = frame->ip;                                                            \
+    slots = vm.stack + frame->slots;                                           \
+    constants = frame->closure->function->chunk.constants.values;              \
+    vm.stack_count =                                                           \
+        frame->slots + frame->closure->function->chunk.maxRegisters;           \
+  } while (false)
+
+  LOAD_FRAME();
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8 | ip[-1])))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+// the register named by the next byte
+#define READ_REGISTER() (slots[READ_BYTE()])
+
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    STORE_FRAME();                                                             \
+    runtimeError(__VA_ARGS__);                                                 \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
+
+/**
+ * dst = a op b, b being read with readB, so the same macro does the register
+ * and the constant (_K) forms
+ */
+#define BINARY_OP(valueType, op, readB)                                        \
+  do {                                                                         \
+    uint8_t dst = READ_BYTE();                                                 \
+    Value a = READ_REGISTER();                                                 \
+    Value b = readB;                                                           \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                                      \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    slots[dst] = valueType(AS_NUMBER(a) op AS_NUMBER(b));                      \
+  } while (false)
+
+// both operands stay in their registers/constants while joinStrings()
+// allocates, and the stack's reloaded after since interning can push
+#define ADD_OP(readB)                                                          \
+  do {                                                                         \
+    uint8_t dst = READ_BYTE();                                                 \
+    Value a = READ_REGISTER();                                                 \
+    Value b = readB;                                                           \
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {                                        \
+      slots[dst] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));                    \
+    } else if (IS_STRING(a) && IS_STRING(b)) {                                 \
+      STORE_FRAME();                                                           \
+      ObjString *result = joinStrings(AS_STRING(a), AS_STRING(b));             \
+      LOAD_FRAME();                                                            \
+      slots[dst] = OBJ_VAL(result);                                            \
+    } else {                                                                   \
+      RUNTIME_ERROR("Operands must be two numbers or two strings.");           \
+    }                                                                          \
+  } while (false)
+
+#define EQUAL_OP(readB)                                                        \
+  do {                                                                         \
+    uint8_t dst = READ_BYTE();                                                 \
+    Value a = READ_REGISTER();                                                 \
+    Value b = readB;                                                           \
+    slots[dst] = BOOL_VAL(valuesEqual(a, b));                                  \
+  } while (false)
+
+// same as run()'s, except it's the frame's registers that get printed
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION()                                                    \
+  do {                                                                         \
+    printf("    ");                                                            \
+    for (Value *slot = slots; slot < vm.stack + vm.stack_count; slot++) {      \
+      printf("[ ");                                                            \
+      printValue(*slot);                                                       \
+      printf(" ]");                                                            \
+    }                                                                          \
+    printf("\n");                                                              \
+    disassembleInstruction(                                                    \
+        &frame->closure->function->chunk,                                      \
+        (int)(ip - frame->closure->function->chunk.code));                     \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION()                                                    \
+  do {                                                                         \
+  } while (false)
+#endif
+
+#ifdef DEBUG_COUNT_DISPATCH
+#define COUNT_DISPATCH() (dispatchCount++)
+#else
+#define COUNT_DISPATCH()                                                       \
+  do {                                                                         \
+  } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+  static void *dispatchTable[UINT8_COUNT] = {
+      [0 ... UINT8_MAX] = &&op_UNKNOWN,
+      [OP_R_MOVE] = &&op_OP_R_MOVE,
+      [OP_R_LOADK] = &&op_OP_R_LOADK,
+      [OP_R_NIL] = &&op_OP_R_NIL,
+      [OP_R_TRUE] = &&op_OP_R_TRUE,
+      [OP_R_FALSE] = &&op_OP_R_FALSE,
+      [OP_R_GET_GLOBAL] = &&op_OP_R_GET_GLOBAL,
+      [OP_R_DEFINE_GLOBAL] = &&op_OP_R_DEFINE_GLOBAL,
+      [OP_R_SET_GLOBAL] = &&op_OP_R_SET_GLOBAL,
+      [OP_R_GET_UPVALUE] = &&op_OP_R_GET_UPVALUE,
+      [OP_R_SET_UPVALUE] = &&op_OP_R_SET_UPVALUE,
+      [OP_R_EQUAL] = &&op_OP_R_EQUAL,
+      [OP_R_EQUAL_K] = &&op_OP_R_EQUAL_K,
+      [OP_R_GREATER] = &&op_OP_R_GREATER,
+      [OP_R_GREATER_K] = &&op_OP_R_GREATER_K,
+      [OP_R_LESS] = &&op_OP_R_LESS,
+      [OP_R_LESS_K] = &&op_OP_R_LESS_K,
+      [OP_R_ADD] = &&op_OP_R_ADD,
+      [OP_R_ADD_K] = &&op_OP_R_ADD_K,
+      [OP_R_SUBTRACT] = &&op_OP_R_SUBTRACT,
+      [OP_R_SUBTRACT_K] = &&op_OP_R_SUBTRACT_K,
+      [OP_R_MULTIPLY] = &&op_OP_R_MULTIPLY,
+      [OP_R_MULTIPLY_K] = &&op_OP_R_MULTIPLY_K,
+      [OP_R_DIVIDE] = &&op_OP_R_DIVIDE,
+      [OP_R_DIVIDE_K] = &&op_OP_R_DIVIDE_K,
+      [OP_R_NOT] = &&op_OP_R_NOT,
+      [OP_R_NEGATE] = &&op_OP_R_NEGATE,
+      [OP_R_PRINT] = &&op_OP_R_PRINT,
+      [OP_R_JUMP] = &&op_OP_R_JUMP,
+      [OP_R_JUMP_IF_FALSE] = &&op_OP_R_JUMP_IF_FALSE,
+      [OP_R_LOOP] = &&op_OP_R_LOOP,
+      [OP_R_CALL] = &&op_OP_R_CALL,
+      [OP_R_CLOSURE] = &&op_OP_R_CLOSURE,
+      [OP_R_CLOSE_UPVALUE] = &&op_OP_R_CLOSE_UPVALUE,
+      [OP_R_RETURN] = &&op_OP_R_RETURN,
+  };
+  // clox --opstats, the same as in run()
+  static void *countTable[UINT8_COUNT] = {[0 ... UINT8_MAX] = &&op_COUNT};
+  void **dispatch = vm.opStats ? countTable : dispatchTable;
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(opcode) op_##opcode:
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    TRACE_INSTRUCTION();                                                       \
+    COUNT_DISPATCH();                                                          \
+    goto *dispatch[instruction = READ_BYTE()];                                 \
+  } while (false)
+#define UNKNOWN_OPCODE op_UNKNOWN:
+#else
+#define INTERPRET_LOOP                                                         \
+  dispatch:                                                                    \
+  TRACE_INSTRUCTION();                                                         \
+  COUNT_DISPATCH();                                                            \
+  instruction = READ_BYTE();                                                   \
+  if (vm.opStats)                                                              \
+    recordOp(frame->closure->function, instruction);                           \
+  switch (instruction)
+#define CASE(opcode) case opcode:
+#define DISPATCH() goto dispatch
+#define UNKNOWN_OPCODE default:
+#endif
+
+  uint8_t instruction;
+  INTERPRET_LOOP {
+    CASE(OP_R_MOVE) {
+      uint8_t dst = READ_BYTE();
+      slots[dst] = READ_REGISTER();
+      DISPATCH();
+    }
+    CASE(OP_R_LOADK) {
+      uint8_t dst = READ_BYTE();
+      slots[dst] = READ_CONSTANT();
+      DISPATCH();
+    }
+    CASE(OP_R_NIL) {
+      READ_REGISTER() = NIL_VAL;
+      DISPATCH();
+    }
+    CASE(OP_R_TRUE) {
+      READ_REGISTER() = BOOL_VAL(true);
+      DISPATCH();
+    }
+    CASE(OP_R_FALSE) {
+      READ_REGISTER() = BOOL_VAL(false);
+      DISPATCH();
+    }
+    CASE(OP_R_GET_GLOBAL) {
+      uint8_t dst = READ_BYTE();
+      uint16_t slot = READ_SHORT();
+      Value value = vm.globalValues.values[slot];
+      if (IS_EMPTY(value)) {
+        RUNTIME_ERROR("Undefined variable '%s'",
+                      AS_CSTRING(vm.globalNames.values[slot]));
+      }
+      slots[dst] = value;
+      DISPATCH();
+    }
+    CASE(OP_R_DEFINE_GLOBAL) {
+      Value value = READ_REGISTER();
+      vm.globalValues.values[READ_SHORT()] = value;
+      DISPATCH();
+    }
+    CASE(OP_R_SET_GLOBAL) {
+      Value value = READ_REGISTER();
+      uint16_t slot = READ_SHORT();
+      if (IS_EMPTY(vm.globalValues.values[slot])) {
+        RUNTIME_ERROR("Undefined variable '%s'.",
+                      AS_CSTRING(vm.globalNames.values[slot]));
+      }
+      vm.globalValues.values[slot] = value;
+      DISPATCH();
+    }
+    CASE(OP_R_GET_UPVALUE) {
+      uint8_t dst = READ_BYTE();
+      slots[dst] = *frame->closure->upvalues[READ_BYTE()]->location;
+      DISPATCH();
+    }
+    CASE(OP_R_SET_UPVALUE) {
+      Value value = READ_REGISTER();
+      ObjUpvalue *upvalue = frame->closure->upvalues[READ_BYTE()];
+      snapshotBarrier(&upvalue->obj);
+      *upvalue->location = value;
+      writeBarrier(&upvalue->obj, value);
+      DISPATCH();
+    }
+    CASE(OP_R_EQUAL) {
+      EQUAL_OP(READ_REGISTER());
+      DISPATCH();
+    }
+    CASE(OP_R_EQUAL_K) {
+      EQUAL_OP(READ_CONSTANT());
+      DISPATCH();
+    }
+    CASE(OP_R_GREATER) {
+      BINARY_OP(BOOL_VAL, >, READ_REGISTER());
+      DISPATCH();
+    }
+    CASE(OP_R_GREATER_K) {
+      BINARY_OP(BOOL_VAL, >, READ_CONSTANT());
+      DISPATCH();
+    }
+    CASE(OP_R_LESS) {
+      BINARY_OP(BOOL_VAL, <, READ_REGISTER());
+      DISPATCH();
+    }
+    CASE(OP_R_LESS_K) {
+      BINARY_OP(BOOL_VAL, <, READ_CONSTANT());
+      DISPATCH();
+    }
+    CASE(OP_R_ADD) {
+      ADD_OP(READ_REGISTER());
+      DISPATCH();
+    }
+    CASE(OP_R_ADD_K) {
+      ADD_OP(READ_CONSTANT());
+      DISPATCH();
+    }
+    CASE(OP_R_SUBTRACT) {
+      BINARY_OP(NUMBER_VAL, -, READ_REGISTER());
+      DISPATCH();
     }
-    case OP_RETURN: {
-      Value result = pop();
-      closeUpvalues((Value *)(vm.stack + frame->slots));
+    CASE(OP_R_SUBTRACT_K) {
+      BINARY_OP(NUMBER_VAL, -, READ_CONSTANT());
+      DISPATCH();
+    }
+    CASE(OP_R_MULTIPLY) {
+      BINARY_OP(NUMBER_VAL, *, READ_REGISTER());
+      DISPATCH();
+    }
+    CASE(OP_R_MULTIPLY_K) {
+      BINARY_OP(NUMBER_VAL, *, READ_CONSTANT());
+      DISPATCH();
+    }
+    CASE(OP_R_DIVIDE) {
+      BINARY_OP(NUMBER_VAL, /, READ_REGISTER());
+      DISPATCH();
+    }
+    CASE(OP_R_DIVIDE_K) {
+      BINARY_OP(NUMBER_VAL, /, READ_CONSTANT());
+      DISPATCH();
+    }
+    CASE(OP_R_NOT) {
+      uint8_t dst = READ_BYTE();
+      slots[dst] = BOOL_VAL(isFalsey(READ_REGISTER()));
+      DISPATCH();
+    }
+    CASE(OP_R_NEGATE) {
+      uint8_t dst = READ_BYTE();
+      Value value = READ_REGISTER();
+      if (!IS_NUMBER(value)) {
+        RUNTIME_ERROR("Operant must be a number.");
+      }
+      slots[dst] = NUMBER_VAL(-AS_NUMBER(value));
+      DISPATCH();
+    }
+    CASE(OP_R_PRINT) {
+      printValue(READ_REGISTER());
+      printf("\n");
+      DISPATCH();
+    }
+    CASE(OP_R_JUMP) {
+      uint16_t offset = READ_SHORT();
+      ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_R_JUMP_IF_FALSE) {
+      Value condition = READ_REGISTER();
+      uint16_t offset = READ_SHORT();
+      if (isFalsey(condition))
+        ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_R_LOOP) {
+      uint16_t offset = READ_SHORT();
+      ip -= offset;
+      DISPATCH();
+    }
+    // the callee and its args sit in registers base..base + argCount, which
+    // is exactly where a new frame expects them once the stack top is moved
+    // down to right above the last arg
+    CASE(OP_R_CALL) {
+      uint8_t base = READ_BYTE();
+      int argCount = READ_BYTE();
+      STORE_FRAME();
+      vm.stack_count = frame->slots + base + argCount + 1;
+      if (!callValue(slots[base], argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      if (!isRegisterFrame(&vm.frames[vm.frameCount - 1])) {
+        return INTERPRET_SWITCH;
+      }
+      LOAD_FRAME(); // also moves the top back up if nothing got pushed
+      DISPATCH();
+    }
+    CASE(OP_R_CLOSURE) {
+      uint8_t dst = READ_BYTE();
+      ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+      ObjClosure *closure = newClosure(function);
+      slots[dst] = OBJ_VAL(closure); // a root before capturing allocates
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = READ_BYTE();
+        uint8_t index = READ_BYTE();
+        ObjUpvalue *upvalue = isLocal ? captureUpvalue(slots + index)
+                                      : frame->closure->upvalues[index];
+        snapshotBarrier(&closure->obj);
+        closure->upvalues[i] = upvalue;
+        writeBarrier(&closure->obj, OBJ_VAL(upvalue));
+      }
+      DISPATCH();
+    }
+    CASE(OP_R_CLOSE_UPVALUE) {
+      closeUpvalues(&READ_REGISTER());
+      DISPATCH();
+    }
+    CASE(OP_R_RETURN) {
+      Value result = READ_REGISTER();
+      closeUpvalues(slots);
       vm.frameCount--;
       if (vm.frameCount == 0) {
-        pop();
+        vm.stack_count = 0;
         return INTERPRET_OK;
       }
 
-      vm.stack_count = frame->slots;
-      push(result);
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
-    }
-    case OP_CLASS: {
-      push(OBJ_VAL(newClass(READ_STRING())));
-      break;
-    }
-    case OP_METHOD: {
-      defineMethod(READ_STRING());
-      break;
+      *slots = result;
+      vm.stack_count = (int)(slots - vm.stack) + 1;
+      if (!isRegisterFrame(&vm.frames[vm.frameCount - 1])) {
+        return INTERPRET_SWITCH;
+      }
+      LOAD_FRAME();
+      DISPATCH();
     }
+    UNKNOWN_OPCODE {
+      RUNTIME_ERROR("Unknown opcode %d.", instruction);
     }
   }
+#ifdef COMPUTED_GOTO
+op_COUNT:
+  recordOp(frame->closure->function, instruction);
+  goto *dispatchTable[instruction];
+#endif
+#undef STORE_FRAME
+#undef LOAD_FRAME
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
-#undef READ_STRING
+#undef READ_REGISTER
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef ADD_OP
+#undef EQUAL_OP
+#undef TRACE_INSTRUCTION
+#undef COUNT_DISPATCH
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
+#undef UNKNOWN_OPCODE
 }
 /**
  * The core of the interpreter, compiler + vm
@@ -683,5 +2007,286 @@ InterpretResult interpret(const char *source) {
   pop();
   push(OBJ_VAL(closure));
   call(closure, 0);
-  return run();
+#ifdef DEBUG_COUNT_DISPATCH
+  dispatchCount = 0;
+#endif
+
+  // run() and run_reg() take turns whenever a call or a return crosses
+  // from one kind of code into the other
+  InterpretResult result;
+  do {
+    result = isRegisterFrame(&vm.frames[vm.frameCount - 1]) ? run_reg()
+                                                            : run();
+  } while (result == INTERPRET_SWITCH);
+#ifdef DEBUG_COUNT_DISPATCH
+  fprintf(stderr, "dispatched %llu instructions\n",
+          (unsigned long long)dispatchCount);
+#endif
+  return result;
+}
+
+// ---- Running functions compiled ahead of time (clox --emit-c) ----
+//
+// The C that emitc.c writes does a function's own stack shuffling and
+// arithmetic inline, everything else goes through these. A call pushes the
+// callee's frame the usual way (callValue()/call()) and then runs its C body
+// right away, so the C stack mirrors vm.frames (tail calls aside, see
+// runCompiled()).
+
+/**
+ * Runs the top frame's C body until the frame returns. A body that hands its
+ * frame to a tail call (aotTailCall()) returns with the frame still there, to
+ * have it run again here with the callee's body, which keeps the C stack flat
+ * no matter how long the chain of tail calls
+ */
+static bool runCompiled() {
+  int frameCount = vm.frameCount;
+  do {
+    // looked up every time, the calls in the body can move vm.frames
+    CallFrame *frame = &vm.frames[frameCount - 1];
+    if (!frame->closure->function->compiled(frame))
+      return false;
+  } while (vm.frameCount == frameCount);
+  return true;
+}
+
+// Every compiled call nests on the C stack, which can run out before
+// vm.frames does, so calls check how much of it is left as well
+static uintptr_t cStackBase;
+static size_t cStackRoom;
+
+/**
+ * Runs the body of the frame a call just pushed, if it pushed one (natives
+ * and classes without init are already done by then)
+ */
+static bool runCompiledCallee(int frameCount) {
+  if (vm.frameCount == frameCount)
+    return true;
+  char here;
+  if (cStackBase - (uintptr_t)&here > cStackRoom) {
+    runtimeError("Stack Overflow.");
+    return false;
+  }
+  return runCompiled();
+}
+
+InterpretResult aotInterpret(ObjFunction *script, size_t stackRoom) {
+  char base;
+  cStackBase = (uintptr_t)&base;
+  cStackRoom = stackRoom;
+
+  push(OBJ_VAL(script));
+  ObjClosure *closure = newClosure(script);
+  pop();
+  push(OBJ_VAL(closure));
+  call(closure, 0);
+  return runCompiled() ? INTERPRET_OK : INTERPRET_RUNTIME_ERROR;
+}
+
+/**
+ * OP_CALL, with the callee and its arguments on top of the stack
+ */
+bool aotCall(int argCount) {
+  int frameCount = vm.frameCount;
+  if (!callValue(peek(argCount), argCount))
+    return false;
+  return runCompiledCallee(frameCount);
+}
+
+/**
+ * OP_TAIL_CALL, see tailCall(). When the frame's reused the generated code
+ * returns right away and runCompiled() goes on with the callee's body
+ */
+bool aotTailCall(int argCount, bool *reused) {
+  return tailCall(argCount, reused);
+}
+
+/**
+ * OP_INVOKE, with the receiver and the arguments on top of the stack
+ */
+bool aotInvoke(ObjString *name, int argCount, PropertyCache *cache) {
+  int frameCount = vm.frameCount;
+  Value receiver = peek(argCount);
+  if (IS_INSTANCE(receiver) && AS_INSTANCE(receiver)->shape != NULL) {
+    ObjShape *shape = AS_INSTANCE(receiver)->shape;
+    for (int i = 0; i < PROPERTY_CACHE_WAYS; i++) {
+      PropertyCacheEntry *entry = &cache->entries[i];
+      if (entry->shape == shape && entry->slot < 0) {
+        if (!call(entry->method, argCount))
+          return false;
+        return runCompiledCallee(frameCount);
+      }
+    }
+  }
+  if (!invoke(name, argCount, cache))
+    return false;
+  return runCompiledCallee(frameCount);
+}
+
+/**
+ * OP_SUPER_INVOKE, with this, the arguments and the superclass on top of the
+ * stack
+ */
+bool aotSuperInvoke(ObjString *name, int argCount, PropertyCache *cache) {
+  int frameCount = vm.frameCount;
+  ObjClass *superclass = AS_CLASS(pop());
+  for (int i = 0; i < PROPERTY_CACHE_WAYS; i++) {
+    PropertyCacheEntry *entry = &cache->entries[i];
+    if (entry->shape == superclass->rootShape) {
+      if (!call(entry->method, argCount))
+        return false;
+      return runCompiledCallee(frameCount);
+    }
+  }
+  if (!superInvoke(superclass, name, argCount, cache))
+    return false;
+  return runCompiledCallee(frameCount);
+}
+
+/**
+ * OP_GET_PROPERTY on the instance on top of the stack
+ */
+bool aotGetProperty(ObjString *name, PropertyCache *cache) {
+  if (!IS_INSTANCE(peek(0))) {
+    runtimeError("Only instances have property.");
+    return false;
+  }
+  ObjInstance *instance = AS_INSTANCE(peek(0));
+  ObjShape *shape = instance->shape;
+  Value *top = &vm.stack[vm.stack_count - 1];
+
+  if (shape != NULL) {
+    for (int i = 0; i < PROPERTY_CACHE_WAYS; i++) {
+      PropertyCacheEntry *entry = &cache->entries[i];
+      if (entry->shape != shape)
+        continue;
+      if (entry->slot >= 0) {
+        *top = instance->fields[entry->slot];
+        return true;
+      }
+      ObjBoundMethod *bound = newBoundMethod(*top, entry->method);
+      *top = OBJ_VAL(bound);
+      return true;
+    }
+
+    int slot = shapeFindSlot(shape, name);
+    if (slot != -1) {
+      fillCache(cache, shape, slot, NULL, NULL);
+      *top = instance->fields[slot];
+      return true;
+    }
+  } else {
+    Value value;
+    if (tableGet(instance->dictionary, name, &value)) {
+      *top = value;
+      return true;
+    }
+  }
+  return bindMethod(instance->klass, name, cache);
+}
+
+/**
+ * OP_SET_PROPERTY, instance and value on top of the stack, leaves the value
+ */
+bool aotSetProperty(ObjString *name, PropertyCache *cache) {
+  if (!IS_INSTANCE(peek(1))) {
+    runtimeError("Only instances have property.");
+    return false;
+  }
+  ObjInstance *instance = AS_INSTANCE(peek(1));
+  ObjShape *shape = instance->shape;
+  Value value = peek(0);
+
+  if (shape != NULL) {
+    snapshotBarrier(&instance->obj);
+    for (int i = 0; i < PROPERTY_CACHE_WAYS; i++) {
+      PropertyCacheEntry *entry = &cache->entries[i];
+      if (entry->shape != shape)
+        continue;
+      if (entry->transition == NULL) {
+        instance->fields[entry->slot] = value;
+        writeBarrier(&instance->obj, value);
+        goto done;
+      }
+      if (entry->slot < instance->fieldCapacity) {
+        instance->fields[entry->slot] = value;
+        instance->shape = entry->transition;
+        writeBarrier(&instance->obj, value);
+        writeBarrier(&instance->obj, OBJ_VAL(entry->transition));
+        goto done;
+      }
+      break;
+    }
+  }
+
+  // the value's still on the stack, in case this runs the GC
+  instanceSetField(instance, name, value);
+  if (shape != NULL && instance->shape != NULL) {
+    fillCache(cache, shape, shapeFindSlot(instance->shape, name),
+              instance->shape == shape ? NULL : instance->shape, NULL);
+  }
+done:
+  pop();
+  vm.stack[vm.stack_count - 1] = value;
+  return true;
+}
+
+/**
+ * OP_ADD on two strings on top of the stack, the type checks are the
+ * caller's
+ */
+void aotConcatenate() { concatenate(); }
+
+/**
+ * OP_METHOD, with the class and the method's closure on top of the stack
+ */
+void aotDefineMethod(ObjString *name) { defineMethod(name); }
+
+/**
+ * OP_INHERIT, see inherit()
+ */
+bool aotInherit() { return inherit(); }
+
+/**
+ * OP_GET_SUPER, with this and the superclass on top of the stack
+ */
+bool aotGetSuper(ObjString *name) {
+  ObjClass *superclass = AS_CLASS(pop());
+  return bindMethod(superclass, name, NULL);
+}
+
+ObjUpvalue *aotCaptureUpvalue(Value *local) { return captureUpvalue(local); }
+
+void aotCloseUpvalues(Value *last) { closeUpvalues(last); }
+
+/**
+ * OP_RETURN: pops frame, with result in the caller's slot for the callee
+ *
+ * @return bool always true, so the generated code can return it
+ */
+bool aotReturn(CallFrame *frame, Value result) {
+  closeUpvalues(vm.stack + frame->slots);
+  vm.frameCount--;
+  if (vm.frameCount == 0) {
+    vm.stack_count = 0;
+    return true;
+  }
+  vm.stack[frame->slots] = result;
+  vm.stack_count = frame->slots + 1;
+  return true;
+}
+
+/**
+ * runtimeError() for the generated code
+ *
+ * @return bool always false, so the generated code can return it
+ */
+bool aotError(const char *format, ...) {
+  char message[1024];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  runtimeError("%s", message);
+  return false;
 }